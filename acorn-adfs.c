@@ -9,6 +9,8 @@
 #define DIR_ENT_SIZE  0x1A
 #define DIR_FTR_SIZE  0x35
 
+#define COUNT(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
 typedef struct extent extent;
 
 struct extent {
@@ -18,6 +20,30 @@ struct extent {
     char *name;
 };
 
+/*
+ * Directories are cached by start sector for as long as the image is
+ * open.  Updates are written through unless the filesystem is in
+ * deferred mode, in which case they are marked dirty and written,
+ * together with the free space map, by adfs_sync.
+ */
+
+typedef struct adfs_dir adfs_dir;
+
+struct adfs_dir {
+    adfs_dir *next;
+    unsigned sector;
+    unsigned length;
+    bool     dirty;
+    unsigned char data[];
+};
+
+typedef struct {
+    unsigned char fsmap[FSMAP_SIZE];
+    bool     map_valid;
+    bool     map_dirty;
+    adfs_dir *dirs;
+} adfs_priv;
+
 typedef struct {
     acorn_fs *fs;
     const char *fsname;
@@ -65,11 +91,127 @@ static int adfs_load(acorn_fs *fs, acorn_fs_object *obj)
     unsigned char *data = malloc(obj->length);
     if (data) {
         obj->data = data;
-        return fs->rdsect(fs, obj->sector, data, obj->length);
+        return acorn_fs_rdsect(fs, obj->sector, data, obj->length);
     }
     return errno;
 }
 
+static adfs_priv *get_priv(acorn_fs *fs)
+{
+    adfs_priv *priv = fs->priv;
+    if (!priv) {
+        if ((priv = malloc(sizeof(adfs_priv)))) {
+            priv->map_valid = false;
+            priv->map_dirty = false;
+            priv->dirs = NULL;
+            fs->priv = priv;
+        }
+    }
+    return priv;
+}
+
+static adfs_dir *dir_lookup(adfs_priv *priv, unsigned sector, unsigned length)
+{
+    for (adfs_dir *ent = priv->dirs; ent; ent = ent->next)
+        if (ent->sector == sector && ent->length == length)
+            return ent;
+    return NULL;
+}
+
+static adfs_dir *dir_cache(adfs_priv *priv, acorn_fs_object *dir)
+{
+    adfs_dir *ent = dir_lookup(priv, dir->sector, dir->length);
+    if (!ent) {
+        if (!(ent = malloc(sizeof(adfs_dir) + dir->length)))
+            return NULL;
+        ent->sector = dir->sector;
+        ent->length = dir->length;
+        ent->dirty = false;
+        ent->next = priv->dirs;
+        priv->dirs = ent;
+    }
+    memcpy(ent->data, dir->data, dir->length);
+    return ent;
+}
+
+static void dir_forget(adfs_priv *priv, unsigned sector, unsigned size)
+{
+    adfs_dir **prev = &priv->dirs;
+    adfs_dir *ent;
+    while ((ent = *prev)) {
+        if (ent->sector >= sector && ent->sector < sector + size) {
+            *prev = ent->next;
+            free(ent);
+        }
+        else
+            prev = &ent->next;
+    }
+}
+
+/*
+ * Readers holding the handle shared may load directories and the map
+ * at the same time, so the cache itself is guarded by cache_lock.
+ * Writers hold the handle exclusive and need no more than that.
+ */
+
+static int load_dir(acorn_fs *fs, acorn_fs_object *dir)
+{
+    pthread_mutex_lock(&fs->cache_lock);
+    adfs_priv *priv = get_priv(fs);
+    if (!priv) {
+        int status = errno;
+        pthread_mutex_unlock(&fs->cache_lock);
+        return status;
+    }
+    adfs_dir *ent = dir_lookup(priv, dir->sector, dir->length);
+    if (ent) {
+        int status = AFS_OK;
+        if ((dir->data = malloc(dir->length))) {
+            memcpy(dir->data, ent->data, dir->length);
+            COUNT(fs->stats.dir_hits, 1);
+        }
+        else
+            status = errno;
+        pthread_mutex_unlock(&fs->cache_lock);
+        return status;
+    }
+    pthread_mutex_unlock(&fs->cache_lock);
+    int status;
+    COUNT(fs->stats.dir_loads, 1);
+    if ((status = adfs_load(fs, dir)) == AFS_OK) {
+        pthread_mutex_lock(&fs->cache_lock);
+        dir_cache(priv, dir); // failure to cache is not fatal.
+        pthread_mutex_unlock(&fs->cache_lock);
+    }
+    return status;
+}
+
+/*
+ * Deferred, the cached copy is the update.  Otherwise the cache takes
+ * the new directory only once it is on the disc, and forgets it if the
+ * write fails, so a failed update is not seen by later lookups.
+ */
+
+static int write_dir(acorn_fs *fs, acorn_fs_object *dir)
+{
+    adfs_priv *priv = fs->priv;
+    if (fs->deferred) {
+        adfs_dir *ent = dir_cache(priv, dir);
+        if (ent) {
+            ent->dirty = true;
+            fs->dirty = true;
+            return AFS_OK;
+        }
+    }
+    fs->stats.dir_writes++;
+    int status = acorn_fs_wrsect(fs, dir->sector, dir->data, dir->length);
+    if (status == AFS_OK)
+        dir_cache(priv, dir);
+    else
+        dir_forget(priv, dir->sector, 1);
+    return status;
+}
+
 static int check_dir(acorn_fs_object *dir)
 {
     unsigned char *data = dir->data;
@@ -151,7 +293,7 @@ static int search(acorn_fs *fs, acorn_fs_object *parent, acorn_fs_object *child,
 {
     if (!(parent->attr & AFS_ATTR_DIR))
         return ENOTDIR;
-    int status = adfs_load(fs, parent);
+    int status = load_dir(fs, parent);
     if (status == AFS_OK) {
         if ((status = check_dir(parent)) == AFS_OK) {
             unsigned char *ent = parent->data;
@@ -216,22 +358,25 @@ static int adfs_settitle(acorn_fs *fs, const char *title)
 {
     // In ADFS the title is 19 characters located at offset 0xD9
     // of the last sector in the root directory.
-    unsigned char buffer[ACORN_FS_SECT_SIZE];
     acorn_fs_object root;
     make_root(&root);
-    int ssect = root.sector + root.length / ACORN_FS_SECT_SIZE - 1;
-    fs->rdsect(fs, ssect, buffer, ACORN_FS_SECT_SIZE);
-    for (int i = 0; i < 19; i++) {
-        buffer[0xD9 + i] = (i < strlen(title)) ? title[i] : 0x0D;
+    int status = load_dir(fs, &root);
+    if (status == AFS_OK) {
+        unsigned char *buffer = root.data + root.length - ACORN_FS_SECT_SIZE;
+        for (int i = 0; i < 19; i++) {
+            buffer[0xD9 + i] = (i < strlen(title)) ? title[i] : 0x0D;
+        }
+        status = write_dir(fs, &root);
+        acorn_fs_free_obj(&root);
     }
-    return fs->wrsect(fs, ssect, buffer, ACORN_FS_SECT_SIZE);
+    return status;
 }
 
 static int glob_dir(acorn_fs *fs, acorn_fs_object *dir, const char *pattern, acorn_fs_cb cb, void *udata, char *path, unsigned path_posn)
 {
     if (!*pattern)
         return AFS_OK;
-    int status = adfs_load(fs, dir);
+    int status = load_dir(fs, dir);
     if (status == AFS_OK) {
         if ((status = check_dir(dir)) == AFS_OK) {
             unsigned char *ent = dir->data;
@@ -285,7 +430,7 @@ static int adfs_glob(acorn_fs *fs, acorn_fs_object *start, const char *pattern,
 
 static int walk_dir(acorn_fs *fs, acorn_fs_object *dir, acorn_fs_cb cb, void *udata, char *path, unsigned path_posn)
 {
-    int status = adfs_load(fs, dir);
+    int status = load_dir(fs, dir);
     if (status == AFS_OK) {
         if ((status = check_dir(dir)) == AFS_OK) {
             unsigned char *ent = dir->data;
@@ -345,31 +490,38 @@ static uint8_t checksum(uint8_t *base)
 static int load_fsmap(acorn_fs *fs)
 {
     int status = AFS_OK;
-    if (!fs->priv) {
-        unsigned char *fsmap = malloc(FSMAP_SIZE);
-        if (fsmap) {
-            if ((status = fs->rdsect(fs, 0, fsmap, FSMAP_SIZE)) == AFS_OK) {
-                if (checksum(fsmap) == fsmap[0xff] && checksum(fsmap + 0x100) == fsmap[0x1ff]) {
-                    fs->priv = fsmap;
-                    return status;
-                }
-                else
-                    status = AFS_BAD_FSMAP;
-            }
-            free(fsmap);
-        }
+    pthread_mutex_lock(&fs->cache_lock);
+    adfs_priv *priv = get_priv(fs);
+    if (!priv)
         status = errno;
+    else if (!priv->map_valid) {
+        unsigned char *fsmap = priv->fsmap;
+        COUNT(fs->stats.map_loads, 1);
+        if ((status = acorn_fs_rdsect(fs, 0, fsmap, FSMAP_SIZE)) == AFS_OK) {
+            if (checksum(fsmap) == fsmap[0xff] && checksum(fsmap + 0x100) == fsmap[0x1ff])
+                priv->map_valid = true;
+            else
+                status = AFS_BAD_FSMAP;
+        }
     }
+    pthread_mutex_unlock(&fs->cache_lock);
     return status;
 }
 
 static int save_fsmap(acorn_fs *fs)
 {
-    unsigned char *fsmap = fs->priv;
-    if (fsmap) {
+    adfs_priv *priv = fs->priv;
+    if (priv && priv->map_valid) {
+        unsigned char *fsmap = priv->fsmap;
+        if (fs->deferred) {
+            priv->map_dirty = true;
+            fs->dirty = true;
+            return AFS_OK;
+        }
         fsmap[0x0ff] = checksum(fsmap);
         fsmap[0x1ff] = checksum(fsmap + 0x100);
-        return fs->wrsect(fs, 0, fsmap, FSMAP_SIZE);
+        fs->stats.map_writes++;
+        return acorn_fs_wrsect(fs, 0, fsmap, FSMAP_SIZE);
     }
     return AFS_BUG;
 }
@@ -383,21 +535,38 @@ static unsigned sectors(unsigned bytes)
 
 static int map_free(acorn_fs *fs, acorn_fs_object *obj)
 {
-    unsigned char *fsmap = fs->priv;
+    adfs_priv *priv = fs->priv;
+    unsigned char *fsmap = priv->fsmap;
     unsigned char *sizes = fsmap + 0x100;
     int end = fsmap[0x1fe];
     int ent, bytes;
     uint32_t posn, size, obj_size;
 
     obj_size = sectors(obj->length);
+    if (!obj_size)
+        return AFS_OK;
+    dir_forget(priv, obj->sector, obj_size);
     for (ent = 0; ent < end; ent += 3) {
         posn = adfs_get24(fsmap + ent);
         size = adfs_get24(sizes + ent);
         if ((posn + size) == obj->sector) { // coallesce
             size += obj_size;
+            if (ent + 3 < end && adfs_get24(fsmap + ent + 3) == posn + size) {
+                // The object filled the gap between two free extents.
+                size += adfs_get24(sizes + ent + 3);
+                bytes = end - ent - 6;
+                memmove(fsmap + ent + 3, fsmap + ent + 6, bytes);
+                memmove(sizes + ent + 3, sizes + ent + 6, bytes);
+                fsmap[0x1fe] -= 3;
+            }
             adfs_put24(sizes + ent, size);
             return AFS_OK;
         }
+        if (posn == obj->sector + obj_size) { // coallesce with the one after.
+            adfs_put24(fsmap + ent, obj->sector);
+            adfs_put24(sizes + ent, size + obj_size);
+            return AFS_OK;
+        }
         if (posn > obj->sector) {
             if (end >= FSMAP_MAX_ENT * 3)
                 return AFS_MAP_FULL;
@@ -415,20 +584,25 @@ static int map_free(acorn_fs *fs, acorn_fs_object *obj)
     return AFS_OK;
 }
 
-static int alloc_write(acorn_fs *fs, acorn_fs_object *obj)
+/*
+ * Take obj_size sectors from the first free extent big enough for
+ * them and set *posn_ptr to where they start.  Only the map in memory
+ * changes; nothing is written to the space.
+ */
+
+static int map_alloc(acorn_fs *fs, uint32_t obj_size, uint32_t *posn_ptr)
 {
-    unsigned char *fsmap = fs->priv;
+    adfs_priv *priv = fs->priv;
+    unsigned char *fsmap = priv->fsmap;
     unsigned char *sizes = fsmap + 0x100;
     int end = fsmap[0x1fe];
     int ent, bytes;
-    uint32_t posn, size, obj_size;
+    uint32_t posn, size;
 
-    obj_size = sectors(obj->length);
     for (ent = 0; ent < end; ent += 3) {
         size = adfs_get24(sizes + ent);
         if (size >= obj_size) {
             posn = adfs_get24(fsmap + ent);
-            obj->sector = posn;
             if (size == obj_size) { // uses exact space so kill entry.
                 bytes = end - ent;
                 memmove(fsmap + ent, fsmap + ent + 3, bytes);
@@ -438,40 +612,71 @@ static int alloc_write(acorn_fs *fs, acorn_fs_object *obj)
                 adfs_put24(fsmap + ent, posn + obj_size);
                 adfs_put24(sizes + ent, size - obj_size);
             }
-            return fs->wrsect(fs, posn, obj->data, obj->length);
+            dir_forget(priv, posn, obj_size);
+            *posn_ptr = posn;
+            return AFS_OK;
         }
     }
     return ENOSPC;
 }
 
-static int dir_update(acorn_fs *fs, acorn_fs_object *parent, acorn_fs_object *child, unsigned char *ent)
+/*
+ * Allocate space for an object and write its contents, either from
+ * obj->data or, if src is not NULL, straight from the object's
+ * sectors in the source filesystem.
+ */
+
+static int alloc_write(acorn_fs *fs, acorn_fs_object *obj, acorn_fs *src)
 {
-    int e = 0, o = 0;
-    if (child->name[0] && child->name[1] == '.')
-        o += 2; // Discard DFS directory.
-    while (o < ADFS_MAX_NAME) {
-        int ch = child->name[o++] & 0x7f;
-        if (!ch)
-            break;
-        ent[e++] = ch;
+    uint32_t src_sect = obj->sector;
+    uint32_t posn;
+    int status = map_alloc(fs, sectors(obj->length), &posn);
+    if (status == AFS_OK) {
+        obj->sector = posn;
+        if (src)
+            return acorn_fs_xfer(fs, posn, src, src_sect, obj->length);
+        return acorn_fs_wrsect(fs, posn, obj->data, obj->length);
     }
-    while (e < ADFS_MAX_NAME)
-        ent[e++] = 0x0d;
-    unsigned a = child->attr;
-    if (a & AFS_ATTR_UREAD)  ent[0] |= 0x80;
-    if (a & AFS_ATTR_UWRITE) ent[1] |= 0x80;
-    if (a & AFS_ATTR_LOCKED) ent[2] |= 0x80;
-    if (a & AFS_ATTR_DIR)    ent[3] |= 0x80;
-    if (a & AFS_ATTR_UEXEC)  ent[4] |= 0x80;
-    if (a & AFS_ATTR_OREAD)  ent[5] |= 0x80;
-    if (a & AFS_ATTR_OWRITE) ent[6] |= 0x80;
-    if (a & AFS_ATTR_OEXEC)  ent[7] |= 0x80;
-    if (a & AFS_ATTR_PRIV)   ent[8] |= 0x80;
-    adfs_put32(ent + 0x0a, child->load_addr);
-    adfs_put32(ent + 0x0e, child->exec_addr);
-    adfs_put32(ent + 0x12, child->length);
-    adfs_put24(ent + 0x16, child->sector);
-    return fs->wrsect(fs, parent->sector, parent->data, parent->length);
+    return status;
+}
+
+/*
+ * Take the free space that starts where an object ends, if there is
+ * enough of it, so the object can grow where it is.
+ */
+
+static bool map_extend(acorn_fs *fs, uint32_t posn, uint32_t extra)
+{
+    adfs_priv *priv = fs->priv;
+    unsigned char *fsmap = priv->fsmap;
+    unsigned char *sizes = fsmap + 0x100;
+    int end = fsmap[0x1fe];
+
+    for (int ent = 0; ent < end; ent += 3) {
+        if (adfs_get24(fsmap + ent) == posn) {
+            uint32_t size = adfs_get24(sizes + ent);
+            if (size < extra)
+                return false;
+            if (size == extra) {
+                int bytes = end - ent;
+                memmove(fsmap + ent, fsmap + ent + 3, bytes);
+                memmove(sizes + ent, sizes + ent + 3, bytes);
+                fsmap[0x1fe] -= 3;
+            } else {
+                adfs_put24(fsmap + ent, posn + extra);
+                adfs_put24(sizes + ent, size - extra);
+            }
+            dir_forget(priv, posn, extra);
+            return true;
+        }
+    }
+    return false;
+}
+
+static int dir_update(acorn_fs *fs, acorn_fs_object *parent, acorn_fs_object *child, unsigned char *ent)
+{
+    acorn_fs_adfs_obj2ent(child, ent);
+    return write_dir(fs, parent);
 }
 
 static int dir_makeslot(acorn_fs_object *parent, unsigned char *ent)
@@ -489,7 +694,7 @@ static int dir_makeslot(acorn_fs_object *parent, unsigned char *ent)
     return AFS_DIR_FULL;
 }
 
-static int adfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+static int save_obj(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite, acorn_fs *src)
 {
     int status;
     acorn_fs_object child;
@@ -501,7 +706,7 @@ static int adfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest,
         if ((status = search(fs, dest, &child, obj->name, &ent)) == AFS_OK) {
 			if (overwrite) {
 				if ((status = map_free(fs, &child)) == AFS_OK)
-					if ((status = alloc_write(fs, obj)) == AFS_OK)
+					if ((status = alloc_write(fs, obj, src)) == AFS_OK)
 						status = dir_update(fs, dest, obj, ent);
 			}
 			else
@@ -509,7 +714,7 @@ static int adfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest,
         }
         else if (status == ENOENT) {
             if ((status = dir_makeslot(dest, ent)) == AFS_OK)
-                if ((status = alloc_write(fs, obj)) == AFS_OK)
+                if ((status = alloc_write(fs, obj, src)) == AFS_OK)
                     status = dir_update(fs, dest, obj, ent);
         }
         if (status == AFS_OK)
@@ -519,11 +724,144 @@ static int adfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest,
     return status;
 }
 
+static int adfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+{
+    return save_obj(fs, obj, dest, overwrite, NULL);
+}
+
+static int adfs_copy(acorn_fs *fs, acorn_fs *src, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+{
+    return save_obj(fs, obj, dest, overwrite, src);
+}
+
+/*
+ * Write obj->length bytes from obj->data at offset in a file that
+ * starts at sector, reading back the part of the first sector that
+ * comes before the offset so only the sectors written to change.
+ */
+
+static int write_part(acorn_fs *fs, uint32_t sector, unsigned offset, acorn_fs_object *obj)
+{
+    unsigned char *data = obj->data;
+    unsigned len = obj->length;
+    sector += offset / ACORN_FS_SECT_SIZE;
+    unsigned skip = offset % ACORN_FS_SECT_SIZE;
+    if (skip && len) {
+        unsigned char sect[ACORN_FS_SECT_SIZE];
+        unsigned chunk = ACORN_FS_SECT_SIZE - skip;
+        if (chunk > len)
+            chunk = len;
+        int status = acorn_fs_rdsect(fs, sector, sect, skip);
+        if (status != AFS_OK)
+            return status;
+        memcpy(sect + skip, data, chunk);
+        if ((status = acorn_fs_wrsect(fs, sector++, sect, skip + chunk)) != AFS_OK)
+            return status;
+        data += chunk;
+        len -= chunk;
+    }
+    return len ? acorn_fs_wrsect(fs, sector, data, len) : AFS_OK;
+}
+
+/*
+ * Write into an existing file without rewriting the rest of it.  A
+ * file that grows takes the free space straight after it if there is
+ * enough; otherwise it moves to a new extent with only the part
+ * before the offset copied across.  One truncated to fewer sectors
+ * gives the tail back to the free space map.
+ */
+
+static int adfs_write_range(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, unsigned offset, unsigned flags)
+{
+    int status;
+    acorn_fs_object child;
+    unsigned char *ent;
+
+    if (!(dest->attr & AFS_ATTR_DIR))
+        return ENOTDIR;
+    if ((status = load_fsmap(fs)) != AFS_OK)
+        return status;
+    if ((status = search(fs, dest, &child, obj->name, &ent)) == AFS_OK && (child.attr & AFS_ATTR_DIR))
+        status = EISDIR;
+    else if (status == AFS_OK) {
+        if (flags & ACORN_FS_APPEND)
+            offset = child.length;
+        unsigned length = offset + obj->length;
+        if (offset > child.length || length < offset)
+            status = EINVAL;
+        else {
+            if (length < child.length && !(flags & ACORN_FS_TRUNC))
+                length = child.length;
+            uint32_t old_size = sectors(child.length);
+            uint32_t new_size = sectors(length);
+            bool map_changed = new_size != old_size;
+            // Space that is given back once the directory no longer
+            // refers to it, and space taken that is given back if the
+            // write fails.
+            acorn_fs_object old, taken;
+            old.length = taken.length = 0;
+            if (new_size > old_size) {
+                if (map_extend(fs, child.sector + old_size, new_size - old_size)) {
+                    taken.sector = child.sector + old_size;
+                    taken.length = (new_size - old_size) * ACORN_FS_SECT_SIZE;
+                }
+                else {
+                    uint32_t posn;
+                    if ((status = map_alloc(fs, new_size, &posn)) == AFS_OK) {
+                        taken.sector = posn;
+                        taken.length = new_size * ACORN_FS_SECT_SIZE;
+                        if (offset)
+                            status = acorn_fs_xfer(fs, posn, fs, child.sector, offset);
+                        old = child;
+                        child.sector = posn;
+                    }
+                }
+            }
+            else if (new_size < old_size) {
+                old.sector = child.sector + new_size;
+                old.length = (old_size - new_size) * ACORN_FS_SECT_SIZE;
+            }
+            if (status == AFS_OK)
+                status = write_part(fs, child.sector, offset, obj);
+            if (status == AFS_OK && (length != child.length || map_changed)) {
+                child.length = length;
+                status = dir_update(fs, dest, &child, ent);
+            }
+            if (status != AFS_OK)
+                map_free(fs, &taken);
+            else if (map_changed) {
+                status = map_free(fs, &old);
+                int save_status = save_fsmap(fs);
+                if (status == AFS_OK)
+                    status = save_status;
+            }
+        }
+    }
+    acorn_fs_free_obj(dest);
+    return status;
+}
+
+static int adfs_free_space(acorn_fs *fs, acorn_fs_extent_cb cb, void *udata)
+{
+    int status = load_fsmap(fs);
+    if (status == AFS_OK) {
+        unsigned char *fsmap = ((adfs_priv *)fs->priv)->fsmap;
+        unsigned char *sizes = fsmap + 0x100;
+        int end = fsmap[0x1fe];
+        for (int ent = 0; ent < end && status == AFS_OK; ent += 3) {
+            unsigned size = adfs_get24(sizes + ent);
+            if (size)
+                status = cb(fs, adfs_get24(fsmap + ent), size, udata);
+        }
+    }
+    return status;
+}
+
 static int remove_loop(acorn_fs *fs, acorn_fs_object *dir, const char *pattern)
 {
     if (!*pattern)
         return AFS_OK;
-    int status = adfs_load(fs, dir);
+    int status = load_dir(fs, dir);
     if (status == AFS_OK) {
         if ((status = check_dir(dir)) == AFS_OK) {
             unsigned char *ent = dir->data;
@@ -557,7 +895,7 @@ static int remove_loop(acorn_fs *fs, acorn_fs_object *dir, const char *pattern)
 					ent += DIR_ENT_SIZE;
             }
             if (status == AFS_OK) {
-				if ((status = fs->wrsect(fs, dir->sector, dir->data, dir->length)) == AFS_OK)
+				if ((status = write_dir(fs, dir)) == AFS_OK)
 					status = save_fsmap(fs);
 			}
         }
@@ -599,7 +937,7 @@ static int name_cmp(const unsigned char *a, const unsigned char *b)
 
 static int check_walk(check_ctx *ctx, acorn_fs_object *dir, acorn_fs_object *parent, char *path, unsigned path_len)
 {
-    int status = adfs_load(ctx->fs, dir);
+    int status = load_dir(ctx->fs, dir);
     if (status == AFS_OK) {
         if ((status = check_dir(dir)) == AFS_OK) {
             char *pat = dir->name;
@@ -674,6 +1012,8 @@ static int check_walk(check_ctx *ctx, acorn_fs_object *dir, acorn_fs_object *par
         }
         else
             fprintf(ctx->mfp, "%s:%s: broken direcrory: Hugo/sequence\n", ctx->fsname, path);
+        free(dir->data);
+        dir->data = NULL;
     }
     else
         fprintf(ctx->mfp, "%s:%s: unable to load directory: %s\n", ctx->fsname, path, acorn_fs_strerr(status));
@@ -693,7 +1033,7 @@ static int adfs_check(acorn_fs *fs, const char *fsname, FILE *mfp)
 {
     int status = load_fsmap(fs);
     if (status == AFS_OK) {
-        unsigned char *fsmap = fs->priv;
+        unsigned char *fsmap = ((adfs_priv *)fs->priv)->fsmap;
         unsigned char *sizes = fsmap + 0x100;
         int end = fsmap[0x1fe];
         if (end == 0) {
@@ -776,24 +1116,7 @@ static int adfs_mkdir(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest)
 {
     // Create empty directory data
     unsigned char empty_data[1280];
-    memset(empty_data, 0, sizeof(empty_data));
-    strcpy((char *)empty_data + 0x001, "Hugo");
-    strcpy((char *)empty_data + 0x4FB, "Hugo");
-    // Populate the directory footer.
-    unsigned char *dname = empty_data + 0x4cc;
-    unsigned char *title = empty_data + 0x4d9;
-    for (int i = 0; i < ACORN_FS_MAX_NAME; ++i) {
-        int ch = obj->name[i];
-        if (!ch) {
-            dname[i] = 0x0d;
-            title[i] = 0x0d;
-            break;
-        }
-        ch &= 0x7f;
-        dname[i] = ch; // directory name.
-        title[i] = ch; // directory title.
-    }
-    adfs_put24(empty_data+0x4d6, dest->sector); // Uplink to parent.
+    acorn_fs_adfs_dirinit(empty_data, obj->name, obj->name, dest->sector);
 
     // Create an empty directory acorn_fs_object
     obj->load_addr = 0;
@@ -803,7 +1126,132 @@ static int adfs_mkdir(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest)
     obj->data = empty_data;
 
     // Save the new directory
-    return adfs_save(fs, obj, dest, false);
+    int status = adfs_save(fs, obj, dest, false);
+    if (status == EEXIST) {
+        // Describe what is already there so the caller can tell if
+        // it is a directory and, if so, use it.
+        unsigned char *ent;
+        search(fs, dest, obj, obj->name, &ent);
+        acorn_fs_free_obj(dest);
+    }
+    obj->data = NULL;
+    return status;
+}
+
+static int adfs_sync(acorn_fs *fs)
+{
+    int status = AFS_OK;
+    adfs_priv *priv = fs->priv;
+    if (priv) {
+        for (adfs_dir *ent = priv->dirs; ent; ent = ent->next) {
+            if (ent->dirty) {
+                fs->stats.dir_writes++;
+                int result = acorn_fs_wrsect(fs, ent->sector, ent->data, ent->length);
+                if (result == AFS_OK)
+                    ent->dirty = false;
+                else
+                    status = result;
+            }
+        }
+        if (priv->map_dirty && status == AFS_OK) {
+            unsigned char *fsmap = priv->fsmap;
+            fsmap[0x0ff] = checksum(fsmap);
+            fsmap[0x1ff] = checksum(fsmap + 0x100);
+            fs->stats.map_writes++;
+            if ((status = acorn_fs_wrsect(fs, 0, fsmap, FSMAP_SIZE)) == AFS_OK)
+                priv->map_dirty = false;
+        }
+    }
+    if (status == AFS_OK)
+        fs->dirty = false;
+    return status;
+}
+
+static void adfs_release(acorn_fs *fs)
+{
+    adfs_priv *priv = fs->priv;
+    if (priv) {
+        adfs_dir *ent = priv->dirs;
+        while (ent) {
+            adfs_dir *next = ent->next;
+            free(ent);
+            ent = next;
+        }
+        free(priv);
+        fs->priv = NULL;
+    }
+}
+
+/*
+ * Helpers for laying out directories and the free space map without
+ * going through an open image, as used by afsbuild.
+ */
+
+void acorn_fs_adfs_obj2ent(const acorn_fs_object *obj, unsigned char *ent)
+{
+    int e = 0, o = 0;
+    if (obj->name[0] && obj->name[1] == '.')
+        o += 2; // Discard DFS directory.
+    while (o < ADFS_MAX_NAME) {
+        int ch = obj->name[o++] & 0x7f;
+        if (!ch)
+            break;
+        ent[e++] = ch;
+    }
+    while (e < ADFS_MAX_NAME)
+        ent[e++] = 0x0d;
+    unsigned a = obj->attr;
+    if (a & AFS_ATTR_UREAD)  ent[0] |= 0x80;
+    if (a & AFS_ATTR_UWRITE) ent[1] |= 0x80;
+    if (a & AFS_ATTR_LOCKED) ent[2] |= 0x80;
+    if (a & AFS_ATTR_DIR)    ent[3] |= 0x80;
+    if (a & AFS_ATTR_UEXEC)  ent[4] |= 0x80;
+    if (a & AFS_ATTR_OREAD)  ent[5] |= 0x80;
+    if (a & AFS_ATTR_OWRITE) ent[6] |= 0x80;
+    if (a & AFS_ATTR_OEXEC)  ent[7] |= 0x80;
+    if (a & AFS_ATTR_PRIV)   ent[8] |= 0x80;
+    adfs_put32(ent + 0x0a, obj->load_addr);
+    adfs_put32(ent + 0x0e, obj->exec_addr);
+    adfs_put32(ent + 0x12, obj->length);
+    adfs_put24(ent + 0x16, obj->sector);
+}
+
+int acorn_fs_adfs_namecmp(const unsigned char *a, const unsigned char *b)
+{
+    return name_cmp(a, b);
+}
+
+void acorn_fs_adfs_dirinit(unsigned char *data, const char *name, const char *title, unsigned parent)
+{
+    memset(data, 0, ACORN_FS_ADFS_DIR_SIZE);
+    memcpy(data + 0x001, "Hugo", 4);
+    memcpy(data + 0x4FB, "Hugo", 4);
+    // Populate the directory footer.
+    unsigned char *dname = data + 0x4cc;
+    unsigned char *dtitle = data + 0x4d9;
+    int i;
+    for (i = 0; i < ADFS_MAX_NAME && name[i]; ++i)
+        dname[i] = name[i] & 0x7f;
+    if (i < ADFS_MAX_NAME)
+        dname[i] = 0x0d;
+    for (i = 0; i < 19 && title[i]; ++i)
+        dtitle[i] = title[i] & 0x7f;
+    if (i < 19)
+        dtitle[i] = 0x0d;
+    adfs_put24(data + 0x4d6, parent); // Uplink to parent.
+}
+
+void acorn_fs_adfs_mapinit(unsigned char *fsmap, unsigned total, unsigned used)
+{
+    memset(fsmap, 0, FSMAP_SIZE);
+    if (used < total) {
+        adfs_put24(fsmap, used);
+        adfs_put24(fsmap + 0x100, total - used);
+        fsmap[0x1fe] = 3;
+    }
+    adfs_put24(fsmap + 0xfc, total);
+    fsmap[0x0ff] = checksum(fsmap);
+    fsmap[0x1ff] = checksum(fsmap + 0x100);
 }
 
 void acorn_fs_adfs_init(acorn_fs *fs)
@@ -813,9 +1261,15 @@ void acorn_fs_adfs_init(acorn_fs *fs)
     fs->walk = adfs_walk;
     fs->remove = adfs_remove;
     fs->load = adfs_load;
+    fs->read_range = acorn_fs_read_contig;
     fs->mkdir = adfs_mkdir;
     fs->save = adfs_save;
+    fs->write_range = adfs_write_range;
+    fs->free_space = adfs_free_space;
+    fs->copy = adfs_copy;
     fs->check = adfs_check;
     fs->priv = NULL;
     fs->settitle = adfs_settitle;
+    fs->sync = adfs_sync;
+    fs->release = adfs_release;
 }
@@ -39,8 +39,8 @@ static int dfs_wildmat(const char *pattern, const unsigned char *candidate)
     if (pat_ch0) {
         int pat_ch1 = pattern[1];
         if (pat_ch1 == '.') {
-            if (pat_ch0 == '*' || pat_ch1 == '#' || pat_ch0 == (candidate[7] & 0x7f))
-                return dfs_wildmat2(pattern, candidate, 7);
+            if (pat_ch0 == '*' || pat_ch0 == '#' || pat_ch0 == (candidate[7] & 0x7f))
+                return dfs_wildmat2(pattern + 2, candidate, 7);
         }
         else if ((candidate[7] & 0x7f) == '$')
             return dfs_wildmat2(pattern, candidate, 7);
@@ -74,6 +74,33 @@ static void ent2obj(const unsigned char *ent, acorn_fs_object *obj)
     obj->data = NULL;
 }
 
+/*
+ * The path passed to glob and walk callbacks is the name with its
+ * directory letter in front, as it would be typed, except for files
+ * in the current directory, $.
+ */
+
+static const char *ent2path(const unsigned char *ent, const acorn_fs_object *obj, char *path)
+{
+    int dir_ch = ent[7] & 0x7f;
+    if (dir_ch == '$')
+        return obj->name;
+    path[0] = dir_ch;
+    path[1] = '.';
+    strcpy(path + 2, obj->name);
+    return path;
+}
+
+static int cat_write(acorn_fs *fs)
+{
+    if (fs->deferred) {
+        fs->dirty = true;
+        return AFS_OK;
+    }
+    fs->stats.dir_writes++;
+    return acorn_fs_wrsect(fs, 0, fs->priv, 0x200);
+}
+
 static int dfs_find(acorn_fs *fs, const char *dfs_name, acorn_fs_object *obj)
 {
 	if (dfs_name[0] == '$' && !dfs_name[1]) {
@@ -106,7 +133,7 @@ static int dfs_settitle(acorn_fs *fs, const char *title)
         // Update the directory
         dir[di] = c;
     }
-    return fs->wrsect(fs, 0, dir, 0x200);
+    return cat_write(fs);
 }
 
 static int dfs_glob(acorn_fs *fs, acorn_fs_object *start, const char *pattern, acorn_fs_cb cb, void *udata)
@@ -117,8 +144,9 @@ static int dfs_glob(acorn_fs *fs, acorn_fs_object *start, const char *pattern, a
     while (ent < end) {
         if (!dfs_wildmat(pattern, ent)) {
             acorn_fs_object obj;
+            char path[10];
             ent2obj(ent, &obj);
-            int status = cb(fs, &obj, udata, obj.name);
+            int status = cb(fs, &obj, udata, ent2path(ent, &obj, path));
             if (status != AFS_OK)
                 return status;
         }
@@ -134,8 +162,9 @@ static int dfs_walk(acorn_fs *fs, acorn_fs_object *start, acorn_fs_cb cb, void *
     unsigned char *end = ent + dir[0x105];
     while (ent < end) {
         acorn_fs_object obj;
+        char path[10];
         ent2obj(ent, &obj);
-        int status = cb(fs, &obj, udata, obj.name);
+        int status = cb(fs, &obj, udata, ent2path(ent, &obj, path));
         if (status != AFS_OK)
             return status;
         ent += 8;
@@ -158,12 +187,13 @@ static int dfs_remove(acorn_fs *fs, acorn_fs_object *start, const char *pattern)
 			memmove(ent+0x100, ent+0x108, bytes); // other details.
 			/* adjust the total */
 			dir[0x105] -= 8;
+			end -= 8;
 			dirty = true;
 		}
 		else
 			ent += 8;
     }
-    return dirty ? fs->wrsect(fs, 0, dir, 0x200) : AFS_OK;
+    return dirty ? cat_write(fs) : AFS_OK;
 }
 
 static int dfs_load(acorn_fs *fs, acorn_fs_object *obj)
@@ -171,7 +201,7 @@ static int dfs_load(acorn_fs *fs, acorn_fs_object *obj)
     unsigned char *data = malloc(obj->length);
     if (data) {
         obj->data = data;
-        return fs->rdsect(fs, obj->sector, data, obj->length);
+        return acorn_fs_rdsect(fs, obj->sector, data, obj->length);
     }
     return errno;
 }
@@ -207,7 +237,7 @@ static void obj2ent(acorn_fs_object *obj, char *name, int dfs_dir, unsigned ssec
     ent[0x107] = ssect;
 }
 
-static int dfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+static int save_obj(acorn_fs *fs, acorn_fs_object *obj, bool overwrite, acorn_fs *src)
 {
     int dfs_dir = '$';
     char *name = obj->name;
@@ -274,7 +304,11 @@ static int dfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, b
     unsigned avail_sect = (((dir[0x106] & 0x03) << 8) | dir[0x107]) - 2;
     if (reqd_sect > (avail_sect - start_sect))
         return ENOSPC;
-    int status = fs->wrsect(fs, start_sect, obj->data, obj->length);
+    int status;
+    if (src)
+        status = acorn_fs_xfer(fs, start_sect, src, obj->sector, obj->length);
+    else
+        status = acorn_fs_wrsect(fs, start_sect, obj->data, obj->length);
     if (status == AFS_OK) {
         if (space_ent != name_ent) {
             if (name_ent > space_ent) {
@@ -292,8 +326,46 @@ static int dfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, b
         obj2ent(obj, name, dfs_dir, start_sect, space_ent);
         if (!found)
             dir[0x105] += 8;
-        status = fs->wrsect(fs, 0, dir, 0x200);
+        status = cat_write(fs);
+    }
+    return status;
+}
+
+static int dfs_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+{
+    return save_obj(fs, obj, overwrite, NULL);
+}
+
+static int dfs_copy(acorn_fs *fs, acorn_fs *src, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+{
+    return save_obj(fs, obj, overwrite, src);
+}
+
+static int dfs_write_range(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, unsigned offset, unsigned flags)
+{
+    return ENOSYS; // files are packed against each other so rarely have room to grow.
+}
+
+static int dfs_free_space(acorn_fs *fs, acorn_fs_extent_cb cb, void *udata)
+{
+    // The catalogue is in decreasing order of start sector so the
+    // gaps are found working back from the last entry.
+    unsigned char *dir = fs->priv;
+    unsigned char *ent = dir + 8 + dir[0x105];
+    unsigned total = ((dir[0x106] & 0x03) << 8) | dir[0x107];
+    unsigned posn = 2;
+    int status = AFS_OK;
+    while (ent > dir + 8 && status == AFS_OK) {
+        acorn_fs_object obj;
+        ent -= 8;
+        ent2obj(ent, &obj);
+        if (obj.sector > posn)
+            status = cb(fs, posn, obj.sector - posn, udata);
+        if (obj.sector + sectors(obj.length) > posn)
+            posn = obj.sector + sectors(obj.length);
     }
+    if (status == AFS_OK && total > posn)
+        status = cb(fs, posn, total - posn, udata);
     return status;
 }
 
@@ -339,6 +411,21 @@ static int dfs_mkdir(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest)
     return ENOSYS;
 }
 
+static int dfs_sync(acorn_fs *fs)
+{
+    fs->stats.dir_writes++;
+    int status = acorn_fs_wrsect(fs, 0, fs->priv, 0x200);
+    if (status == AFS_OK)
+        fs->dirty = false;
+    return status;
+}
+
+static void dfs_release(acorn_fs *fs)
+{
+    free(fs->priv);
+    fs->priv = NULL;
+}
+
 void acorn_fs_dfs_init(acorn_fs *fs)
 {
     fs->find  = dfs_find;
@@ -346,8 +433,21 @@ void acorn_fs_dfs_init(acorn_fs *fs)
     fs->walk  = dfs_walk;
     fs->remove = dfs_remove;
     fs->load  = dfs_load;
+    fs->read_range = acorn_fs_read_contig;
     fs->mkdir = dfs_mkdir;
     fs->save  = dfs_save;
+    fs->write_range = dfs_write_range;
+    fs->free_space = dfs_free_space;
+    fs->copy  = dfs_copy;
     fs->check = acorn_fs_dfs_check;
     fs->settitle = dfs_settitle;
+    fs->sync  = dfs_sync;
+    fs->release = dfs_release;
+    // The catalogue was read while the image was being identified.
+    fs->stats.dir_loads++;
+    fs->stats.reads++;
+    fs->stats.sects_read += 2;
+    fs->stats.bytes_read += 0x200;
+    fs->stats.io_calls += 2;
+    fs->next_sect = 2;
 }
@@ -1,13 +1,31 @@
+#define _GNU_SOURCE
 #include "acorn-fs.h"
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
 
 #ifndef WIN32
 #include <fcntl.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define flockfile   _lock_file
+#define funlockfile _unlock_file
 #endif
 
-static acorn_fs *open_list;
+#define XFER_SECTS 64
+
+static FILE *stats_fp;
+
+static FILE *trace_fp;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static uint64_t trace_start;
+static unsigned trace_images;
+static const char **trace_callers;
+static unsigned trace_ncallers;
 
 static int check_adfs(FILE *fp, unsigned off1, unsigned off2, const char *pattern, size_t len)
 {
@@ -27,73 +45,152 @@ static int check_adfs(FILE *fp, unsigned off1, unsigned off2, const char *patter
     return AFS_OK;
 }
 
-static int rdsect_simple(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+/*
+ * Counters may be updated by several threads reading one image.
+ */
+
+#define COUNT(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+/*
+ * The backends transfer with pread and pwrite at an explicit offset
+ * so threads sharing an image do not disturb each other's position
+ * in the file.
+ */
+
+static int read_at(acorn_fs *fs, unsigned char *buf, size_t size, off_t offset)
 {
-    if (fseek(fs->fp, ssect * ACORN_FS_SECT_SIZE, SEEK_SET))
-        return errno;
-    if (fread(buf, size, 1, fs->fp) != 1)
-        return ferror(fs->fp) ? errno : AFS_BAD_EOF;
+#ifndef WIN32
+    int fd = fileno(fs->fp);
+    while (size) {
+        ssize_t bytes = pread(fd, buf, size, offset);
+        COUNT(fs->stats.io_calls, 1);
+        if (bytes < 0) {
+            if (errno != EINTR)
+                return errno;
+        }
+        else if (bytes == 0)
+            return AFS_BAD_EOF;
+        else {
+            buf += bytes;
+            size -= bytes;
+            offset += bytes;
+        }
+    }
     return AFS_OK;
+#else
+    int status = AFS_OK;
+    flockfile(fs->fp);
+    COUNT(fs->stats.io_calls, 2);
+    if (fseek(fs->fp, offset, SEEK_SET))
+        status = errno;
+    else if (fread(buf, size, 1, fs->fp) != 1)
+        status = ferror(fs->fp) ? errno : AFS_BAD_EOF;
+    funlockfile(fs->fp);
+    return status;
+#endif
 }
 
-static int wrsect_simple(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+static int write_at(acorn_fs *fs, const unsigned char *buf, size_t size, off_t offset)
 {
-    if (fseek(fs->fp, ssect * ACORN_FS_SECT_SIZE, SEEK_SET))
-        return errno;
-    if (fwrite(buf, size, 1, fs->fp) != 1)
-        return errno;
+#ifndef WIN32
+    int fd = fileno(fs->fp);
+    while (size) {
+        ssize_t bytes = pwrite(fd, buf, size, offset);
+        COUNT(fs->stats.io_calls, 1);
+        if (bytes < 0) {
+            if (errno != EINTR)
+                return errno;
+        }
+        else {
+            buf += bytes;
+            size -= bytes;
+            offset += bytes;
+        }
+    }
     return AFS_OK;
+#else
+    int status = AFS_OK;
+    flockfile(fs->fp);
+    COUNT(fs->stats.io_calls, 2);
+    if (fseek(fs->fp, offset, SEEK_SET) || fwrite(buf, size, 1, fs->fp) != 1)
+        status = errno;
+    funlockfile(fs->fp);
+    return status;
+#endif
+}
+
+static int rdsect_simple(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    return read_at(fs, buf, size, (off_t)ssect * ACORN_FS_SECT_SIZE);
+}
+
+static int wrsect_simple(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    return write_at(fs, buf, size, (off_t)ssect * ACORN_FS_SECT_SIZE);
 }
 
+/*
+ * IDE images hold each byte in the low half of a 16-bit word; they
+ * are transferred IDE_SECTS sectors at a time through a buffer.
+ */
+
+#define IDE_SECTS 16
+
 static int rdsect_ide(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
 {
-    unsigned char tbuf[2*ACORN_FS_SECT_SIZE];
+    unsigned char tbuf[2*ACORN_FS_SECT_SIZE*IDE_SECTS];
+    off_t offset = (off_t)ssect * ACORN_FS_SECT_SIZE * 2;
 
-    if (fseek(fs->fp, ssect * ACORN_FS_SECT_SIZE * 2, SEEK_SET))
-        return errno;
     while (size) {
         unsigned chunk = size;
-        if (chunk > ACORN_FS_SECT_SIZE)
-            chunk = ACORN_FS_SECT_SIZE;
-        if (fread(tbuf, chunk * 2, 1, fs->fp) == 1) {
-            unsigned char *ptr = tbuf;
-            unsigned char *end = buf + chunk;
-            while (buf < end) {
-                *buf++ = *ptr;
-                ptr += 2;
-            }
-            size -= chunk;
+        if (chunk > ACORN_FS_SECT_SIZE*IDE_SECTS)
+            chunk = ACORN_FS_SECT_SIZE*IDE_SECTS;
+        int status = read_at(fs, tbuf, chunk * 2, offset);
+        if (status != AFS_OK)
+            return status;
+        unsigned char *ptr = tbuf;
+        unsigned char *end = buf + chunk;
+        while (buf < end) {
+            *buf++ = *ptr;
+            ptr += 2;
         }
-        else
-            return ferror(fs->fp) ? errno : AFS_BAD_EOF;
+        offset += chunk * 2;
+        size -= chunk;
     }
     return AFS_OK;
 }
 
 static int wrsect_ide(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
 {
-    unsigned char tbuf[2*ACORN_FS_SECT_SIZE];
+    unsigned char tbuf[2*ACORN_FS_SECT_SIZE*IDE_SECTS];
+    off_t offset = (off_t)ssect * ACORN_FS_SECT_SIZE * 2;
 
-    if (fseek(fs->fp, ssect * ACORN_FS_SECT_SIZE * 2, SEEK_SET))
-        return errno;
     while (size) {
         unsigned chunk = size;
-        if (chunk > ACORN_FS_SECT_SIZE)
-            chunk = ACORN_FS_SECT_SIZE;
+        if (chunk > ACORN_FS_SECT_SIZE*IDE_SECTS)
+            chunk = ACORN_FS_SECT_SIZE*IDE_SECTS;
         unsigned char *ptr = tbuf;
         unsigned char *end = buf + chunk;
         while (buf < end) {
             *ptr++ = *buf++;
             *ptr++ = 0;
         }
-        if (fwrite(tbuf, chunk * 2, 1, fs->fp) != 1)
-            return errno;
+        int status = write_at(fs, tbuf, chunk * 2, offset);
+        if (status != AFS_OK)
+            return status;
+        offset += chunk * 2;
         size -= chunk;
     }
     return AFS_OK;
 }
 
-static int ileave_seek(acorn_fs *fs, int ssect, int sect_per_track)
+/*
+ * Interleaved images alternate the tracks of the two sides, so the
+ * sectors of one logical track are contiguous in the file and each
+ * is transferred with a single call.
+ */
+
+static off_t ileave_offset(int ssect, int sect_per_track)
 {
     int track = ssect / sect_per_track;
     int sector = ssect % sect_per_track;
@@ -101,49 +198,652 @@ static int ileave_seek(acorn_fs *fs, int ssect, int sect_per_track)
         sector +=  (((track - 80) * 2 + 1) * sect_per_track);
     else
         sector += track * 2 * sect_per_track;
-    return fseek(fs->fp, sector * ACORN_FS_SECT_SIZE, SEEK_SET);
+    return (off_t)sector * ACORN_FS_SECT_SIZE;
 }
 
-typedef size_t (*cb_type)(void *ptr, size_t size, size_t nmemb, FILE *fp);
-
-static int interleaved(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size, int sect_per_track, cb_type callback)
+static int interleaved(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size, int sect_per_track, bool write)
 {
-    while (size > ACORN_FS_SECT_SIZE) {
-        if (ileave_seek(fs, ssect, sect_per_track))
-            return errno;
-        if (callback(buf, ACORN_FS_SECT_SIZE, 1, fs->fp) != 1)
-            return ferror(fs->fp) ? errno : AFS_BAD_EOF;
-        ssect++;
-        buf += ACORN_FS_SECT_SIZE;
-        size -= ACORN_FS_SECT_SIZE;
-    }
-    if (size > 0) {
-        if  (ileave_seek(fs, ssect, sect_per_track))
-            return errno;
-        if (callback(buf, size, 1, fs->fp) != 1)
-            return ferror(fs->fp) ? errno : AFS_BAD_EOF;
+    while (size) {
+        unsigned chunk = (sect_per_track - ssect % sect_per_track) * ACORN_FS_SECT_SIZE;
+        if (chunk > size)
+            chunk = size;
+        off_t offset = ileave_offset(ssect, sect_per_track);
+        int status = write ? write_at(fs, buf, chunk, offset) : read_at(fs, buf, chunk, offset);
+        if (status != AFS_OK)
+            return status;
+        ssect += sect_per_track - ssect % sect_per_track;
+        buf += chunk;
+        size -= chunk;
     }
     return AFS_OK;
 }
 
 static int rdsect_ileave16(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
 {
-    return interleaved(fs, ssect, buf, size, 16, (cb_type)fread);
+    return interleaved(fs, ssect, buf, size, 16, false);
 }
 
 static int wrsect_ileave16(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
 {
-    return interleaved(fs, ssect, buf, size, 16, (cb_type)fwrite);
+    return interleaved(fs, ssect, buf, size, 16, true);
 }
 
 static int rdsect_ileave10(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
 {
-    return interleaved(fs, ssect, buf, size, 10, (cb_type)fread);
+    return interleaved(fs, ssect, buf, size, 10, false);
 }
 
 static int wrsect_ileave10(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
 {
-    return interleaved(fs, ssect, buf, size, 10, (cb_type)fwrite);
+    return interleaved(fs, ssect, buf, size, 10, true);
+}
+
+static const struct {
+    int (*rdsect)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+    int (*wrsect)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+} backends[] = {
+    /* AFS_LAYOUT_SIMPLE   */ { rdsect_simple,   wrsect_simple   },
+    /* AFS_LAYOUT_IDE      */ { rdsect_ide,      wrsect_ide      },
+    /* AFS_LAYOUT_ILEAVE16 */ { rdsect_ileave16, wrsect_ileave16 },
+    /* AFS_LAYOUT_ILEAVE10 */ { rdsect_ileave10, wrsect_ileave10 }
+};
+
+static uint64_t now_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The simulated device sits between the counting wrappers and the
+ * layout backend.  The head starts at track zero; an access that does
+ * not follow on from the last one pays the settle time plus the seek
+ * time for the tracks crossed, each arrival at a new track, whether
+ * by seeking or by running on from the previous track, pays the track
+ * time and every sector pays the sector time.
+ */
+
+typedef struct {
+    bool     sleep;
+    unsigned spt;
+    unsigned settle;
+    unsigned seek;
+    unsigned track;
+    unsigned sector;
+} simdev_conf;
+
+static const struct {
+    const char  *name;
+    simdev_conf conf;
+} simdev_presets[] = {
+    { "floppy", { false, 16, 15000, 3000, 100000, 12500 } },
+    { "scsi",   { false, 32,  2000,   50,   8300,   250 } }
+};
+
+typedef struct {
+    int (*rdsect)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+    int (*wrsect)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+    unsigned spt;
+    unsigned track;
+    unsigned next;
+    pthread_mutex_t lock; // the device does one transfer at a time.
+} simdev;
+
+static simdev_conf simdev_config;
+static pthread_once_t simdev_once = PTHREAD_ONCE_INIT;
+static bool simdev_enabled;
+
+static void simdev_init(void)
+{
+    const char *env = getenv("ACORN_FS_SIMDEV");
+    if (!env || !*env)
+        return;
+    char *copy = strdup(env);
+    if (!copy)
+        return;
+    simdev_enabled = true;
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        char *value = strchr(tok, '=');
+        unsigned *field = NULL;
+        if (value)
+            *value++ = 0;
+        if (!strcmp(tok, "spt"))
+            field = &simdev_config.spt;
+        else if (!strcmp(tok, "settle"))
+            field = &simdev_config.settle;
+        else if (!strcmp(tok, "seek"))
+            field = &simdev_config.seek;
+        else if (!strcmp(tok, "track"))
+            field = &simdev_config.track;
+        else if (!strcmp(tok, "sector"))
+            field = &simdev_config.sector;
+        if (field && value)
+            *field = strtoul(value, NULL, 10);
+        else if (!value && !strcmp(tok, "sleep"))
+            simdev_config.sleep = true;
+        else if (!value && !strcmp(tok, "virtual"))
+            simdev_config.sleep = false;
+        else {
+            size_t p;
+            for (p = 0; p < sizeof(simdev_presets) / sizeof(simdev_presets[0]); p++) {
+                if (!value && !strcmp(tok, simdev_presets[p].name)) {
+                    bool sleep = simdev_config.sleep;
+                    simdev_config = simdev_presets[p].conf;
+                    simdev_config.sleep = sleep;
+                    break;
+                }
+            }
+            if (p == sizeof(simdev_presets) / sizeof(simdev_presets[0]))
+                fprintf(stderr, "acorn-fs: ACORN_FS_SIMDEV: unknown setting '%s'\n", tok);
+        }
+    }
+    free(copy);
+}
+
+static void simdev_charge(acorn_fs *fs, int ssect, unsigned size)
+{
+    simdev *sim = fs->simdev;
+    unsigned sect = ssect;
+    unsigned nsects = (size + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE;
+    unsigned first = sect / sim->spt;
+    unsigned last = (sect + (nsects ? nsects - 1 : 0)) / sim->spt;
+    uint64_t usecs = (uint64_t)simdev_config.sector * nsects;
+    pthread_mutex_lock(&sim->lock);
+    if (sect != sim->next) {
+        unsigned dist = first > sim->track ? first - sim->track : sim->track - first;
+        usecs += simdev_config.settle + (uint64_t)simdev_config.seek * dist;
+    }
+    if (first != sim->track)
+        usecs += simdev_config.track;
+    usecs += (uint64_t)simdev_config.track * (last - first);
+    sim->track = last;
+    sim->next = sect + nsects;
+    COUNT(fs->stats.sim_ns, usecs * 1000);
+#ifndef WIN32
+    if (simdev_config.sleep && usecs) {
+        struct timespec ts;
+        ts.tv_sec = usecs / 1000000;
+        ts.tv_nsec = (usecs % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) && errno == EINTR)
+            ;
+    }
+#endif
+    pthread_mutex_unlock(&sim->lock);
+}
+
+static int rdsect_simdev(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    simdev_charge(fs, ssect, size);
+    return ((simdev *)fs->simdev)->rdsect(fs, ssect, buf, size);
+}
+
+static int wrsect_simdev(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    simdev_charge(fs, ssect, size);
+    return ((simdev *)fs->simdev)->wrsect(fs, ssect, buf, size);
+}
+
+static void simdev_attach(acorn_fs *fs)
+{
+    simdev *sim = malloc(sizeof(simdev));
+    if (sim) {
+        sim->rdsect = fs->rdsect_io;
+        sim->wrsect = fs->wrsect_io;
+        sim->spt = simdev_config.spt;
+        if (!sim->spt)
+            sim->spt = fs->check == acorn_fs_dfs_check ? 10 : 16;
+        sim->track = 0;
+        sim->next = 0;
+        pthread_mutex_init(&sim->lock, NULL);
+        fs->simdev = sim;
+        fs->rdsect_io = rdsect_simdev;
+        fs->wrsect_io = wrsect_simdev;
+        // Charge for the DFS catalogue, read before the device existed.
+        if (fs->next_sect)
+            simdev_charge(fs, 0, fs->next_sect * ACORN_FS_SECT_SIZE);
+    }
+}
+
+/*
+ * Sector access tracing; the record format is described in acorn-fs.h.
+ * Callers are identified by their __func__ pointer and given a number
+ * the first time they appear.  The stream lock keeps the records from
+ * different threads whole and in step with the caller table.
+ */
+
+static void trace_put(unsigned char *ptr, uint64_t value, int bytes)
+{
+    while (bytes--) {
+        *ptr++ = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void trace_record(int type, unsigned image, unsigned caller, unsigned sector, unsigned length, const char *name)
+{
+    unsigned char hdr[ACORN_FS_TRACE_HDR];
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = type;
+    trace_put(hdr + 2, image, 2);
+    trace_put(hdr + 4, caller, 2);
+    trace_put(hdr + 8, sector, 4);
+    trace_put(hdr + 12, length, 4);
+    trace_put(hdr + 16, now_ns() - trace_start, 8);
+    fwrite(hdr, sizeof(hdr), 1, trace_fp);
+    if (name)
+        fwrite(name, length, 1, trace_fp);
+}
+
+static void trace_init(void)
+{
+    const char *name = getenv("ACORN_FS_TRACE");
+    if (name && *name) {
+        char fn[ACORN_FS_MAX_PATH+16];
+        const char *pid = strstr(name, "%p");
+        if (pid)
+            snprintf(fn, sizeof(fn), "%.*s%ld%s", (int)(pid - name), name, (long)getpid(), pid + 2);
+        else
+            snprintf(fn, sizeof(fn), "%s", name);
+        if ((trace_fp = fopen(fn, "wb"))) {
+            trace_start = now_ns();
+            fwrite(ACORN_FS_TRACE_MAGIC, 8, 1, trace_fp);
+        }
+        else
+            fprintf(stderr, "acorn-fs: unable to open trace file %s: %s\n", fn, strerror(errno));
+    }
+}
+
+static void trace_open(acorn_fs *fs)
+{
+    flockfile(trace_fp);
+    fs->trace_id = ++trace_images;
+    trace_record('O', fs->trace_id, 0, fs->layout, strlen(fs->filename), fs->filename);
+    funlockfile(trace_fp);
+}
+
+static void trace_xfer(acorn_fs *fs, int type, int ssect, unsigned size, const char *name)
+{
+    flockfile(trace_fp);
+    unsigned caller = 0;
+    if (name) {
+        while (caller < trace_ncallers && trace_callers[caller] != name)
+            caller++;
+        if (caller == trace_ncallers) {
+            const char **callers = realloc(trace_callers, (caller + 1) * sizeof(const char *));
+            if (callers) {
+                trace_callers = callers;
+                trace_callers[trace_ncallers++] = name;
+                trace_record('N', 0, caller + 1, 0, strlen(name), name);
+            }
+        }
+        caller = caller < trace_ncallers ? caller + 1 : 0;
+    }
+    trace_record(type, fs->trace_id, caller, ssect, size, NULL);
+    funlockfile(trace_fp);
+}
+
+static void count_seek(acorn_fs *fs, int ssect, unsigned size)
+{
+    unsigned sect = ssect;
+    unsigned next = __atomic_exchange_n(&fs->next_sect, sect + (size + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE, __ATOMIC_RELAXED);
+    if (sect != next) {
+        COUNT(fs->stats.seeks, 1);
+        COUNT(fs->stats.seek_dist, sect > next ? sect - next : next - sect);
+    }
+}
+
+/*
+ * Each thread keeps a note of the handles it has locked so that
+ * nested calls, from a driver to its own entry points, from a glob
+ * callback or from a copy reading its source, do not lock again.
+ */
+
+#define MAX_HELD 8
+
+static _Thread_local struct {
+    acorn_fs *fs;
+    bool     excl;
+} held[MAX_HELD];
+static _Thread_local unsigned nheld;
+
+_Thread_local const char *acorn_fs_caller;
+
+enum { LOCK_HELD, LOCK_TAKEN, LOCK_UPGRADED };
+
+/*
+ * An update from inside a read of the same handle, from a glob
+ * callback say, cannot wait for the readers to finish as it is one
+ * of them.  It gives up its shared lock and waits for the exclusive
+ * one instead, and goes back to sharing once done, so the image may
+ * change under the outer read just as the update changes it.
+ */
+
+static int lock_handle(acorn_fs *fs, bool excl, int *locked)
+{
+    *locked = LOCK_HELD;
+    for (unsigned i = 0; i < nheld; i++) {
+        if (held[i].fs == fs) {
+            if (!excl || held[i].excl)
+                return AFS_OK;
+            pthread_rwlock_unlock(&fs->lock);
+            int status = pthread_rwlock_wrlock(&fs->lock);
+            if (status == 0) {
+                held[i].excl = true;
+                *locked = LOCK_UPGRADED;
+            }
+            else
+                pthread_rwlock_rdlock(&fs->lock);
+            return status;
+        }
+    }
+    if (nheld == MAX_HELD)
+        return ENOLCK;
+    int status = excl ? pthread_rwlock_wrlock(&fs->lock) : pthread_rwlock_rdlock(&fs->lock);
+    if (status == 0) {
+        held[nheld].fs = fs;
+        held[nheld++].excl = excl;
+        *locked = LOCK_TAKEN;
+    }
+    return status;
+}
+
+static void unlock_handle(acorn_fs *fs, int locked)
+{
+    if (locked != LOCK_HELD) {
+        unsigned i = 0;
+        while (held[i].fs != fs)
+            i++;
+        pthread_rwlock_unlock(&fs->lock);
+        if (locked == LOCK_UPGRADED) {
+            pthread_rwlock_rdlock(&fs->lock);
+            held[i].excl = false;
+        }
+        else
+            held[i] = held[--nheld];
+    }
+}
+
+/*
+ * A copy between two images holds the destination exclusively and
+ * the source shared.  Two copies going opposite ways between the same
+ * pair would each wait for the lock the other holds if the locks were
+ * taken destination first, so they are taken in address order.
+ */
+
+static int lock_copy(acorn_fs *dst, int *dst_locked, acorn_fs *src, int *src_locked)
+{
+    int status;
+    if (src < dst) {
+        if ((status = lock_handle(src, false, src_locked)) == AFS_OK)
+            if ((status = lock_handle(dst, true, dst_locked)) != AFS_OK)
+                unlock_handle(src, *src_locked);
+    }
+    else if ((status = lock_handle(dst, true, dst_locked)) == AFS_OK)
+        if ((status = lock_handle(src, false, src_locked)) != AFS_OK)
+            unlock_handle(dst, *dst_locked);
+    return status;
+}
+
+static void unlock_copy(acorn_fs *dst, int dst_locked, acorn_fs *src, int src_locked)
+{
+    unlock_handle(src, src_locked);
+    unlock_handle(dst, dst_locked);
+}
+
+/*
+ * The rdsect and wrsect entry points count each transfer and time
+ * the layout backend, which is kept in rdsect_io and wrsect_io.
+ */
+
+static int rdsect_counted(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    const char *caller = acorn_fs_caller;
+    acorn_fs_caller = NULL;
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status != AFS_OK)
+        return status;
+    count_seek(fs, ssect, size);
+    COUNT(fs->stats.reads, 1);
+    COUNT(fs->stats.sects_read, (size + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE);
+    COUNT(fs->stats.bytes_read, size);
+    if (trace_fp)
+        trace_xfer(fs, 'R', ssect, size, caller);
+    uint64_t start = now_ns();
+    status = fs->rdsect_io(fs, ssect, buf, size);
+    COUNT(fs->stats.read_ns, now_ns() - start);
+    unlock_handle(fs, locked);
+    return status;
+}
+
+static int wrsect_counted(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    const char *caller = acorn_fs_caller;
+    acorn_fs_caller = NULL;
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status != AFS_OK)
+        return status;
+    count_seek(fs, ssect, size);
+    COUNT(fs->stats.writes, 1);
+    COUNT(fs->stats.sects_written, (size + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE);
+    COUNT(fs->stats.bytes_written, size);
+    if (trace_fp)
+        trace_xfer(fs, 'W', ssect, size, caller);
+    uint64_t start = now_ns();
+    status = fs->wrsect_io(fs, ssect, buf, size);
+    COUNT(fs->stats.write_ns, now_ns() - start);
+    unlock_handle(fs, locked);
+    return status;
+}
+
+/*
+ * The entry points installed over the driver's own.
+ */
+
+static int locked_find(acorn_fs *fs, const char *adfs_name, acorn_fs_object *obj)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.find(fs, adfs_name, obj);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_glob(acorn_fs *fs, acorn_fs_object *start, const char *pattern, acorn_fs_cb cb, void *udata)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.glob(fs, start, pattern, cb, udata);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_walk(acorn_fs *fs, acorn_fs_object *start, acorn_fs_cb cb, void *udata)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.walk(fs, start, cb, udata);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_remove(acorn_fs *fs, acorn_fs_object *start, const char *pattern)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.remove(fs, start, pattern);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_load(acorn_fs *fs, acorn_fs_object *obj)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.load(fs, obj);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_read_range(acorn_fs *fs, acorn_fs_object *obj, unsigned offset, unsigned len, unsigned char *buf)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.read_range(fs, obj, offset, len, buf);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_save(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.save(fs, obj, dest, overwrite);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_write_range(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, unsigned offset, unsigned flags)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.write_range(fs, obj, dest, offset, flags);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_copy(acorn_fs *fs, acorn_fs *src, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite)
+{
+    int locked, src_locked;
+    int status = lock_copy(fs, &locked, src, &src_locked);
+    if (status == AFS_OK) {
+        status = fs->driver.copy(fs, src, obj, dest, overwrite);
+        unlock_copy(fs, locked, src, src_locked);
+    }
+    return status;
+}
+
+static int locked_mkdir(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.mkdir(fs, obj, dest);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_free_space(acorn_fs *fs, acorn_fs_extent_cb cb, void *udata)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.free_space(fs, cb, udata);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_check(acorn_fs *fs, const char *fsname, FILE *mfp)
+{
+    int locked;
+    int status = lock_handle(fs, false, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.check(fs, fsname, mfp);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_settitle(acorn_fs *fs, const char *title)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        status = fs->driver.settitle(fs, title);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static int locked_sync(acorn_fs *fs)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        if (fs->dirty)
+            status = fs->driver.sync(fs);
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+static void install_locks(acorn_fs *fs)
+{
+    fs->driver.find = fs->find;
+    fs->driver.glob = fs->glob;
+    fs->driver.walk = fs->walk;
+    fs->driver.remove = fs->remove;
+    fs->driver.load = fs->load;
+    fs->driver.read_range = fs->read_range;
+    fs->driver.save = fs->save;
+    fs->driver.write_range = fs->write_range;
+    fs->driver.copy = fs->copy;
+    fs->driver.mkdir = fs->mkdir;
+    fs->driver.free_space = fs->free_space;
+    fs->driver.check = fs->check;
+    fs->driver.settitle = fs->settitle;
+    fs->driver.sync = fs->sync;
+    fs->find = locked_find;
+    fs->glob = locked_glob;
+    fs->walk = locked_walk;
+    fs->remove = locked_remove;
+    fs->load = locked_load;
+    fs->read_range = locked_read_range;
+    fs->save = locked_save;
+    fs->write_range = locked_write_range;
+    fs->copy = locked_copy;
+    fs->mkdir = locked_mkdir;
+    fs->free_space = locked_free_space;
+    fs->check = locked_check;
+    fs->settitle = locked_settitle;
+    fs->sync = locked_sync;
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+}
+
+static void init_layout(acorn_fs *fs, int layout)
+{
+    fs->layout = layout;
+    fs->rdsect_io = backends[layout].rdsect;
+    fs->wrsect_io = backends[layout].wrsect;
+    fs->rdsect = rdsect_counted;
+    fs->wrsect = wrsect_counted;
+    memset(&fs->stats, 0, sizeof(fs->stats));
+    fs->next_sect = 0;
 }
 
 static int lock_file(FILE *fp, bool writable)
@@ -168,51 +868,207 @@ static int lock_file(FILE *fp, bool writable)
 #endif
 }
 
-static void init_link(acorn_fs *fs, FILE *fp, const char *filename)
+/*
+ * The registry is a hash table of open handles chained through next,
+ * each keeping a pointer to the link that points to it so it can be
+ * taken out without searching.  Handles with no references left are
+ * also on a doubly linked idle list, most recently closed first.
+ */
+
+struct acorn_fs_ctx {
+    pthread_mutex_t lock;
+    acorn_fs        **table;
+    unsigned        size;   // buckets, a power of two.
+    unsigned        count;
+    acorn_fs        *idle_head, *idle_tail;
+    unsigned        idle, idle_limit;
+};
+
+#define MIN_BUCKETS 16
+
+static acorn_fs_ctx default_ctx = { PTHREAD_MUTEX_INITIALIZER };
+
+static int file_key(const char *filename, uint64_t *dev, uint64_t *ino)
+{
+#ifdef WIN32
+    // No inode numbers, so use the full path name instead.
+    char path[_MAX_PATH];
+    if (!_fullpath(path, filename, sizeof(path)))
+        return errno;
+    *dev = 0;
+    *ino = acorn_fs_hash((const unsigned char *)path, strlen(path));
+#else
+    struct stat st;
+    if (stat(filename, &st))
+        return errno;
+    *dev = st.st_dev;
+    *ino = st.st_ino;
+#endif
+    return AFS_OK;
+}
+
+static unsigned key_hash(uint64_t dev, uint64_t ino, unsigned size)
+{
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (size - 1);
+}
+
+static void chain_add(acorn_fs **bucket, acorn_fs *fs)
+{
+    if ((fs->next = *bucket))
+        fs->next->link = &fs->next;
+    *bucket = fs;
+    fs->link = bucket;
+}
+
+static void chain_remove(acorn_fs *fs)
+{
+    if ((*fs->link = fs->next))
+        fs->next->link = fs->link;
+}
+
+static void grow_table(acorn_fs_ctx *ctx)
+{
+    unsigned size = ctx->size ? ctx->size * 2 : MIN_BUCKETS;
+    acorn_fs **table = calloc(size, sizeof(acorn_fs *));
+    if (table) { // if not, the chains just get longer.
+        for (unsigned i = 0; i < ctx->size; i++) {
+            acorn_fs *fs = ctx->table[i];
+            while (fs) {
+                acorn_fs *next = fs->next;
+                chain_add(table + key_hash(fs->dev, fs->ino, size), fs);
+                fs = next;
+            }
+        }
+        free(ctx->table);
+        ctx->table = table;
+        ctx->size = size;
+    }
+}
+
+static acorn_fs *lookup(acorn_fs_ctx *ctx, uint64_t dev, uint64_t ino)
+{
+    if (ctx->size)
+        for (acorn_fs *fs = ctx->table[key_hash(dev, ino, ctx->size)]; fs; fs = fs->next)
+            if (fs->dev == dev && fs->ino == ino)
+                return fs;
+    return NULL;
+}
+
+static void idle_remove(acorn_fs_ctx *ctx, acorn_fs *fs)
+{
+    if (fs->idle_prev)
+        fs->idle_prev->idle_next = fs->idle_next;
+    else
+        ctx->idle_head = fs->idle_next;
+    if (fs->idle_next)
+        fs->idle_next->idle_prev = fs->idle_prev;
+    else
+        ctx->idle_tail = fs->idle_prev;
+    ctx->idle--;
+}
+
+static void idle_add(acorn_fs_ctx *ctx, acorn_fs *fs)
+{
+    fs->idle_prev = NULL;
+    if ((fs->idle_next = ctx->idle_head))
+        fs->idle_next->idle_prev = fs;
+    else
+        ctx->idle_tail = fs;
+    ctx->idle_head = fs;
+    ctx->idle++;
+}
+
+/*
+ * Take the least recently used idle handles out of the registry until
+ * no more than the limit remain and return them chained through next
+ * to be closed once the registry lock is released.
+ */
+
+static acorn_fs *idle_evict(acorn_fs_ctx *ctx)
+{
+    acorn_fs *evicted = NULL;
+    while (ctx->idle > ctx->idle_limit) {
+        acorn_fs *fs = ctx->idle_tail;
+        idle_remove(ctx, fs);
+        chain_remove(fs);
+        ctx->count--;
+        fs->next = evicted;
+        evicted = fs;
+    }
+    return evicted;
+}
+
+static void init_link(acorn_fs *fs, FILE *fp, const char *filename, acorn_fs_ctx *ctx)
 {
     fs->fp = fp;
+    fs->deferred = false;
+    fs->dirty = false;
     strcpy(fs->filename, filename);
-    fs->next = open_list;
-    open_list = fs;
+    fs->ctx = ctx;
+    fs->refs = 1;
+    if (ctx->count >= ctx->size)
+        grow_table(ctx);
+    chain_add(ctx->table + key_hash(fs->dev, fs->ino, ctx->size), fs);
+    ctx->count++;
+    fs->simdev = NULL;
+    pthread_once(&simdev_once, simdev_init);
+    if (simdev_enabled)
+        simdev_attach(fs);
+    pthread_once(&trace_once, trace_init);
+    if (trace_fp)
+        trace_open(fs);
+    install_locks(fs);
 }
 
-acorn_fs *acorn_fs_open(const char *filename, bool writable)
+static acorn_fs *open_fs(acorn_fs_ctx *ctx, const char *filename, bool writable, int *status)
 {
-    for (acorn_fs *fs = open_list; fs; fs = fs->next)
-        if (!strcmp(fs->filename, filename))
-            return fs;
+    uint64_t dev = 0, ino = 0;
+    if ((*status = file_key(filename, &dev, &ino)) != AFS_OK)
+        return NULL;
+    acorn_fs *fs = lookup(ctx, dev, ino);
+    if (fs) {
+        if (!fs->refs++)
+            idle_remove(ctx, fs);
+        return fs;
+    }
+    if (!ctx->size) {
+        grow_table(ctx);
+        if (!ctx->size) {
+            *status = ENOMEM;
+            return NULL;
+        }
+    }
 
-    acorn_fs *fs = malloc(sizeof(acorn_fs) + strlen(filename));
+    fs = malloc(sizeof(acorn_fs) + strlen(filename));
     if (fs) {
+        fs->dev = dev;
+        fs->ino = ino;
+        fs->writable = writable;
+        fs->ro_fp = NULL;
         const char *mode = writable ? "rb+" : "rb";
         FILE *fp = fopen(filename, mode);
         if (fp) {
-            int status = lock_file(fp, writable);
-            if (status == AFS_OK) {
-                if ((status = check_adfs(fp, 0x200, 0x6fa, "Hugo", 5)) == AFS_OK) {
+            if ((*status = lock_file(fp, writable)) == AFS_OK) {
+                if ((*status = check_adfs(fp, 0x200, 0x6fa, "Hugo", 5)) == AFS_OK) {
                     const char *ext = strrchr(filename, '.');
-                    if (ext && !strcasecmp(ext, ".adl")) {
-                        fs->rdsect = rdsect_ileave16;
-                        fs->wrsect = wrsect_ileave16;
-                    }
-                    else {
-                        fs->rdsect = rdsect_simple;
-                        fs->wrsect = wrsect_simple;
-                    }
+                    if (ext && !strcasecmp(ext, ".adl"))
+                        init_layout(fs, AFS_LAYOUT_ILEAVE16);
+                    else
+                        init_layout(fs, AFS_LAYOUT_SIMPLE);
                     acorn_fs_adfs_init(fs);
-                    init_link(fs, fp, filename);
+                    init_link(fs, fp, filename, ctx);
                     return fs;
                 }
-                else if (status == AFS_NOT_ACORN) {
-                    if ((status = check_adfs(fp, 0x400, 0xdf4, "\0H\0u\0g\0o", 10)) == AFS_OK) {
-                        fs->rdsect = rdsect_ide;
-                        fs->wrsect = wrsect_ide;
+                else if (*status == AFS_NOT_ACORN) {
+                    if ((*status = check_adfs(fp, 0x400, 0xdf4, "\0H\0u\0g\0o", 10)) == AFS_OK) {
+                        init_layout(fs, AFS_LAYOUT_IDE);
                         acorn_fs_adfs_init(fs);
-                        init_link(fs, fp, filename);
+                        init_link(fs, fp, filename, ctx);
                         return fs;
                     }
                 }
-                if (status == AFS_NOT_ACORN || status == AFS_BAD_EOF) {
+                if (*status == AFS_NOT_ACORN || *status == AFS_BAD_EOF) {
                     unsigned char *dir = malloc(0x200);
                     if (dir) {
                         if (fseek(fp, 0L, SEEK_SET) == 0) {
@@ -220,78 +1076,543 @@ acorn_fs *acorn_fs_open(const char *filename, bool writable)
                                 fs->priv = dir;
                                 if (acorn_fs_dfs_check(fs, NULL, NULL) == AFS_OK) {
                                     const char *ext = strrchr(filename, '.');
-                                    if (ext && !strcasecmp(ext, ".dsd")) {
-                                        fs->rdsect = rdsect_ileave10;
-                                        fs->wrsect = wrsect_ileave10;
-                                    }
-                                    else {
-                                        fs->rdsect = rdsect_simple;
-                                        fs->wrsect = wrsect_simple;
-                                    }
+                                    if (ext && !strcasecmp(ext, ".dsd"))
+                                        init_layout(fs, AFS_LAYOUT_ILEAVE10);
+                                    else
+                                        init_layout(fs, AFS_LAYOUT_SIMPLE);
                                     acorn_fs_dfs_init(fs);
-                                    init_link(fs, fp, filename);
+                                    init_link(fs, fp, filename, ctx);
                                     return fs;
                                 }
+                                *status = AFS_NOT_ACORN;
                             }
-                            else if (!ferror(fp))
-                                errno = AFS_BAD_EOF;
+                            else
+                                *status = ferror(fp) ? errno : AFS_BAD_EOF;
                         }
+                        else
+                            *status = errno;
+                        free(dir);
                     }
+                    else
+                        *status = errno;
                 }
             }
             fclose(fp);
-            errno = status;
         }
+        else
+            *status = errno;
         free(fs);
     }
+    else
+        *status = errno;
     return NULL;
 }
 
+/*
+ * Check a newly opened stream is still the file the handle was opened
+ * on, not one renamed over it since.
+ */
+
+static int same_file(acorn_fs *fs, FILE *fp)
+{
+#ifndef WIN32
+    struct stat st;
+    if (fstat(fileno(fp), &st))
+        return errno;
+    if (st.st_dev != fs->dev || st.st_ino != fs->ino)
+        return ESTALE;
+#endif
+    return AFS_OK;
+}
+
+/*
+ * An image already open for reading is being opened for writing, by
+ * the same name or another, so the file is reopened read-write under
+ * the handle.  The new stream is only used once it is known to be the
+ * same file and holds the write lock; until then the handle keeps the
+ * old one.  Closing any descriptor for a file drops all the process's
+ * locks on it, so the old stream is kept open until the handle closes
+ * and, if the new one has to be closed after locking it failed, the
+ * read lock is taken again.
+ */
+
+static int make_writable(acorn_fs *fs, const char *filename)
+{
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK) {
+        if (!fs->writable) {
+            FILE *fp = fopen(filename, "rb+");
+            if (!fp)
+                status = errno;
+            else if ((status = same_file(fs, fp)) != AFS_OK)
+                fclose(fp);
+            else if ((status = lock_file(fp, true)) != AFS_OK) {
+                fclose(fp);
+                lock_file(fs->fp, false);
+            }
+            else {
+                fs->ro_fp = fs->fp;
+                fs->fp = fp;
+                fs->writable = true;
+            }
+        }
+        unlock_handle(fs, locked);
+    }
+    return status;
+}
+
+acorn_fs *acorn_fs_ctx_open(acorn_fs_ctx *ctx, const char *filename, bool writable, int *status)
+{
+    pthread_mutex_lock(&ctx->lock);
+    acorn_fs *fs = open_fs(ctx, filename, writable, status);
+    pthread_mutex_unlock(&ctx->lock);
+    if (fs && writable && !fs->writable && (*status = make_writable(fs, filename)) != AFS_OK) {
+        acorn_fs_close(fs);
+        fs = NULL;
+    }
+    return fs;
+}
+
+acorn_fs *acorn_fs_open_err(const char *filename, bool writable, int *status)
+{
+    return acorn_fs_ctx_open(&default_ctx, filename, writable, status);
+}
+
+acorn_fs *acorn_fs_open(const char *filename, bool writable)
+{
+    int status;
+    acorn_fs *fs = acorn_fs_open_err(filename, writable, &status);
+    if (!fs)
+        errno = status;
+    return fs;
+}
+
 static int close_fs(acorn_fs *fs)
 {
-    int status = AFS_OK;
-    if (fs->priv)
-        free(fs->priv);
+    // Through lock_handle so the sync's own sector writes pass through.
+    int locked;
+    int status = lock_handle(fs, true, &locked);
+    if (status == AFS_OK && fs->dirty)
+        status = fs->driver.sync(fs);
+    if (stats_fp)
+        acorn_fs_print_stats(fs, stats_fp);
+    fs->release(fs);
     if (fs->fp)
-        if (fclose(fs->fp))
+        if (fclose(fs->fp) && status == AFS_OK)
             status = errno;
+    if (fs->ro_fp)
+        fclose(fs->ro_fp);
+    unlock_handle(fs, locked);
+    pthread_rwlock_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+    free(fs->simdev);
     free(fs);
     return status;
 }
 
+static int close_list(acorn_fs *fs)
+{
+    int status = AFS_OK;
+    while (fs) {
+        acorn_fs *next = fs->next;
+        int result = close_fs(fs);
+        if (result != AFS_OK)
+            status = result;
+        fs = next;
+    }
+    return status;
+}
+
 int acorn_fs_close(acorn_fs *fs)
 {
-    if (fs == open_list) {
-        open_list = fs->next;
-        return close_fs(fs);
+    acorn_fs_ctx *ctx = fs->ctx;
+    // Write back this user's updates while the reference keeps it open.
+    int status = acorn_fs_sync(fs);
+    pthread_mutex_lock(&ctx->lock);
+    if (--fs->refs) {
+        pthread_mutex_unlock(&ctx->lock);
+        return status;
+    }
+    acorn_fs *evicted;
+    if (ctx->idle_limit) {
+        idle_add(ctx, fs);
+        evicted = idle_evict(ctx);
     }
     else {
-        acorn_fs *prev = open_list;
-        acorn_fs *cur = prev->next;
-        while (cur) {
-            if (fs == cur) {
-                prev->next = cur->next;
-                return close_fs(fs);
-            }
-            prev = cur;
-            cur = cur->next;
+        chain_remove(fs);
+        ctx->count--;
+        fs->next = NULL;
+        evicted = fs;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    int result = close_list(evicted);
+    return status == AFS_OK ? result : status;
+}
+
+int acorn_fs_ctx_close_all(acorn_fs_ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    acorn_fs *list = NULL;
+    for (unsigned i = 0; i < ctx->size; i++) {
+        acorn_fs *fs = ctx->table[i];
+        while (fs) {
+            acorn_fs *next = fs->next;
+            fs->next = list;
+            list = fs;
+            fs = next;
         }
+        ctx->table[i] = NULL;
     }
-    return AFS_OK;
+    ctx->count = 0;
+    ctx->idle_head = ctx->idle_tail = NULL;
+    ctx->idle = 0;
+    pthread_mutex_unlock(&ctx->lock);
+    return close_list(list);
 }
 
 int acorn_fs_close_all(void)
+{
+    return acorn_fs_ctx_close_all(&default_ctx);
+}
+
+int acorn_fs_ctx_idle_limit(acorn_fs_ctx *ctx, unsigned limit)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->idle_limit = limit;
+    acorn_fs *evicted = idle_evict(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    return close_list(evicted);
+}
+
+int acorn_fs_idle_limit(unsigned limit)
+{
+    return acorn_fs_ctx_idle_limit(&default_ctx, limit);
+}
+
+acorn_fs_ctx *acorn_fs_ctx_new(void)
+{
+    acorn_fs_ctx *ctx = calloc(1, sizeof(acorn_fs_ctx));
+    if (ctx)
+        pthread_mutex_init(&ctx->lock, NULL);
+    return ctx;
+}
+
+int acorn_fs_ctx_free(acorn_fs_ctx *ctx)
+{
+    int status = acorn_fs_ctx_close_all(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx->table);
+    free(ctx);
+    return status;
+}
+
+int acorn_fs_sync(acorn_fs *fs)
+{
+    return fs->sync(fs);
+}
+
+#ifdef __linux__
+
+/*
+ * Copy a run of sectors between two plain images with copy_file_range
+ * so the data never passes through user space and, where the host
+ * filesystem supports it, the kernel can share the blocks (reflink).
+ * Returns ENOSYS etc. untouched so the caller can fall back.
+ */
+
+static int xfer_kernel(acorn_fs *dst, int dsect, acorn_fs *src, int ssect, unsigned size)
 {
     int status = AFS_OK;
-    acorn_fs *ent = open_list;
-    while (ent) {
-        acorn_fs *next = ent->next;
-        int result = close_fs(ent);
-        if (result != AFS_OK)
-            status = result;
-        ent = next;
+    loff_t in_off = (loff_t)ssect * ACORN_FS_SECT_SIZE;
+    loff_t out_off = (loff_t)dsect * ACORN_FS_SECT_SIZE;
+    if (fflush(dst->fp) || fflush(src->fp))
+        return errno;
+    while (size) {
+        ssize_t bytes = copy_file_range(fileno(src->fp), &in_off, fileno(dst->fp), &out_off, size, 0);
+        COUNT(dst->stats.io_calls, 1);
+        if (bytes < 0) {
+            status = errno;
+            break;
+        }
+        if (bytes == 0) {
+            status = AFS_BAD_EOF;
+            break;
+        }
+        size -= bytes;
+    }
+    // Discard anything stdio has buffered for either stream.
+    fflush(src->fp);
+    fflush(dst->fp);
+    return status;
+}
+
+#endif
+
+/*
+ * Both drivers keep a file in consecutive sectors from obj->sector, so
+ * part of one is read by transferring the sectors covering it.  A
+ * part sector at the start goes through a buffer; the rest is read
+ * straight into the caller's.
+ */
+
+int acorn_fs_read_contig(acorn_fs *fs, acorn_fs_object *obj, unsigned offset, unsigned len, unsigned char *buf)
+{
+    if (offset > obj->length || len > obj->length - offset)
+        return EINVAL;
+    int ssect = obj->sector + offset / ACORN_FS_SECT_SIZE;
+    unsigned skip = offset % ACORN_FS_SECT_SIZE;
+    if (skip && len) {
+        unsigned char sect[ACORN_FS_SECT_SIZE];
+        unsigned chunk = ACORN_FS_SECT_SIZE - skip;
+        if (chunk > len)
+            chunk = len;
+        int status = acorn_fs_rdsect(fs, ssect++, sect, skip + chunk);
+        if (status != AFS_OK)
+            return status;
+        memcpy(buf, sect + skip, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return len ? acorn_fs_rdsect(fs, ssect, buf, len) : AFS_OK;
+}
+
+static const char xfer_caller[] = "acorn_fs_xfer";
+
+static int xfer(acorn_fs *dst, int dsect, acorn_fs *src, int ssect, unsigned size)
+{
+#ifdef __linux__
+    if (dst->layout == AFS_LAYOUT_SIMPLE && src->layout == AFS_LAYOUT_SIMPLE && !dst->simdev && !src->simdev) {
+        uint64_t start = now_ns();
+        int status = xfer_kernel(dst, dsect, src, ssect, size);
+        if (status != ENOSYS && status != EXDEV && status != EINVAL && status != EOPNOTSUPP) {
+            // Count it as one read and one write.
+            unsigned sects = (size + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE;
+            count_seek(src, ssect, size);
+            count_seek(dst, dsect, size);
+            COUNT(src->stats.reads, 1);
+            COUNT(src->stats.sects_read, sects);
+            COUNT(src->stats.bytes_read, size);
+            COUNT(dst->stats.writes, 1);
+            COUNT(dst->stats.sects_written, sects);
+            COUNT(dst->stats.bytes_written, size);
+            COUNT(dst->stats.write_ns, now_ns() - start);
+            if (trace_fp) {
+                trace_xfer(src, 'R', ssect, size, xfer_caller);
+                trace_xfer(dst, 'W', dsect, size, xfer_caller);
+            }
+            return status;
+        }
+    }
+#endif
+    unsigned char buf[XFER_SECTS * ACORN_FS_SECT_SIZE];
+    while (size) {
+        unsigned chunk = size;
+        if (chunk > sizeof(buf))
+            chunk = sizeof(buf);
+        acorn_fs_caller = xfer_caller;
+        int status = src->rdsect(src, ssect, buf, chunk);
+        if (status != AFS_OK)
+            return status;
+        acorn_fs_caller = xfer_caller;
+        if ((status = dst->wrsect(dst, dsect, buf, chunk)) != AFS_OK)
+            return status;
+        ssect += XFER_SECTS;
+        dsect += XFER_SECTS;
+        size -= chunk;
+    }
+    return AFS_OK;
+}
+
+int acorn_fs_xfer(acorn_fs *dst, int dsect, acorn_fs *src, int ssect, unsigned size)
+{
+    int dst_locked, src_locked;
+    int status = lock_copy(dst, &dst_locked, src, &src_locked);
+    if (status == AFS_OK) {
+        status = xfer(dst, dsect, src, ssect, size);
+        unlock_copy(dst, dst_locked, src, src_locked);
+    }
+    return status;
+}
+
+/*
+ * Sparsifying works on the image file itself, so each free run of
+ * sectors is turned into the byte ranges it occupies in the file:
+ * twice the size for IDE and one piece per track when interleaved.
+ */
+
+typedef struct {
+    bool     dry_run;
+    off_t    file_size;
+    off_t    block;
+    off_t    offset, end; // free bytes not yet released.
+    uint64_t bytes;
+} sparsify_ctx;
+
+#ifdef __linux__
+
+static off_t data_bytes(acorn_fs *fs, off_t offset, off_t end)
+{
+    // Count only what is not a hole already.
+    int fd = fileno(fs->fp);
+    off_t bytes = 0;
+    while (offset < end) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0)
+            return errno == ENXIO ? bytes : end - offset + bytes;
+        if (data >= end)
+            break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end)
+            hole = end;
+        bytes += hole - data;
+        offset = hole;
+    }
+    return bytes;
+}
+
+#endif
+
+/*
+ * Zero the parts of a range that are not zero already, counting them.
+ * This covers what cannot be punched out and hosts with no punching.
+ */
+
+static int zero_bytes(acorn_fs *fs, sparsify_ctx *ctx, off_t offset, off_t end)
+{
+    unsigned char buf[XFER_SECTS * ACORN_FS_SECT_SIZE];
+    while (offset < end) {
+        size_t chunk = end - offset < sizeof(buf) ? end - offset : sizeof(buf);
+        int status = read_at(fs, buf, chunk, offset);
+        if (status != AFS_OK)
+            return status;
+        size_t i = 0;
+        while (i < chunk && !buf[i])
+            i++;
+        if (i < chunk) {
+            ctx->bytes += chunk;
+            if (!ctx->dry_run) {
+                memset(buf, 0, chunk);
+                if ((status = write_at(fs, buf, chunk, offset)) != AFS_OK)
+                    return status;
+            }
+        }
+        offset += chunk;
+    }
+    return AFS_OK;
+}
+
+/*
+ * Only whole blocks of the host filing system can become holes, so a
+ * range is punched from the first block boundary in it to the last
+ * and the pieces either side are zeroed.  Without hole punching the
+ * whole range is zeroed, which at least lets compressing or
+ * deduplicating storage drop it.
+ */
+
+static int release_bytes(acorn_fs *fs, sparsify_ctx *ctx, off_t offset, off_t end)
+{
+    if (end > ctx->file_size)
+        end = ctx->file_size;
+#ifdef __linux__
+    off_t first = (offset + ctx->block - 1) / ctx->block * ctx->block;
+    off_t last = end / ctx->block * ctx->block;
+    if (first >= last)
+        return zero_bytes(fs, ctx, offset, end);
+    int status = zero_bytes(fs, ctx, offset, first);
+    if (status != AFS_OK)
+        return status;
+    off_t bytes = data_bytes(fs, first, last);
+    if (ctx->dry_run || !bytes)
+        ctx->bytes += bytes;
+    else {
+        COUNT(fs->stats.io_calls, 1);
+        if (fallocate(fileno(fs->fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first, last - first) == 0)
+            ctx->bytes += bytes;
+        else if (errno == EOPNOTSUPP || errno == ENOSYS)
+            status = zero_bytes(fs, ctx, first, last);
+        else
+            status = errno;
+    }
+    return status == AFS_OK ? zero_bytes(fs, ctx, last, end) : status;
+#else
+    return zero_bytes(fs, ctx, offset, end);
+#endif
+}
+
+/*
+ * Ranges that follow on from each other in the file are joined before
+ * being released so blocks spanning two free runs are not missed.
+ */
+
+static int sparsify_bytes(acorn_fs *fs, sparsify_ctx *ctx, off_t offset, off_t len)
+{
+    if (offset == ctx->end) {
+        ctx->end += len;
+        return AFS_OK;
+    }
+    int status = release_bytes(fs, ctx, ctx->offset, ctx->end);
+    ctx->offset = offset;
+    ctx->end = offset + len;
+    return status;
+}
+
+static int sparsify_run(acorn_fs *fs, unsigned sector, unsigned count, void *udata)
+{
+    sparsify_ctx *ctx = udata;
+    int spt = fs->layout == AFS_LAYOUT_ILEAVE16 ? 16 : 10;
+    switch (fs->layout) {
+        case AFS_LAYOUT_SIMPLE:
+            return sparsify_bytes(fs, ctx, (off_t)sector * ACORN_FS_SECT_SIZE, (off_t)count * ACORN_FS_SECT_SIZE);
+        case AFS_LAYOUT_IDE:
+            return sparsify_bytes(fs, ctx, (off_t)sector * ACORN_FS_SECT_SIZE * 2, (off_t)count * ACORN_FS_SECT_SIZE * 2);
+        default:
+            while (count) {
+                unsigned chunk = spt - sector % spt;
+                if (chunk > count)
+                    chunk = count;
+                int status = sparsify_bytes(fs, ctx, ileave_offset(sector, spt), (off_t)chunk * ACORN_FS_SECT_SIZE);
+                if (status != AFS_OK)
+                    return status;
+                sector += chunk;
+                count -= chunk;
+            }
+            return AFS_OK;
+    }
+}
+
+int acorn_fs_sparsify(acorn_fs *fs, bool dry_run, uint64_t *bytes)
+{
+    sparsify_ctx ctx;
+    struct stat st;
+    int locked;
+    if (!dry_run && !fs->writable)
+        return EBADF;
+    // With deferred updates the map in memory may already have given
+    // up space the directories on the disc still use, so they are
+    // written first.
+    int status = lock_handle(fs, !dry_run || fs->deferred, &locked);
+    if (status != AFS_OK)
+        return status;
+    ctx.dry_run = dry_run;
+    ctx.offset = ctx.end = 0;
+    ctx.bytes = 0;
+    if (fs->dirty)
+        status = fs->driver.sync(fs);
+    if (status == AFS_OK) {
+        if (fflush(fs->fp) || fstat(fileno(fs->fp), &st))
+            status = errno;
+        else {
+            ctx.file_size = st.st_size;
+#ifdef __linux__
+            ctx.block = st.st_blksize;
+#endif
+            if ((status = fs->driver.free_space(fs, sparsify_run, &ctx)) == AFS_OK)
+                status = release_bytes(fs, &ctx, ctx.offset, ctx.end);
+        }
     }
-    open_list = NULL;
+    unlock_handle(fs, locked);
+    *bytes = ctx.bytes;
     return status;
 }
 
@@ -344,3 +1665,53 @@ int acorn_fs_info(acorn_fs_object *obj, FILE *fp)
     if (a & AFS_ATTR_PRIV)   str[8] = 'P';
     return fprintf(fp, "%.9s %08X %08X %'10d %06X", str, obj->load_addr, obj->exec_addr, obj->length, obj->sector);
 }
+
+/*
+ * A 64-bit FNV-1a hash, used to compare file contents without
+ * keeping both copies.
+ */
+
+uint64_t acorn_fs_hash(const unsigned char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const unsigned char *end = data + len;
+    while (data < end) {
+        hash ^= *data++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void acorn_fs_get_stats(acorn_fs *fs, acorn_fs_stats *stats)
+{
+    *stats = fs->stats;
+}
+
+void acorn_fs_reset_stats(acorn_fs *fs)
+{
+    memset(&fs->stats, 0, sizeof(fs->stats));
+}
+
+void acorn_fs_print_stats(acorn_fs *fs, FILE *fp)
+{
+    const acorn_fs_stats *st = &fs->stats;
+    const char *fn = fs->filename;
+    fprintf(fp, "%s: %'llu sectors read in %'lu calls, %'llu bytes, %.3fms\n", fn, st->sects_read, st->reads, st->bytes_read, st->read_ns / 1e6);
+    fprintf(fp, "%s: %'llu sectors written in %'lu calls, %'llu bytes, %.3fms\n", fn, st->sects_written, st->writes, st->bytes_written, st->write_ns / 1e6);
+    fprintf(fp, "%s: %'lu seeks over %'llu sectors, %'lu host I/O calls\n", fn, st->seeks, st->seek_dist, st->io_calls);
+    fprintf(fp, "%s: %'lu directory loads, %'lu cache hits, %'lu directory writes\n", fn, st->dir_loads, st->dir_hits, st->dir_writes);
+    fprintf(fp, "%s: %'lu map loads, %'lu map writes\n", fn, st->map_loads, st->map_writes);
+    if (fs->simdev)
+        fprintf(fp, "%s: %.3fms simulated device time\n", fn, st->sim_ns / 1e6);
+}
+
+/*
+ * Print the statistics for each image as it is closed, after any
+ * deferred updates have been written, so tools need only arrange to
+ * close their images.
+ */
+
+void acorn_fs_stats_at_close(FILE *fp)
+{
+    stats_fp = fp;
+}
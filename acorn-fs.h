@@ -2,6 +2,7 @@
 #define ACORN_FS_INC
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,6 +10,7 @@
 #define ACORN_FS_SECT_SIZE 256
 #define ACORN_FS_MAX_NAME   12
 #define ACORN_FS_MAX_PATH  256
+#define ACORN_FS_ADFS_DIR_SIZE 1280
 
 #define AFS_OK          0
 #define AFS_BAD_EOF    -1
@@ -31,6 +33,11 @@
 #define AFS_ATTR_PRIV   0x0080
 #define AFS_ATTR_DIR    0x0100
 
+#define AFS_LAYOUT_SIMPLE   0
+#define AFS_LAYOUT_IDE      1
+#define AFS_LAYOUT_ILEAVE16 2
+#define AFS_LAYOUT_ILEAVE10 3
+
 typedef struct {
     char          name[ACORN_FS_MAX_NAME+1];
     unsigned      load_addr;
@@ -41,9 +48,84 @@ typedef struct {
     unsigned char *data;
 } acorn_fs_object;
 
+/*
+ * Counters kept for each open image.  Sector reads and writes are
+ * counted as they pass through rdsect and wrsect to the layout
+ * backend, which also counts its calls into the host I/O layer.  A
+ * seek is any access that does not follow on from the previous one.
+ */
+
+typedef struct {
+    unsigned long      reads;       // rdsect calls.
+    unsigned long      writes;      // wrsect calls.
+    unsigned long long sects_read;
+    unsigned long long sects_written;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long      seeks;
+    unsigned long long seek_dist;   // sectors.
+    unsigned long      io_calls;    // fseek, fread, fwrite etc.
+    unsigned long      dir_loads;
+    unsigned long      dir_hits;    // served from the directory cache.
+    unsigned long      dir_writes;
+    unsigned long      map_loads;
+    unsigned long      map_writes;
+    uint64_t           read_ns;     // time in the rdsect backend.
+    uint64_t           write_ns;    // time in the wrsect backend.
+    uint64_t           sim_ns;      // simulated device latency.
+} acorn_fs_stats;
+
 typedef struct acorn_fs acorn_fs;
+typedef struct acorn_fs_ctx acorn_fs_ctx;
 
 typedef int (*acorn_fs_cb)(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path);
+typedef int (*acorn_fs_extent_cb)(acorn_fs *fs, unsigned sector, unsigned count, void *udata);
+
+/*
+ * read_range reads len bytes from offset in a file found by find or
+ * glob into buf, transferring only the sectors that cover them, and
+ * fails with EINVAL if the range runs past the end of the file.
+ *
+ * write_range writes obj->length bytes from obj->data at offset in
+ * the existing file named obj->name in directory dest, growing it as
+ * needed, and writes only the sectors the data falls in.  With
+ * ACORN_FS_APPEND the offset is the current length and with
+ * ACORN_FS_TRUNC the file ends after the data.  The offset may not be
+ * past the end of the file.  DFS does not support it (ENOSYS).
+ *
+ * free_space calls cb for each run of free sectors, in order of
+ * sector: the extents in the ADFS free space map or the gaps between
+ * the files in a DFS catalogue.
+ *
+ * Handles may be shared between threads.  The entry points in
+ * acorn_fs lock the handle, shared for find, glob, walk, load,
+ * read_range, free_space, check and rdsect and exclusive for the
+ * others, and then call the driver's own functions, kept in driver.
+ * A thread that already holds the lock, such as a driver calling its
+ * own entry points or a glob callback, passes straight through.  An
+ * update made while the thread holds only the shared lock gives that
+ * up for the exclusive lock and takes it back afterwards.
+ */
+
+#define ACORN_FS_APPEND 0x01
+#define ACORN_FS_TRUNC  0x02
+
+typedef struct {
+    int (*find)(acorn_fs *fs, const char *adfs_name, acorn_fs_object *obj);
+    int (*glob)(acorn_fs *fs, acorn_fs_object *start, const char *pattern, acorn_fs_cb cb, void *udata);
+    int (*walk)(acorn_fs *fs, acorn_fs_object *start, acorn_fs_cb cb, void *udata);
+    int (*remove)(acorn_fs *fs, acorn_fs_object *start, const char *pattern);
+    int (*load)(acorn_fs *fs, acorn_fs_object *obj);
+    int (*read_range)(acorn_fs *fs, acorn_fs_object *obj, unsigned offset, unsigned len, unsigned char *buf);
+    int (*save)(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite);
+    int (*write_range)(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, unsigned offset, unsigned flags);
+    int (*copy)(acorn_fs *fs, acorn_fs *src, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite);
+    int (*mkdir)(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest);
+    int (*free_space)(acorn_fs *fs, acorn_fs_extent_cb cb, void *udata);
+    int (*check)(acorn_fs *fs, const char *fsname, FILE *mfp);
+    int (*settitle)(acorn_fs *fs, const char *title);
+    int (*sync)(acorn_fs *fs);
+} acorn_fs_ops;
 
 struct acorn_fs {
     int (*find)(acorn_fs *fs, const char *adfs_name, acorn_fs_object *obj);
@@ -51,29 +133,210 @@ struct acorn_fs {
     int (*walk)(acorn_fs *fs, acorn_fs_object *start, acorn_fs_cb cb, void *udata);
     int (*remove)(acorn_fs *fs, acorn_fs_object *start, const char *pattern);
     int (*load)(acorn_fs *fs, acorn_fs_object *obj);
+    int (*read_range)(acorn_fs *fs, acorn_fs_object *obj, unsigned offset, unsigned len, unsigned char *buf);
     int (*save)(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite);
+    int (*write_range)(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest, unsigned offset, unsigned flags);
+    int (*copy)(acorn_fs *fs, acorn_fs *src, acorn_fs_object *obj, acorn_fs_object *dest, bool overwrite);
     int (*mkdir)(acorn_fs *fs, acorn_fs_object *obj, acorn_fs_object *dest);
+    int (*free_space)(acorn_fs *fs, acorn_fs_extent_cb cb, void *udata);
     int (*check)(acorn_fs *fs, const char *fsname, FILE *mfp);
     int (*rdsect)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
     int (*wrsect)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
     int (*settitle)(acorn_fs *fs, const char *title);
+    int (*sync)(acorn_fs *fs);
+    void (*release)(acorn_fs *fs);
+    int (*rdsect_io)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+    int (*wrsect_io)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+    acorn_fs_stats stats;
+    unsigned next_sect; // follows the last access, for counting seeks.
+    unsigned trace_id;
+    void *simdev;       // simulated device, see ACORN_FS_SIMDEV.
+    acorn_fs_ops driver;
+    pthread_rwlock_t lock;
+    pthread_mutex_t cache_lock; // driver caches filled under the shared lock.
+    acorn_fs_ctx *ctx;  // the registry the handle is open in.
+    uint64_t dev, ino;  // identity of the image file, the registry key.
+    unsigned refs;      // opens not yet matched by a close.
+    acorn_fs **link;    // the pointer to this handle in its hash chain.
+    acorn_fs *idle_prev, *idle_next; // idle handles, most recent first.
     FILE *fp;
+    FILE *ro_fp;        // the stream fp replaced when made writable.
     void *priv;
-    acorn_fs *next;
+    int layout;
+    bool writable;
+    bool deferred; // hold directory/map updates until sync.
+    bool dirty;    // deferred updates are pending.
+    acorn_fs *next; // hash chain.
     char filename[1];
 };
 
+/*
+ * The library is built as libacornfs with the API below exported
+ * under the ACORNFS_1 symbol version, with later additions under
+ * ACORNFS_2 and so on.  ACORN_FS_API_VERSION is raised when functions
+ * are added.  Programs call through struct acorn_fs directly, so
+ * any change to its layout raises LIB_MAJOR in the Makefile, and with
+ * it the soname.
+ */
+
+#define ACORN_FS_API_VERSION 6
+
 // API Functions.
 extern acorn_fs *acorn_fs_open(const char *filename, bool writable);
+/*
+ * As acorn_fs_open but the reason for failing, an errno value or one
+ * of the AFS_ codes, is stored in *status rather than errno.
+ */
+extern acorn_fs *acorn_fs_open_err(const char *filename, bool writable, int *status);
 extern int acorn_fs_close(acorn_fs *fs);
 extern int acorn_fs_close_all(void);
+extern int acorn_fs_sync(acorn_fs *fs);
 extern const char *acorn_fs_strerr(int status);
 extern void acorn_fs_free_obj(acorn_fs_object *obj);
 extern int acorn_fs_info(acorn_fs_object *obj, FILE *fp);
+extern uint64_t acorn_fs_hash(const unsigned char *data, size_t len);
+extern void acorn_fs_get_stats(acorn_fs *fs, acorn_fs_stats *stats);
+extern void acorn_fs_reset_stats(acorn_fs *fs);
+extern void acorn_fs_print_stats(acorn_fs *fs, FILE *fp);
+extern void acorn_fs_stats_at_close(FILE *fp);
+
+/*
+ * Open images are kept in a registry keyed by the device and inode
+ * of the image file, so opening an image that is already open, by
+ * any name, returns the same handle and counts another reference.
+ * acorn_fs_close drops one reference; when the last goes the handle
+ * is synced and closed or, if the registry has an idle limit, kept
+ * on a least recently used list from which the oldest are closed
+ * once there are more than the limit.  The limit is zero by default.
+ * acorn_fs_open uses one registry for the process; a thread or
+ * service can keep its own with a context, closed as a whole with
+ * acorn_fs_ctx_free.  The host file lock does not keep two contexts
+ * in one process from opening the same image, so one that is to be
+ * written should be open in only one context.
+ */
+
+extern acorn_fs_ctx *acorn_fs_ctx_new(void);
+extern acorn_fs *acorn_fs_ctx_open(acorn_fs_ctx *ctx, const char *filename, bool writable, int *status);
+extern int acorn_fs_ctx_close_all(acorn_fs_ctx *ctx);
+extern int acorn_fs_ctx_free(acorn_fs_ctx *ctx);
+extern int acorn_fs_ctx_idle_limit(acorn_fs_ctx *ctx, unsigned limit);
+extern int acorn_fs_idle_limit(unsigned limit);
+
+/*
+ * acorn_fs_sparsify releases the parts of the image file that lie in
+ * the filing system's free space, punching holes where the host
+ * supports it and otherwise writing zeros, and sets *bytes to the
+ * size of those parts that were not already holes.  With dry_run the
+ * image is not changed, only measured.
+ */
+
+extern int acorn_fs_sparsify(acorn_fs *fs, bool dry_run, uint64_t *bytes);
+
+/*
+ * When the environment variable ACORN_FS_TRACE names a file, each
+ * sector transfer is appended to it as a record.  A trace starts with
+ * ACORN_FS_TRACE_MAGIC and every record begins with the same 24 byte
+ * header, all fields little-endian:
+ *
+ *   0  type    'R' read, 'W' write, 'O' image opened, 'N' caller name
+ *   2  image   image number, from the 'O' record
+ *   4  caller  caller number, from the 'N' record, 0 if unknown
+ *   8  sector  first sector ('O': layout)
+ *  12  length  bytes ('O' and 'N': length of the name that follows)
+ *  16  time    nanoseconds since the trace was started
+ *
+ * A %p in the file name is replaced by the process id.
+ */
+
+#define ACORN_FS_TRACE_MAGIC "AFSTRC1\n"
+#define ACORN_FS_TRACE_HDR   24
+
+/*
+ * ACORN_FS_SIMDEV puts a simulated device between each image and its
+ * layout so benchmarks see the latency of real hardware.  It is a
+ * comma separated list of a preset (floppy or scsi) and settings,
+ * times in microseconds:
+ *
+ *   spt=<n>     sectors per track (default 16, or 10 for DFS)
+ *   settle=<t>  fixed cost of each non-sequential access
+ *   seek=<t>    cost per track of seek distance
+ *   track=<t>   cost of arriving at a different track
+ *   sector=<t>  cost per sector transferred
+ *   sleep       sleep for the latency rather than only counting it
+ *
+ * The simulated time is kept in the sim_ns statistic.
+ */
+
+// Native filesystem helpers.
+extern void acorn_fs_name_n2a(const char *native_fn, char *acorn_fn);
+extern void acorn_fs_name_a2n(const char *acorn_fn, char *native_fn);
+extern void acorn_fs_parse_inf(acorn_fs_object *obj, const char *filename);
+extern void acorn_fs_parse_inf_fp(acorn_fs_object *obj, FILE *fp, const char *filename);
+extern bool acorn_fs_is_inf(const char *path);
+
+/*
+ * Internal Functions.  These are not exported by libacornfs.so; the
+ * tools that need them link the objects.
+ */
+
+/*
+ * Sector transfers made by the drivers go through these so the trace
+ * can record which function asked for them.
+ */
+
+extern _Thread_local const char *acorn_fs_caller;
+
+#define acorn_fs_rdsect(fs, ssect, buf, size) (acorn_fs_caller = __func__, (fs)->rdsect(fs, ssect, buf, size))
+#define acorn_fs_wrsect(fs, ssect, buf, size) (acorn_fs_caller = __func__, (fs)->wrsect(fs, ssect, buf, size))
+
+extern int acorn_fs_xfer(acorn_fs *dst, int dsect, acorn_fs *src, int ssect, unsigned size);
+
+// ADFS layout helpers.
+extern void acorn_fs_adfs_obj2ent(const acorn_fs_object *obj, unsigned char *ent);
+extern int acorn_fs_adfs_namecmp(const unsigned char *a, const unsigned char *b);
+extern void acorn_fs_adfs_dirinit(unsigned char *data, const char *name, const char *title, unsigned parent);
+extern void acorn_fs_adfs_mapinit(unsigned char *fsmap, unsigned total, unsigned used);
+
+/*
+ * Copying between images and the native filing system, shared by
+ * afscp and afsbatch.  The destination, dst_fs or a native path in
+ * dst_objname when dst_fs is NULL, is a directory into which the
+ * sources go under their own names, or a single file dst_leaf in
+ * dst_obj.  acorn_fs_copy_cb is a glob callback copying what it is
+ * given from an image and acorn_fs_copy_native copies a native file
+ * or directory with its .inf sidecars.  When set, extract is called
+ * for each image file bound for a native directory in place of
+ * loading and saving it there.  Errors are reported on stderr after
+ * prog.
+ */
+
+typedef struct acorn_fs_copy acorn_fs_copy;
+
+struct acorn_fs_copy {
+    const char      *prog;
+    const char      *src_fsname;
+    acorn_fs        *dst_fs;
+    const char      *dst_fsname;
+    acorn_fs_object *dst_obj;
+    const char      *dst_objname;
+    const char      *dst_leaf;      // name within dst_obj for a file.
+    bool            dst_isdir;
+    bool            append;
+    bool            recurse;
+    int (*extract)(acorn_fs_copy *cp, acorn_fs *fs, acorn_fs_object *obj, const char *path);
+    void            *udata;         // for extract.
+};
+
+extern int acorn_fs_copy_cb(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path);
+extern int acorn_fs_copy_native(acorn_fs_copy *cp, const char *path);
+extern int acorn_fs_save_native(acorn_fs_copy *cp, acorn_fs_object *obj, const char *filename);
+extern int acorn_fs_find_parent(acorn_fs *fs, char *dest, acorn_fs_object *dobj, const char **leaf_ptr);
 
-// Internal Functions.
+// Driver set up.
 extern void acorn_fs_adfs_init(acorn_fs *fs);
 extern void acorn_fs_dfs_init(acorn_fs *fs);
 extern int acorn_fs_dfs_check(acorn_fs *fs, const char *fsname, FILE *mfp);
+extern unsigned acorn_fs_default_attr(unsigned attr);
+extern int acorn_fs_read_contig(acorn_fs *fs, acorn_fs_object *obj, unsigned offset, unsigned len, unsigned char *buf);
 
 #endif
@@ -0,0 +1,590 @@
+#include "acorn-fs.h"
+#include <alloca.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Translate non-BBC filename characters to BBC ones according to
+ * the table at http://beebwiki.mdfs.net/Filename_character_mapping
+*/
+
+static const char nativ_chars[] = "#$%&.?@^";
+static const char acorn_chars[] = "?<;+/#=>";
+
+void acorn_fs_name_n2a(const char *native_fn, char *acorn_fn)
+{
+    int ch;
+    const char *ptr;
+    char *end = acorn_fn + ACORN_FS_MAX_NAME;
+
+    while ((ch = *native_fn++) && acorn_fn < end) {
+        if ((ptr = strchr(nativ_chars, ch)))
+            ch = acorn_chars[ptr-nativ_chars];
+        *acorn_fn++ = ch;
+    }
+    *acorn_fn = '\0';
+}
+
+void acorn_fs_name_a2n(const char *acorn_fn, char *native_fn)
+{
+    int ch;
+    const char *ptr;
+    char *end = native_fn + ACORN_FS_MAX_NAME;
+
+    while ((ch = *acorn_fn++) && native_fn < end) {
+        if ((ptr = strchr(acorn_chars, ch)))
+            ch = nativ_chars[ptr-acorn_chars];
+        *native_fn++ = ch;
+    }
+    *native_fn = '\0';
+}
+
+/*
+ * Handle sidecar (.inf) files containing Acorn-specific attributes
+ * that cannot be stored in the native filing system.
+*/
+
+void acorn_fs_parse_inf_fp(acorn_fs_object *obj, FILE *fp, const char *filename)
+{
+    bool copy_name = true;
+    obj->load_addr = 0;
+    obj->exec_addr = 0;
+    obj->length = 0;
+    obj->attr = 0;
+
+    if (fp) { // NULL if there is no .inf file.
+        int n  = fscanf(fp, "%12s%x%x%x%x", obj->name, &obj->load_addr, &obj->exec_addr, &obj->length, &obj->attr);
+        if (n >= 1) {
+            copy_name = false;
+            if (n < 5) {
+                if (n == 2)
+                    obj->exec_addr = obj->load_addr;
+                char lck;
+                if (fscanf(fp, " %c", &lck) == 1 && (lck == 'L' || lck == 'l'))
+                    obj->attr = AFS_ATTR_LOCKED;
+            }
+        }
+    }
+    if (copy_name) {
+        const char *ptr = strrchr(filename, '/');
+        if (ptr)
+            filename = ptr + 1;
+        acorn_fs_name_n2a(filename, obj->name);
+    }
+}
+
+void acorn_fs_parse_inf(acorn_fs_object *obj, const char *filename)
+{
+    size_t len = strlen(filename);
+    char *inf = alloca(len+5);
+    strcpy(inf, filename);
+    strcpy(inf+len, ".inf");
+    FILE *fp = fopen(inf, "r");
+    acorn_fs_parse_inf_fp(obj, fp, filename);
+    if (fp)
+        fclose(fp);
+}
+
+/*
+ * A file brought in from outside with no access bits, from an archive
+ * or a .inf file that has none, would be unreadable in the image, so
+ * is given owner read and write.
+ */
+
+unsigned acorn_fs_default_attr(unsigned attr)
+{
+    if (!(attr & (AFS_ATTR_UREAD|AFS_ATTR_UWRITE|AFS_ATTR_UEXEC|AFS_ATTR_OREAD|AFS_ATTR_OWRITE|AFS_ATTR_OEXEC)))
+        attr |= AFS_ATTR_UREAD|AFS_ATTR_UWRITE;
+    return attr;
+}
+
+bool acorn_fs_is_inf(const char *path)
+{
+    const char *ptr = strrchr(path, '.');
+    // we know if ptr is not NULL, ptr[0] is a dot, no need to test.
+    return ptr && (ptr[1] == 'I' || ptr[1] == 'i') && (ptr[2] == 'N' || ptr[2] == 'n') && (ptr[3] == 'F' || ptr[3] == 'f') && !ptr[4];
+}
+
+/*
+ * Write the .inf sidecar for a file saved to the native filing
+ * system.
+ */
+
+static int write_inf(acorn_fs_copy *cp, acorn_fs_object *obj, const char *filename)
+{
+    size_t len = strlen(filename);
+    char *inf = alloca(len+5);
+    strcpy(inf, filename);
+    strcpy(inf+len, ".inf");
+    int status = AFS_OK;
+    FILE *fp = fopen(inf, "w");
+    if (fp) {
+        fprintf(fp, "%-12s %08X %08X %08X %02X\n", obj->name, obj->load_addr, obj->exec_addr, obj->length, obj->attr);
+        if (fclose(fp))
+            status = errno;
+    }
+    else
+        status = errno;
+    if (status != AFS_OK)
+        fprintf(stderr, "%s: %s: %s\n", cp->prog, inf, strerror(status));
+    return status;
+}
+
+/*
+ * Load a native file into memory.
+ */
+
+static int native_load_fp(acorn_fs_object *obj, FILE *fp)
+{
+    struct stat stb;
+    obj->data = NULL;
+    if (fstat(fileno(fp), &stb))
+        return errno;
+    obj->length = stb.st_size;
+    if (!obj->length)
+        return AFS_OK;
+    if (!(obj->data = malloc(obj->length)))
+        return errno;
+    if (fread(obj->data, obj->length, 1, fp) == 1)
+        return AFS_OK;
+    int status = ferror(fp) ? errno : AFS_BAD_EOF;
+    free(obj->data);
+    obj->data = NULL;
+    return status;
+}
+
+static int native_load(acorn_fs_copy *cp, acorn_fs_object *obj, const char *filename)
+{
+    int status;
+    acorn_fs_parse_inf(obj, filename);
+    FILE *fp = fopen(filename, "rb");
+    if (fp) {
+        status = native_load_fp(obj, fp);
+        fclose(fp);
+        if (status == AFS_OK)
+            return status;
+    }
+    else
+        status = errno;
+    fprintf(stderr, "%s: %s: %s\n", cp->prog, filename, acorn_fs_strerr(status));
+    return status;
+}
+
+int acorn_fs_save_native(acorn_fs_copy *cp, acorn_fs_object *obj, const char *filename)
+{
+    int status = AFS_OK;
+    FILE *fp = fopen(filename, "wb");
+    if (fp) {
+        if (obj->length && fwrite(obj->data, obj->length, 1, fp) != 1)
+            status = errno;
+        if (fclose(fp) && status == AFS_OK)
+            status = errno;
+    }
+    else
+        status = errno;
+    if (status == AFS_OK)
+        return write_inf(cp, obj, filename);
+    fprintf(stderr, "%s: %s: %s\n", cp->prog, filename, strerror(status));
+    return status;
+}
+
+/*
+ * Save a file into the Acorn destination.  If src_fs is not NULL
+ * the object is copied directly from that image without being
+ * loaded into memory.
+ */
+
+static int acorn_save(acorn_fs_copy *cp, acorn_fs_object *obj, acorn_fs *src_fs)
+{
+    int status;
+    if (!cp->dst_isdir)
+        strncpy(obj->name, cp->dst_leaf, ACORN_FS_MAX_NAME);
+    obj->attr = acorn_fs_default_attr(obj->attr);
+    if (cp->append) {
+        // Add to the end of the file in place, or create it.
+        status = AFS_OK;
+        if (src_fs) {
+            obj->data = NULL;
+            status = src_fs->load(src_fs, obj);
+        }
+        if (status == AFS_OK) {
+            status = cp->dst_fs->write_range(cp->dst_fs, obj, cp->dst_obj, 0, ACORN_FS_APPEND);
+            if (status == ENOENT)
+                status = cp->dst_fs->save(cp->dst_fs, obj, cp->dst_obj, false);
+        }
+        if (src_fs)
+            acorn_fs_free_obj(obj);
+    }
+    else if (src_fs)
+        status = cp->dst_fs->copy(cp->dst_fs, src_fs, obj, cp->dst_obj, true);
+    else
+        status = cp->dst_fs->save(cp->dst_fs, obj, cp->dst_obj, true);
+    if (status != AFS_OK) {
+        if (cp->dst_isdir)
+            fprintf(stderr, "%s: %s:%s.%s: %s\n", cp->prog, cp->dst_fsname, cp->dst_objname, obj->name, acorn_fs_strerr(status));
+        else
+            fprintf(stderr, "%s: %s:%s: %s\n", cp->prog, cp->dst_fsname, cp->dst_objname, acorn_fs_strerr(status));
+    }
+    return status;
+}
+
+static int save_file(acorn_fs_copy *cp, acorn_fs_object *obj)
+{
+    if (cp->dst_fs)
+        return acorn_save(cp, obj, NULL);
+    // Native destination.
+    const char *name = cp->dst_objname;
+    if (cp->dst_isdir) {
+        size_t len = strlen(cp->dst_objname);
+        char *path = alloca(len + ACORN_FS_MAX_NAME + 2);
+        memcpy(path, cp->dst_objname, len);
+        path[len++] = '/';
+        acorn_fs_name_a2n(obj->name, path+len);
+        name = path;
+    }
+    return acorn_fs_save_native(cp, obj, name);
+}
+
+int acorn_fs_copy_cb(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    acorn_fs_copy *cp = udata;
+    int astat;
+    if (obj->attr & AFS_ATTR_DIR) {
+        if (!cp->recurse) {
+            fprintf(stderr, "%s: skipping directory %s:%s\n", cp->prog, cp->src_fsname, path);
+            return AFS_OK;
+        }
+        acorn_fs_copy ccp = *cp;
+        if (cp->dst_fs) {
+            // Destination is an Acorn filesystem.
+            acorn_fs_object child;
+            memcpy(child.name, obj->name, ACORN_FS_MAX_NAME+1);
+            astat = cp->dst_fs->mkdir(cp->dst_fs, &child, cp->dst_obj);
+            if (astat == AFS_OK || (astat == EEXIST && (child.attr & AFS_ATTR_DIR))) {
+                ccp.dst_objname = obj->name;
+                ccp.dst_obj = &child;
+                astat = fs->glob(fs, obj, "*", acorn_fs_copy_cb, &ccp);
+            }
+            else
+                fprintf(stderr, "%s: unable to create Acorn directory %s: %s\n", cp->prog, child.name, acorn_fs_strerr(astat));
+        }
+        else {
+            // Destination is the native filesystem.
+            size_t plen = strlen(cp->dst_objname);
+            char *cpath = alloca(plen + ACORN_FS_MAX_NAME + 2);
+            memcpy(cpath, cp->dst_objname, plen);
+            cpath[plen] = '/';
+            acorn_fs_name_a2n(obj->name, cpath+plen+1);
+            struct stat stb;
+            if ((!stat(cpath, &stb) && S_ISDIR(stb.st_mode)) || !mkdir(cpath, 0755)) {
+                ccp.dst_objname = cpath;
+                astat = fs->glob(fs, obj, "*", acorn_fs_copy_cb, &ccp);
+            }
+            else {
+                astat = errno;
+                fprintf(stderr, "%s: unable to create native directory %s: %s\n", cp->prog, cpath, strerror(astat));
+            }
+        }
+    }
+    else if (cp->dst_fs)
+        astat = acorn_save(cp, obj, fs); // image to image.
+    else if (cp->extract)
+        astat = cp->extract(cp, fs, obj, path);
+    else {
+        obj->data = NULL;
+        astat = fs->load(fs, obj);
+        if (astat == AFS_OK)
+            astat = save_file(cp, obj);
+        else
+            fprintf(stderr, "%s: %s:%s: %s\n", cp->prog, cp->src_fsname, path, acorn_fs_strerr(astat));
+        acorn_fs_free_obj(obj);
+    }
+    return astat;
+}
+
+/*
+ * Native directories are read once, through a directory descriptor,
+ * and each file is paired with its .inf sidecar from the listing
+ * rather than by trying to open one for every file.  When copying
+ * into an image the entries are taken in Acorn name order so each
+ * is added at the end of the directory.
+ */
+
+typedef struct {
+    char          *name;
+    char          acorn[ACORN_FS_MAX_NAME+1];
+    unsigned char type;
+    bool          has_inf;
+} dir_item;
+
+static int native_dir(acorn_fs_copy *cp, int dfd, const char *path);
+
+static int native_subdir(acorn_fs_copy *cp, int dfd, const char *path, const char *name)
+{
+    int astat;
+    acorn_fs_copy ccp = *cp;
+    if (cp->dst_fs) {
+        // Destination is an Acorn filesystem.
+        acorn_fs_object child;
+        acorn_fs_name_n2a(name, child.name);
+        astat = cp->dst_fs->mkdir(cp->dst_fs, &child, cp->dst_obj);
+        if (astat == AFS_OK || (astat == EEXIST && (child.attr & AFS_ATTR_DIR))) {
+            ccp.dst_objname = name;
+            ccp.dst_obj = &child;
+            return native_dir(&ccp, dfd, path);
+        }
+        fprintf(stderr, "%s: unable to create Acorn directory %s: %s\n", cp->prog, child.name, acorn_fs_strerr(astat));
+    }
+    else {
+        // Destination is the native filesystem.
+        size_t plen = strlen(cp->dst_objname);
+        size_t nlen = strlen(name);
+        char *cpath = alloca(plen+nlen+2);
+        memcpy(cpath, cp->dst_objname, plen);
+        cpath[plen] = '/';
+        strcpy(cpath+plen+1, name);
+        struct stat stb;
+        if ((!stat(cpath, &stb) && S_ISDIR(stb.st_mode)) || !mkdir(cpath, 0755)) {
+            ccp.dst_objname = cpath;
+            return native_dir(&ccp, dfd, path);
+        }
+        astat = errno;
+        fprintf(stderr, "%s: unable to create native directory %s: %s\n", cp->prog, cpath, strerror(astat));
+    }
+    close(dfd);
+    return astat;
+}
+
+int acorn_fs_copy_native(acorn_fs_copy *cp, const char *path)
+{
+    int astat;
+    struct stat stb;
+    if (stat(path, &stb)) {
+        astat = errno;
+        fprintf(stderr, "%s: %s: %s\n", cp->prog, path, strerror(astat));
+    }
+    else if (!S_ISDIR(stb.st_mode)) {
+        acorn_fs_object obj;
+        astat = native_load(cp, &obj, path);
+        if (astat == AFS_OK) {
+            astat = save_file(cp, &obj);
+            acorn_fs_free_obj(&obj);
+        }
+    }
+    else if (!cp->recurse) {
+        astat = AFS_OK;
+        fprintf(stderr, "%s: skipping directory %s in non-recursive mode\n", cp->prog, path);
+    }
+    else {
+        int dfd = open(path, O_RDONLY|O_DIRECTORY);
+        if (dfd >= 0) {
+            const char *name = strrchr(path, '/');
+            astat = native_subdir(cp, dfd, path, name ? name+1 : path);
+        }
+        else {
+            astat = errno;
+            fprintf(stderr, "%s: unable to opendir '%s': %s\n", cp->prog, path, strerror(astat));
+        }
+    }
+    return astat;
+}
+
+static int item_name_cmp(const void *va, const void *vb)
+{
+    return strcmp(((const dir_item *)va)->name, ((const dir_item *)vb)->name);
+}
+
+static int item_acorn_cmp(const void *va, const void *vb)
+{
+    const dir_item *a = va, *b = vb;
+    return acorn_fs_adfs_namecmp((const unsigned char *)a->acorn, (const unsigned char *)b->acorn);
+}
+
+static int read_items(DIR *dir, dir_item **items_ptr, size_t *count_ptr)
+{
+    dir_item *items = NULL;
+    size_t count = 0, size = 0;
+    struct dirent *dp;
+    while ((dp = readdir(dir))) {
+        if (dp->d_name[0] == '.')
+            continue;
+        if (count == size) {
+            size_t nsize = size ? size * 2 : 64;
+            dir_item *nitems = realloc(items, nsize * sizeof(dir_item));
+            if (!nitems)
+                break;
+            items = nitems;
+            size = nsize;
+        }
+        dir_item *item = items + count;
+        if (!(item->name = strdup(dp->d_name)))
+            break;
+        item->type = dp->d_type;
+        item->has_inf = false;
+        count++;
+    }
+    *items_ptr = items;
+    *count_ptr = count;
+    return dp ? ENOMEM : AFS_OK;
+}
+
+/*
+ * Pair each file with its sidecar and drop the sidecars from the
+ * list, leaving the entries in name order.
+ */
+
+static size_t pair_inf(dir_item *items, size_t count)
+{
+    qsort(items, count, sizeof(dir_item), item_name_cmp);
+    for (size_t i = 0; i < count; i++) {
+        dir_item *item = items + i;
+        if (!acorn_fs_is_inf(item->name)) {
+            size_t len = strlen(item->name);
+            dir_item key;
+            key.name = alloca(len + 5);
+            memcpy(key.name, item->name, len);
+            strcpy(key.name + len, ".inf");
+            item->has_inf = bsearch(&key, items, count, sizeof(dir_item), item_name_cmp) != NULL;
+        }
+    }
+    size_t keep = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (acorn_fs_is_inf(items[i].name))
+            free(items[i].name);
+        else
+            items[keep++] = items[i];
+    }
+    return keep;
+}
+
+static int native_file(acorn_fs_copy *cp, int dfd, dir_item *item, const char *path)
+{
+    int astat;
+    acorn_fs_object obj;
+    FILE *inf = NULL;
+    if (item->has_inf) {
+        size_t len = strlen(item->name);
+        char *iname = alloca(len + 5);
+        memcpy(iname, item->name, len);
+        strcpy(iname + len, ".inf");
+        int ifd = openat(dfd, iname, O_RDONLY);
+        if (ifd >= 0 && !(inf = fdopen(ifd, "r")))
+            close(ifd);
+    }
+    acorn_fs_parse_inf_fp(&obj, inf, item->name);
+    if (inf)
+        fclose(inf);
+    FILE *fp = NULL;
+    int fd = openat(dfd, item->name, O_RDONLY);
+    if (fd >= 0 && !(fp = fdopen(fd, "rb")))
+        close(fd);
+    if (fp) {
+        astat = native_load_fp(&obj, fp);
+        fclose(fp);
+    }
+    else
+        astat = errno;
+    if (astat == AFS_OK) {
+        astat = save_file(cp, &obj);
+        acorn_fs_free_obj(&obj);
+    }
+    else
+        fprintf(stderr, "%s: %s: %s\n", cp->prog, path, acorn_fs_strerr(astat));
+    return astat;
+}
+
+static int native_dir(acorn_fs_copy *cp, int dfd, const char *path)
+{
+    int astat;
+    DIR *dir = fdopendir(dfd);
+    if (!dir) {
+        astat = errno;
+        close(dfd);
+        fprintf(stderr, "%s: unable to opendir '%s': %s\n", cp->prog, path, strerror(astat));
+        return astat;
+    }
+    dir_item *items;
+    size_t count;
+    astat = read_items(dir, &items, &count);
+    if (astat == AFS_OK) {
+        count = pair_inf(items, count);
+        if (cp->dst_fs) {
+            for (size_t i = 0; i < count; i++)
+                acorn_fs_name_n2a(items[i].name, items[i].acorn);
+            qsort(items, count, sizeof(dir_item), item_acorn_cmp);
+        }
+        size_t plen = strlen(path);
+        char *cpath = malloc(plen + NAME_MAX + 2);
+        if (cpath) {
+            memcpy(cpath, path, plen);
+            cpath[plen] = '/';
+            for (size_t i = 0; i < count && astat == AFS_OK; i++) {
+                dir_item *item = items + i;
+                strcpy(cpath+plen+1, item->name);
+                unsigned char type = item->type;
+                if (type != DT_DIR && type != DT_REG) {
+                    struct stat stb;
+                    if (fstatat(dfd, item->name, &stb, 0)) {
+                        astat = errno;
+                        fprintf(stderr, "%s: %s: %s\n", cp->prog, cpath, strerror(astat));
+                        break;
+                    }
+                    type = S_ISDIR(stb.st_mode) ? DT_DIR : DT_REG;
+                }
+                if (type != DT_DIR)
+                    astat = native_file(cp, dfd, item, cpath);
+                else if (cp->recurse) {
+                    int cfd = openat(dfd, item->name, O_RDONLY|O_DIRECTORY);
+                    if (cfd >= 0)
+                        astat = native_subdir(cp, cfd, cpath, item->name);
+                    else {
+                        astat = errno;
+                        fprintf(stderr, "%s: unable to opendir '%s': %s\n", cp->prog, cpath, strerror(astat));
+                    }
+                }
+                else
+                    fprintf(stderr, "%s: skipping directory %s in non-recursive mode\n", cp->prog, cpath);
+            }
+            free(cpath);
+        }
+        else
+            astat = ENOMEM;
+    }
+    else
+        fprintf(stderr, "%s: %s: %s\n", cp->prog, path, strerror(astat));
+    for (size_t i = 0; i < count; i++)
+        free(items[i].name);
+    free(items);
+    closedir(dir);
+    return astat;
+}
+
+/*
+ * For a destination that is not a directory, find the directory it
+ * goes in.  Failing that it is in the root, perhaps under a DFS
+ * directory letter which stays part of the name.
+ */
+
+int acorn_fs_find_parent(acorn_fs *fs, char *dest, acorn_fs_object *dobj, const char **leaf_ptr)
+{
+    char *leaf = strrchr(dest, '.');
+    int status = ENOENT;
+    *leaf_ptr = dest;
+    if (leaf) {
+        *leaf = 0;
+        status = fs->find(fs, dest, dobj);
+        *leaf++ = '.';
+        if (status == AFS_OK && !(dobj->attr & AFS_ATTR_DIR))
+            status = ENOTDIR;
+        else if (status == AFS_OK)
+            *leaf_ptr = leaf;
+    }
+    if (status == ENOENT)
+        status = fs->find(fs, "$", dobj);
+    return status;
+}
@@ -1,77 +1,326 @@
+#include "acorn-fs.h"
 #include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <zip.h>
 #include <sys/stat.h>
 
-static int acunzip(const char *fn)
+#define DEFAULT_JOBS 4
+#define BUFFER_SIZE  (256*1024)
+
+/*
+ * Directories are created first, in archive order, on the main thread.
+ * The file members are then shared out to a pool of workers each of
+ * which has its own handle on the archive, as a zip_t may not be used
+ * from more than one thread at a time.
+ *
+ * When importing into an image the workers still decompress in
+ * parallel but the saves are serialised as an image may only be used
+ * by one thread at a time.  The image is in deferred mode so the
+ * directories and map are written once, at the end.
+ */
+
+typedef struct {
+    acorn_fs        *fs;
+    const char      *fsname;
+    const char      *dest_name;
+    acorn_fs_object dest;
+    pthread_mutex_t lock;
+    char            last_path[ACORN_FS_MAX_PATH];
+    acorn_fs_object last_dir;
+} image_dest;
+
+typedef struct {
+    const char         *fn;
+    zip_int64_t        nfile;
+    zip_int64_t        next;
+    unsigned           files;
+    unsigned long long bytes;
+    int                status;
+    pthread_mutex_t    lock;
+    image_dest         *img;
+} unzip_job;
+
+static void write_inf(zip_t *zip, zip_int64_t file, const char *name, zip_int64_t size)
+{
+    zip_uint16_t len;
+    const zip_uint8_t *data = zip_file_extra_field_get_by_id(zip, file, 0x4341, 0, &len, ZIP_FL_CENTRAL);
+    if (data && len >= 8) {
+        char inf[128];
+        snprintf(inf, sizeof(inf), "%s.inf", name);
+        FILE *fp = fopen(inf, "w");
+        if (fp) {
+            /* Name and load address */
+            const char *base = strrchr(name, '/');
+            if (base)
+                ++base;
+            else
+                base = name;
+            unsigned value = (data[7] << 24) | (data[6] << 16) | (data[5] << 8) | data[4];
+            fprintf(fp, "%-12s %08X", base, value);
+            if (len >= 12) {
+                /* Exec address */
+                value = (data[11] << 24) | (data[10] << 16) | (data[9] << 8) | data[8];
+                fprintf(fp, " %08X %08" PRIi64, value, size);
+                if (len >= 16) {
+                    /* File attributes */
+                    value = (data[15] << 24) | (data[14] << 16) | (data[13] << 8) | data[12];
+                    fprintf(fp, " %08X", value);
+                }
+            }
+            fputc('\n', fp);
+            fclose(fp);
+        }
+    }
+}
+
+static int extract(zip_t *zip, zip_int64_t file, const char *name, char *buffer, zip_int64_t *size)
+{
+    int status = 0;
+    zip_file_t *zf = zip_fopen_index(zip, file, 0);
+    if (zf) {
+        FILE *fp = fopen(name, "wb");
+        if (fp) {
+            zip_int64_t nbytes;
+            setvbuf(fp, NULL, _IONBF, 0); // writes are already large.
+            *size = 0;
+            while ((nbytes = zip_fread(zf, buffer, BUFFER_SIZE)) > 0) {
+                if (fwrite(buffer, nbytes, 1, fp) != 1) {
+                    fprintf(stderr, "acunzip: error writing %s: %s\n", name, strerror(errno));
+                    status = 1;
+                    break;
+                }
+                *size += nbytes;
+            }
+            if (nbytes < 0) {
+                fprintf(stderr, "acunzip: error reading member %s: %s\n", name, zip_file_strerror(zf));
+                status = 1;
+            }
+            fclose(fp);
+            if (!status)
+                write_inf(zip, file, name, *size);
+        }
+        else {
+            fprintf(stderr, "acunzip: unable to open %s for writing: %s\n", name, strerror(errno));
+            status = 1;
+        }
+        zip_fclose(zf);
+    }
+    else {
+        fprintf(stderr, "acunzip: unable to extra file member %s: %s\n", name, zip_strerror(zip));
+        status = 1;
+    }
+    return status;
+}
+
+/*
+ * Find the image directory for the leading len characters of a member
+ * name, creating any directories that do not yet exist.
+ */
+
+static int image_dir(image_dest *img, const char *name, size_t len, acorn_fs_object *dir)
+{
+    if (len < sizeof(img->last_path) && img->last_path[0] && !strncmp(img->last_path, name, len) && !img->last_path[len]) {
+        *dir = img->last_dir;
+        return AFS_OK;
+    }
+    *dir = img->dest;
+    const char *end = name + len;
+    while (name < end) {
+        char comp[NAME_MAX+1];
+        const char *sep = memchr(name, '/', end - name);
+        size_t clen = (sep ? sep : end) - name;
+        if (clen > NAME_MAX)
+            clen = NAME_MAX;
+        memcpy(comp, name, clen);
+        comp[clen] = 0;
+        if (clen) {
+            acorn_fs_object child;
+            acorn_fs_name_n2a(comp, child.name);
+            int status = img->fs->mkdir(img->fs, &child, dir);
+            if (status != AFS_OK && !(status == EEXIST && (child.attr & AFS_ATTR_DIR))) {
+                fprintf(stderr, "acunzip: unable to create directory %s in %s: %s\n", child.name, img->fsname, acorn_fs_strerr(status));
+                return status;
+            }
+            *dir = child;
+        }
+        name = sep ? sep + 1 : end;
+    }
+    if (len < sizeof(img->last_path)) {
+        memcpy(img->last_path, end - len, len);
+        img->last_path[len] = 0;
+        img->last_dir = *dir;
+    }
+    return AFS_OK;
+}
+
+static unsigned extra32(const zip_uint8_t *data)
+{
+    return (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
+}
+
+static int import(image_dest *img, zip_t *zip, zip_int64_t file, const char *name, zip_int64_t *size)
+{
+    int status = 0;
+    zip_stat_t st;
+    acorn_fs_object obj;
+    if (zip_stat_index(zip, file, 0, &st) || !(st.valid & ZIP_STAT_SIZE)) {
+        fprintf(stderr, "acunzip: unable to stat member %s: %s\n", name, zip_strerror(zip));
+        return 1;
+    }
+    obj.length = st.size;
+    if (!(obj.data = malloc(st.size ? st.size : 1))) {
+        fprintf(stderr, "acunzip: %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    zip_file_t *zf = zip_fopen_index(zip, file, 0);
+    if (zf) {
+        zip_int64_t nbytes;
+        *size = 0;
+        while (*size < st.size && (nbytes = zip_fread(zf, obj.data + *size, st.size - *size)) > 0)
+            *size += nbytes;
+        if (*size < st.size) {
+            fprintf(stderr, "acunzip: error reading member %s: %s\n", name, zip_file_strerror(zf));
+            status = 1;
+        }
+        zip_fclose(zf);
+    }
+    else {
+        fprintf(stderr, "acunzip: unable to extra file member %s: %s\n", name, zip_strerror(zip));
+        status = 1;
+    }
+    if (!status) {
+        zip_uint16_t len;
+        const zip_uint8_t *data = zip_file_extra_field_get_by_id(zip, file, 0x4341, 0, &len, ZIP_FL_CENTRAL);
+        obj.load_addr = (data && len >= 8) ? extra32(data + 4) : 0;
+        obj.exec_addr = (data && len >= 12) ? extra32(data + 8) : obj.load_addr;
+        obj.attr = acorn_fs_default_attr((data && len >= 16) ? extra32(data + 12) & 0xff : 0);
+        const char *base = strrchr(name, '/');
+        base = base ? base + 1 : name;
+        acorn_fs_name_n2a(base, obj.name);
+        acorn_fs_object dir;
+        pthread_mutex_lock(&img->lock);
+        int astat = image_dir(img, name, base > name ? base - name - 1 : 0, &dir);
+        if (astat == AFS_OK && (astat = img->fs->save(img->fs, &obj, &dir, true)) != AFS_OK)
+            fprintf(stderr, "acunzip: unable to save %s in %s: %s\n", name, img->fsname, acorn_fs_strerr(astat));
+        pthread_mutex_unlock(&img->lock);
+        if (astat != AFS_OK)
+            status = 1;
+    }
+    free(obj.data);
+    return status;
+}
+
+static void *worker(void *udata)
+{
+    unzip_job *job = udata;
+    int err, status = 0;
+    unsigned files = 0;
+    unsigned long long bytes = 0;
+    char *buffer = malloc(BUFFER_SIZE);
+    zip_t *zip = zip_open(job->fn, ZIP_RDONLY, &err);
+    if (buffer && zip) {
+        for (;;) {
+            pthread_mutex_lock(&job->lock);
+            zip_int64_t file = job->next++;
+            pthread_mutex_unlock(&job->lock);
+            if (file >= job->nfile)
+                break;
+            const char *name = zip_get_name(zip, file, 0);
+            if (name[strlen(name)-1] != '/') {
+                zip_int64_t size = 0;
+                if (job->img)
+                    status |= import(job->img, zip, file, name, &size);
+                else
+                    status |= extract(zip, file, name, buffer, &size);
+                bytes += size;
+                files++;
+            }
+        }
+    }
+    else if (!zip) {
+        zip_error_t error;
+        zip_error_init_with_code(&error, err);
+        fprintf(stderr, "acunzip: cannot open zip archive '%s': %s\n", job->fn, zip_error_strerror(&error));
+        zip_error_fini(&error);
+        status = 1;
+    }
+    else {
+        fprintf(stderr, "acunzip: %s\n", strerror(errno));
+        status = 1;
+    }
+    if (zip)
+        zip_close(zip);
+    free(buffer);
+    pthread_mutex_lock(&job->lock);
+    job->files += files;
+    job->bytes += bytes;
+    job->status |= status;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int acunzip(const char *fn, unsigned jobs, bool timing, image_dest *img)
 {
     int status = 0, err;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     zip_t *zip = zip_open(fn, ZIP_RDONLY, &err);
     if (zip) {
-        zip_int64_t nfile = zip_get_num_entries(zip, 0);
-        for (int file = 0; file < nfile; file++) {
+        unzip_job job;
+        job.fn = fn;
+        job.nfile = zip_get_num_entries(zip, 0);
+        job.next = 0;
+        job.files = 0;
+        job.bytes = 0;
+        job.status = 0;
+        job.img = img;
+        for (zip_int64_t file = 0; file < job.nfile; file++) {
             const char *name = zip_get_name(zip, file, 0);
             if (name[strlen(name)-1] == '/') {
-                if (mkdir(name, 0777) < 0 && errno != EEXIST) {
-                    fprintf(stderr, "acunzip: unable to create directory '%s': %s\n", name, strerror(errno));
-                    status = 1;
-                }
-            }
-            else {
-                zip_file_t *zf = zip_fopen_index(zip, file, 0);
-                if (zf) {
-                    FILE *fp = fopen(name, "wb");
-                    if (fp) {
-                        char buffer[8192];
-                        zip_int64_t nbytes, size = 0;
-                        while ((nbytes = zip_fread(zf, buffer, sizeof(buffer))) > 0) {
-                            fwrite(buffer, nbytes, 1, fp);
-                            size += nbytes;
-                        }
-                        fclose(fp);
-                        zip_uint16_t len;
-                        const zip_uint8_t *data = zip_file_extra_field_get_by_id(zip, file, 0x4341, 0, &len, ZIP_FL_CENTRAL);
-                        if (data && len >= 8) {
-                            char inf[128];
-                            snprintf(inf, sizeof(inf), "%s.inf", name);
-                            fp = fopen(inf, "w");
-                            if (fp) {
-                                /* Name and load address */
-                                const char *base = strrchr(name, '/');
-                                if (base)
-                                    ++base;
-                                else
-                                    base = name;
-                                unsigned value = (data[7] << 24) | (data[6] << 16) | (data[5] << 8) | data[4];
-                                fprintf(fp, "%-12s %08X", base, value);
-                                if (len >= 12) {
-                                    /* Exec address */
-                                    value = (data[11] << 24) | (data[10] << 16) | (data[9] << 8) | data[8];
-                                    fprintf(fp, " %08X %08" PRIi64, value, size);
-                                    if (len >= 16) {
-                                        /* File attributes */
-                                        value = (data[15] << 24) | (data[14] << 16) | (data[13] << 8) | data[12];
-                                        fprintf(fp, " %08X", value);
-                                    }
-                                }
-                                fputc('\n', fp);
-                                fclose(fp);
-                            }
-                        }
-                    }
-                    else {
-                        fprintf(stderr, "acunzip: unable to open %s for writing: %s\n", name, strerror(errno));
+                if (img) {
+                    acorn_fs_object dir;
+                    if (image_dir(img, name, strlen(name) - 1, &dir) != AFS_OK)
                         status = 1;
-                    }
                 }
-                else {
-                    fprintf(stderr, "acunzip: unable to extra file member %s: %s\n", name, zip_strerror(zip));
+                else if (mkdir(name, 0777) < 0 && errno != EEXIST) {
+                    fprintf(stderr, "acunzip: unable to create directory '%s': %s\n", name, strerror(errno));
                     status = 1;
                 }
             }
         }
         zip_close(zip);
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+        unsigned nthreads = 0;
+        if (threads && jobs > 1)
+            while (nthreads < jobs && !pthread_create(threads + nthreads, NULL, worker, &job))
+                nthreads++;
+        if (!nthreads)
+            worker(&job);
+        for (unsigned i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+        pthread_mutex_destroy(&job.lock);
+        status |= job.status;
+        if (timing) {
+            double secs = elapsed(&start);
+            fprintf(stderr, "acunzip: %s: %u files, %llu bytes in %.3fs (%.1f MB/s, %u threads)\n",
+                    fn, job.files, job.bytes, secs, secs > 0 ? job.bytes / secs / 1e6 : 0.0, nthreads ? nthreads : 1);
+        }
     }
     else {
         zip_error_t error;
@@ -83,17 +332,77 @@ static int acunzip(const char *fn)
     return status;
 }
 
+static int open_dest(image_dest *img, char *fsname)
+{
+    int status;
+    char *dest = strchr(fsname, ':');
+    if (dest)
+        *dest++ = 0;
+    if (!dest || !*dest)
+        dest = "$";
+    img->fsname = fsname;
+    img->dest_name = dest;
+    img->last_path[0] = 0;
+    if ((img->fs = acorn_fs_open(fsname, true))) {
+        img->fs->deferred = true; // commit directories and map once.
+        status = img->fs->find(img->fs, dest, &img->dest);
+        if (status == AFS_OK && (img->dest.attr & AFS_ATTR_DIR)) {
+            pthread_mutex_init(&img->lock, NULL);
+            return AFS_OK;
+        }
+        fprintf(stderr, "acunzip: %s:%s: %s\n", fsname, dest, status == AFS_OK ? strerror(ENOTDIR) : acorn_fs_strerr(status));
+        acorn_fs_close_all();
+    }
+    else {
+        status = errno;
+        fprintf(stderr, "acunzip: %s: %s\n", fsname, acorn_fs_strerr(status));
+    }
+    return status ? status : ENOTDIR;
+}
+
 int main(int argc, char **argv)
 {
-    int status = 0;
+    int status = 0, opt;
+    unsigned jobs = DEFAULT_JOBS;
+    bool timing = false;
+    char *dest = NULL;
 
-    if (--argc) {
-        do {
-            status += acunzip(*++argv);
-        } while (--argc);
+    while ((opt = getopt(argc, argv, "d:j:t")) != -1) {
+        switch (opt) {
+            case 'd':
+                dest = optarg;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                timing = true;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (optind < argc) {
+        image_dest img, *imgp = NULL;
+        if (dest) {
+            if (open_dest(&img, dest) != AFS_OK)
+                return 2;
+            imgp = &img;
+        }
+        while (optind < argc)
+            status += acunzip(argv[optind++], jobs, timing, imgp);
+        if (imgp) {
+            int sstat = acorn_fs_sync(img.fs);
+            if (sstat != AFS_OK) {
+                fprintf(stderr, "acunzip: %s: %s\n", img.fsname, acorn_fs_strerr(sstat));
+                status++;
+            }
+            acorn_fs_close_all();
+            pthread_mutex_destroy(&img.lock);
+        }
     }
     else {
-        fputs("Usage: acunzip <zip-file> <...>\n", stderr);
+        fputs("Usage: acunzip [ -j <threads> ] [ -t ] [ -d <img-file>[:<dir>] ] <zip-file> <...>\n", stderr);
         status = 1;
     }
     return status;
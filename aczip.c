@@ -0,0 +1,453 @@
+#include "acorn-fs.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * Write the contents of an image, or a directory within one, to a zip
+ * archive with the Acorn extra field (0x4341) holding the load and exec
+ * addresses and attributes, as understood by acunzip.
+ *
+ * Files are read from the image on the main thread, as an image may
+ * only be used by one thread at a time, and deflated by a pool of
+ * workers.  A writer thread emits the members in their original order
+ * as each one becomes ready, so the archive is written as a single
+ * stream and may go to a pipe.  The number of members loaded but not
+ * yet written is bounded.
+ */
+
+#define DEFAULT_JOBS 4
+#define WINDOW       64
+#define EXTRA_SIZE   24
+
+typedef struct {
+    acorn_fs_object obj;
+    char            *name;
+    unsigned char   *comp;
+    unsigned        csize;
+    uint32_t        crc;
+    unsigned        method;
+    uint32_t        offset;
+    bool            ready;
+} member;
+
+typedef struct {
+    member          *members;
+    size_t          count;
+    size_t          size;
+    const char      *fsname;
+    int             level;
+    FILE            *fp;
+    const char      *zipname;
+    uint32_t        offset;
+    unsigned        dos_time;
+    unsigned        dos_date;
+    int             errors;        // main thread only.
+    int             write_errors;  // writer only.
+    size_t          loaded;
+    size_t          next_job;
+    size_t          written;
+    pthread_mutex_t lock;
+    pthread_cond_t  job_ready;
+    pthread_cond_t  member_ready;
+    pthread_cond_t  space;
+} zip_ctx;
+
+static int collect(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    zip_ctx *ctx = udata;
+    if (ctx->count == ctx->size) {
+        size_t size = ctx->size ? ctx->size * 2 : 64;
+        member *members = realloc(ctx->members, size * sizeof(member));
+        if (!members)
+            return errno;
+        ctx->members = members;
+        ctx->size = size;
+    }
+    // Acorn path components become native names separated by '/'.
+    char name[ACORN_FS_MAX_PATH * 2];
+    char *ptr = name;
+    const char *comp = path;
+    for (;;) {
+        char acorn[ACORN_FS_MAX_NAME+1];
+        const char *sep = strchr(comp, '.');
+        size_t len = sep ? sep - comp : strlen(comp);
+        if (len > ACORN_FS_MAX_NAME)
+            len = ACORN_FS_MAX_NAME;
+        memcpy(acorn, comp, len);
+        acorn[len] = 0;
+        acorn_fs_name_a2n(acorn, ptr);
+        ptr += strlen(ptr);
+        if (!sep)
+            break;
+        *ptr++ = '/';
+        comp = sep + 1;
+    }
+    if (obj->attr & AFS_ATTR_DIR)
+        *ptr++ = '/';
+    *ptr = 0;
+    member *m = ctx->members + ctx->count;
+    if (!(m->name = strdup(name)))
+        return errno;
+    m->obj = *obj;
+    m->obj.data = NULL;
+    if (obj->attr & AFS_ATTR_DIR)
+        m->obj.length = 0;
+    m->comp = NULL;
+    m->csize = 0;
+    m->crc = 0;
+    m->method = 0;
+    m->ready = false;
+    ctx->count++;
+    return AFS_OK;
+}
+
+static void put16(unsigned char *base, unsigned value)
+{
+    base[0] = value & 0xff;
+    base[1] = (value >> 8) & 0xff;
+}
+
+static void put32(unsigned char *base, uint32_t value)
+{
+    put16(base, value & 0xffff);
+    put16(base + 2, value >> 16);
+}
+
+static void put_extra(unsigned char *extra, acorn_fs_object *obj)
+{
+    put16(extra, 0x4341);
+    put16(extra + 2, EXTRA_SIZE - 4);
+    memcpy(extra + 4, "ARC0", 4);
+    put32(extra + 8, obj->load_addr);
+    put32(extra + 12, obj->exec_addr);
+    put32(extra + 16, obj->attr & 0xff);
+    put32(extra + 20, 0);
+}
+
+/*
+ * Compress one member, falling back to storing it if deflate does
+ * not make it any smaller.
+ */
+
+static void compress_member(zip_ctx *ctx, member *m)
+{
+    unsigned length = m->obj.length;
+    m->crc = crc32(0, m->obj.data, length);
+    m->method = 0;
+    m->csize = length;
+    if (length && ctx->level) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, ctx->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            uLong bound = deflateBound(&zs, length);
+            unsigned char *comp = malloc(bound);
+            if (comp) {
+                zs.next_in = m->obj.data;
+                zs.avail_in = length;
+                zs.next_out = comp;
+                zs.avail_out = bound;
+                if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < length) {
+                    m->comp = comp;
+                    m->csize = zs.total_out;
+                    m->method = 8;
+                }
+                else
+                    free(comp);
+            }
+            deflateEnd(&zs);
+        }
+    }
+}
+
+static int write_member(zip_ctx *ctx, member *m)
+{
+    unsigned char hdr[30 + EXTRA_SIZE];
+    size_t nlen = strlen(m->name);
+    put32(hdr, 0x04034b50);
+    put16(hdr + 4, 20);
+    put16(hdr + 6, 0);
+    put16(hdr + 8, m->method);
+    put16(hdr + 10, ctx->dos_time);
+    put16(hdr + 12, ctx->dos_date);
+    put32(hdr + 14, m->crc);
+    put32(hdr + 18, m->csize);
+    put32(hdr + 22, m->obj.length);
+    put16(hdr + 26, nlen);
+    put16(hdr + 28, EXTRA_SIZE);
+    put_extra(hdr + 30, &m->obj);
+    m->offset = ctx->offset;
+    const unsigned char *data = m->comp ? m->comp : m->obj.data;
+    if (fwrite(hdr, 30, 1, ctx->fp) != 1 || fwrite(m->name, nlen, 1, ctx->fp) != 1 ||
+        fwrite(hdr + 30, EXTRA_SIZE, 1, ctx->fp) != 1 || (m->csize && fwrite(data, m->csize, 1, ctx->fp) != 1))
+        return errno;
+    ctx->offset += 30 + nlen + EXTRA_SIZE + m->csize;
+    return AFS_OK;
+}
+
+static int write_central(zip_ctx *ctx)
+{
+    uint32_t start = ctx->offset;
+    for (size_t i = 0; i < ctx->count; i++) {
+        member *m = ctx->members + i;
+        unsigned char hdr[46 + EXTRA_SIZE];
+        size_t nlen = strlen(m->name);
+        put32(hdr, 0x02014b50);
+        put16(hdr + 4, (13 << 8) | 20); // made by Acorn RISC OS, zip 2.0.
+        put16(hdr + 6, 20);
+        put16(hdr + 8, 0);
+        put16(hdr + 10, m->method);
+        put16(hdr + 12, ctx->dos_time);
+        put16(hdr + 14, ctx->dos_date);
+        put32(hdr + 16, m->crc);
+        put32(hdr + 20, m->csize);
+        put32(hdr + 24, m->obj.length);
+        put16(hdr + 28, nlen);
+        put16(hdr + 30, EXTRA_SIZE);
+        put16(hdr + 32, 0);
+        put16(hdr + 34, 0);
+        put16(hdr + 36, 0);
+        put32(hdr + 38, (m->obj.attr & AFS_ATTR_DIR) ? 0x10 : 0);
+        put32(hdr + 42, m->offset);
+        put_extra(hdr + 46, &m->obj);
+        if (fwrite(hdr, 46, 1, ctx->fp) != 1 || fwrite(m->name, nlen, 1, ctx->fp) != 1 ||
+            fwrite(hdr + 46, EXTRA_SIZE, 1, ctx->fp) != 1)
+            return errno;
+        ctx->offset += 46 + nlen + EXTRA_SIZE;
+    }
+    unsigned char end[22];
+    put32(end, 0x06054b50);
+    put16(end + 4, 0);
+    put16(end + 6, 0);
+    put16(end + 8, ctx->count);
+    put16(end + 10, ctx->count);
+    put32(end + 12, ctx->offset - start);
+    put32(end + 16, start);
+    put16(end + 20, 0);
+    if (fwrite(end, sizeof(end), 1, ctx->fp) != 1)
+        return errno;
+    return AFS_OK;
+}
+
+static void finish_member(zip_ctx *ctx, member *m)
+{
+    int status = write_member(ctx, m);
+    if (status != AFS_OK) {
+        fprintf(stderr, "aczip: %s: %s\n", ctx->zipname, strerror(status));
+        ctx->write_errors++;
+    }
+    free(m->comp);
+    m->comp = NULL;
+    acorn_fs_free_obj(&m->obj);
+}
+
+static void *deflate_worker(void *udata)
+{
+    zip_ctx *ctx = udata;
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->next_job >= ctx->loaded && ctx->loaded < ctx->count)
+            pthread_cond_wait(&ctx->job_ready, &ctx->lock);
+        if (ctx->next_job >= ctx->count)
+            break;
+        member *m = ctx->members + ctx->next_job++;
+        pthread_mutex_unlock(&ctx->lock);
+        compress_member(ctx, m);
+        pthread_mutex_lock(&ctx->lock);
+        m->ready = true;
+        pthread_cond_broadcast(&ctx->member_ready);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static void *write_worker(void *udata)
+{
+    zip_ctx *ctx = udata;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->written < ctx->count) {
+        member *m = ctx->members + ctx->written;
+        while (!m->ready)
+            pthread_cond_wait(&ctx->member_ready, &ctx->lock);
+        pthread_mutex_unlock(&ctx->lock);
+        finish_member(ctx, m);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->written++;
+        pthread_cond_signal(&ctx->space);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static int load_member(acorn_fs *fs, zip_ctx *ctx, member *m)
+{
+    int status = AFS_OK;
+    if (!(m->obj.attr & AFS_ATTR_DIR) && (status = fs->load(fs, &m->obj)) != AFS_OK) {
+        // Keep the entry, empty, so the archive order is preserved.
+        fprintf(stderr, "aczip: %s:%s: %s\n", ctx->fsname, m->name, acorn_fs_strerr(status));
+        m->obj.length = 0;
+        acorn_fs_free_obj(&m->obj);
+        ctx->errors++;
+    }
+    return status;
+}
+
+static void run_serial(acorn_fs *fs, zip_ctx *ctx)
+{
+    for (size_t i = 0; i < ctx->count; i++) {
+        member *m = ctx->members + i;
+        load_member(fs, ctx, m);
+        compress_member(ctx, m);
+        finish_member(ctx, m);
+    }
+}
+
+static void run_parallel(acorn_fs *fs, zip_ctx *ctx, unsigned jobs)
+{
+    pthread_t writer, *workers = calloc(jobs, sizeof(pthread_t));
+    unsigned nworkers = 0;
+    if (workers && !pthread_create(&writer, NULL, write_worker, ctx)) {
+        while (nworkers < jobs && !pthread_create(workers + nworkers, NULL, deflate_worker, ctx))
+            nworkers++;
+        for (size_t i = 0; i < ctx->count; i++) {
+            member *m = ctx->members + i;
+            pthread_mutex_lock(&ctx->lock);
+            while (i - ctx->written >= WINDOW)
+                pthread_cond_wait(&ctx->space, &ctx->lock);
+            pthread_mutex_unlock(&ctx->lock);
+            load_member(fs, ctx, m);
+            if (!nworkers)
+                compress_member(ctx, m); // no workers, do it here.
+            pthread_mutex_lock(&ctx->lock);
+            ctx->loaded = i + 1;
+            if (nworkers)
+                pthread_cond_signal(&ctx->job_ready);
+            else {
+                m->ready = true;
+                pthread_cond_broadcast(&ctx->member_ready);
+            }
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        pthread_mutex_lock(&ctx->lock);
+        pthread_cond_broadcast(&ctx->job_ready);
+        pthread_mutex_unlock(&ctx->lock);
+        for (unsigned i = 0; i < nworkers; i++)
+            pthread_join(workers[i], NULL);
+        pthread_join(writer, NULL);
+    }
+    else {
+        fprintf(stderr, "aczip: unable to start threads, compressing serially\n");
+        run_serial(fs, ctx);
+    }
+    free(workers);
+}
+
+static int aczip(acorn_fs *fs, acorn_fs_object *start, zip_ctx *ctx, unsigned jobs)
+{
+    int status;
+    if (start && !(start->attr & AFS_ATTR_DIR))
+        status = collect(fs, start, ctx, start->name);
+    else
+        status = fs->walk(fs, start, collect, ctx);
+    if (status != AFS_OK) {
+        fprintf(stderr, "aczip: %s: %s\n", ctx->fsname, acorn_fs_strerr(status));
+        return 2;
+    }
+    if (ctx->count > 0xffff) {
+        fprintf(stderr, "aczip: %s: too many files for a zip archive\n", ctx->fsname);
+        return 2;
+    }
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+    ctx->dos_time = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+    ctx->dos_date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+    if (jobs)
+        run_parallel(fs, ctx, jobs);
+    else
+        run_serial(fs, ctx);
+    if ((status = write_central(ctx)) != AFS_OK || fflush(ctx->fp)) {
+        fprintf(stderr, "aczip: %s: %s\n", ctx->zipname, strerror(status ? status : errno));
+        return 3;
+    }
+    return (ctx->errors || ctx->write_errors) ? 3 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int status, opt;
+    unsigned jobs = DEFAULT_JOBS;
+    zip_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.level = Z_DEFAULT_COMPRESSION;
+    while ((opt = getopt(argc, argv, "j:0123456789")) != -1) {
+        switch (opt) {
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                if (opt >= '0' && opt <= '9')
+                    ctx.level = opt - '0';
+                else
+                    argc = 0;
+        }
+    }
+    if (argc - optind == 2) {
+        char *fsname = argv[optind];
+        char *src = strchr(fsname, ':');
+        if (src)
+            *src++ = 0;
+        ctx.fsname = fsname;
+        ctx.zipname = argv[optind+1];
+        acorn_fs *fs = acorn_fs_open(fsname, false);
+        if (fs) {
+            acorn_fs_object sobj, *start = NULL;
+            status = AFS_OK;
+            if (src && *src) {
+                status = fs->find(fs, src, &sobj);
+                start = &sobj;
+            }
+            if (status == AFS_OK) {
+                if (!strcmp(ctx.zipname, "-"))
+                    ctx.fp = stdout;
+                else
+                    ctx.fp = fopen(ctx.zipname, "wb");
+                if (ctx.fp) {
+                    pthread_mutex_init(&ctx.lock, NULL);
+                    pthread_cond_init(&ctx.job_ready, NULL);
+                    pthread_cond_init(&ctx.member_ready, NULL);
+                    pthread_cond_init(&ctx.space, NULL);
+                    status = aczip(fs, start, &ctx, jobs);
+                    if (ctx.fp != stdout && fclose(ctx.fp) && !status) {
+                        fprintf(stderr, "aczip: %s: %s\n", ctx.zipname, strerror(errno));
+                        status = 3;
+                    }
+                }
+                else {
+                    fprintf(stderr, "aczip: %s: %s\n", ctx.zipname, strerror(errno));
+                    status = 2;
+                }
+            }
+            else {
+                fprintf(stderr, "aczip: %s:%s: %s\n", fsname, src, acorn_fs_strerr(status));
+                status = 2;
+            }
+            acorn_fs_close_all();
+        }
+        else {
+            fprintf(stderr, "aczip: %s: %s\n", fsname, acorn_fs_strerr(errno));
+            status = 2;
+        }
+        for (size_t i = 0; i < ctx.count; i++)
+            free(ctx.members[i].name);
+        free(ctx.members);
+    }
+    else {
+        fputs("Usage: aczip [ -0 ... -9 ] [ -j <threads> ] <img-file>[:<dir>] <zip-file>|-\n", stderr);
+        status = 1;
+    }
+    return status;
+}
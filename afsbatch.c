@@ -0,0 +1,477 @@
+#include "acorn-fs.h"
+#include <ctype.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Run a script of commands against images that stay open from one
+ * command to the next.  Directory and free space map updates are
+ * deferred and written once per image at a sync command or at the
+ * end.  Each line is a command and its arguments, separated by white
+ * space; double quotes group words and # starts a comment.
+ *
+ *   ls <img>[:<pattern>] ...
+ *   tree <img>[:<start>] ...
+ *   cp [-r] <src> ... <dest>      as afscp, sources may be host files
+ *                                 or directories, or <img>:<pattern>
+ *   mkdir <img>:<dir> ...
+ *   rm <img>:<pattern> ...
+ *   title <img> <title>
+ *   chk <img> ...
+ *   sync [<img> ...]
+ */
+
+#define MAX_ARGS 64
+
+/*
+ * The library hands back the image already open for a name so ours
+ * are kept in its list; this list only records which were opened for
+ * writing so one opened read-only can be reopened when needed.
+ */
+
+typedef struct image image;
+
+struct image {
+    acorn_fs *fs;
+    bool     writable;
+    image    *next;
+};
+
+static image *images;
+static const char *script;
+static unsigned line_no;
+
+static void error(const char *what, int status)
+{
+    fprintf(stderr, "afsbatch: %s:%u: %s: %s\n", script, line_no, what, acorn_fs_strerr(status));
+}
+
+static acorn_fs *get_image(const char *fsname, bool writable)
+{
+    image *img;
+    for (img = images; img; img = img->next)
+        if (!strcmp(img->fs->filename, fsname))
+            break;
+    if (img) {
+        if (img->writable || !writable)
+            return img->fs;
+        // Write back anything pending before giving up the read lock.
+        int status = acorn_fs_close(img->fs);
+        if (status != AFS_OK)
+            error(fsname, status);
+    }
+    else if (!(img = malloc(sizeof(image))))
+        return NULL;
+    else {
+        img->next = images;
+        images = img;
+    }
+    if ((img->fs = acorn_fs_open(fsname, writable))) {
+        img->fs->deferred = true;
+        img->writable = writable;
+        return img->fs;
+    }
+    int status = errno;
+    image **prev = &images;
+    while (*prev != img)
+        prev = &(*prev)->next;
+    *prev = img->next;
+    free(img);
+    errno = status;
+    return NULL;
+}
+
+static acorn_fs *open_image(const char *fsname, bool writable)
+{
+    acorn_fs *fs = get_image(fsname, writable);
+    if (!fs)
+        error(fsname, errno);
+    return fs;
+}
+
+static int info_cb(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    acorn_fs_info(obj, stdout);
+    printf(" %s\n", path);
+    return AFS_OK;
+}
+
+static int cmd_ls(int argc, char **argv)
+{
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *sep = strchr(argv[i], ':');
+        if (sep)
+            *sep++ = 0;
+        acorn_fs *fs = open_image(argv[i], false);
+        if (fs) {
+            int astat = fs->glob(fs, NULL, sep && *sep ? sep : "*", info_cb, NULL);
+            if (astat != AFS_OK) {
+                error(argv[i], astat);
+                status++;
+            }
+        }
+        else
+            status++;
+    }
+    return status;
+}
+
+static int cmd_tree(int argc, char **argv)
+{
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *sep = strchr(argv[i], ':');
+        if (sep)
+            *sep++ = 0;
+        acorn_fs *fs = open_image(argv[i], false);
+        if (fs) {
+            int astat;
+            if (sep && *sep) {
+                acorn_fs_object start;
+                if ((astat = fs->find(fs, sep, &start)) == AFS_OK)
+                    astat = fs->walk(fs, &start, info_cb, NULL);
+            }
+            else
+                astat = fs->walk(fs, NULL, info_cb, NULL);
+            if (astat != AFS_OK) {
+                error(argv[i], astat);
+                status++;
+            }
+        }
+        else
+            status++;
+    }
+    return status;
+}
+
+/*
+ * Copying goes through the engine afscp uses, with errors reported
+ * against the script line.
+ */
+
+static int cmd_cp(int argc, char **argv)
+{
+    acorn_fs_copy cp;
+    acorn_fs_object dobj;
+    cp.recurse = argc > 1 && !strcmp(argv[1], "-r");
+    if (cp.recurse) {
+        argc--;
+        argv++;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "afsbatch: %s:%u: usage: cp [ -r ] <src> [ <src> ... ] <dest>\n", script, line_no);
+        return 1;
+    }
+    char *dest = argv[argc-1];
+    char *sep = strchr(dest, ':');
+    int status;
+    if (sep) {
+        *sep++ = 0;
+        if (!(cp.dst_fs = open_image(dest, true)))
+            return 1;
+        cp.dst_fsname = dest;
+        cp.dst_obj = &dobj;
+        cp.dst_objname = *sep ? sep : "$";
+        status = cp.dst_fs->find(cp.dst_fs, cp.dst_objname, &dobj);
+        cp.dst_isdir = status == AFS_OK && (dobj.attr & AFS_ATTR_DIR);
+        if (!cp.dst_isdir && (status == AFS_OK || status == ENOENT))
+            status = acorn_fs_find_parent(cp.dst_fs, sep, &dobj, &cp.dst_leaf);
+    }
+    else {
+        struct stat stb;
+        cp.dst_fs = NULL;
+        cp.dst_fsname = NULL;
+        cp.dst_obj = NULL;
+        cp.dst_objname = dest;
+        cp.dst_leaf = dest;
+        cp.dst_isdir = !stat(dest, &stb) && S_ISDIR(stb.st_mode);
+        status = AFS_OK;
+    }
+    if (status != AFS_OK) {
+        error(dest, status);
+        return 1;
+    }
+    if (!cp.dst_isdir && (argc > 3 || cp.recurse)) {
+        fprintf(stderr, "afsbatch: %s:%u: destination must be a directory for multi-file/recursive copy\n", script, line_no);
+        return 1;
+    }
+    char *prog = malloc(strlen(script) + 32);
+    if (!prog) {
+        error(dest, ENOMEM);
+        return 1;
+    }
+    sprintf(prog, "afsbatch: %s:%u", script, line_no);
+    cp.prog = prog;
+    cp.append = false;
+    cp.extract = NULL;
+    cp.udata = NULL;
+    int errors = 0;
+    for (int i = 1; i < argc - 1; i++) {
+        char *src = argv[i];
+        if ((sep = strchr(src, ':'))) {
+            *sep++ = 0;
+            acorn_fs *fs = open_image(src, false);
+            if (fs) {
+                cp.src_fsname = src;
+                status = fs->glob(fs, NULL, sep, acorn_fs_copy_cb, &cp);
+            }
+            else
+                status = errno;
+        }
+        else
+            status = acorn_fs_copy_native(&cp, src);
+        if (status != AFS_OK)
+            errors++;
+    }
+    free(prog);
+    return errors;
+}
+
+/*
+ * Split the last component off an Acorn path, as afsmkdir.
+ */
+
+static int cmd_mkdir(int argc, char **argv)
+{
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *path = strchr(argv[i], ':');
+        if (!path) {
+            fprintf(stderr, "afsbatch: %s:%u: name '%s' invalid, ':' required\n", script, line_no, argv[i]);
+            status++;
+            continue;
+        }
+        *path++ = 0;
+        acorn_fs *fs = open_image(argv[i], true);
+        if (!fs) {
+            status++;
+            continue;
+        }
+        size_t len = strlen(path);
+        while (len > 0 && path[len-1] == '.')
+            path[--len] = 0;
+        const char *dest = "$";
+        char *name = strrchr(path, '.');
+        if (name) {
+            dest = path;
+            *name++ = 0;
+        }
+        else
+            name = path;
+        acorn_fs_object dobj, child;
+        int astat = fs->find(fs, dest, &dobj);
+        if (astat == AFS_OK && !(dobj.attr & AFS_ATTR_DIR))
+            astat = ENOTDIR;
+        if (astat == AFS_OK) {
+            strncpy(child.name, name, ACORN_FS_MAX_NAME);
+            child.name[ACORN_FS_MAX_NAME] = 0;
+            astat = fs->mkdir(fs, &child, &dobj);
+        }
+        if (astat != AFS_OK) {
+            error(name, astat);
+            status++;
+        }
+    }
+    return status;
+}
+
+static int cmd_rm(int argc, char **argv)
+{
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *sep = strchr(argv[i], ':');
+        if (!sep) {
+            fprintf(stderr, "afsbatch: %s:%u: name '%s' invalid, ':' required\n", script, line_no, argv[i]);
+            status++;
+            continue;
+        }
+        *sep++ = 0;
+        acorn_fs *fs = open_image(argv[i], true);
+        if (fs) {
+            int astat = fs->remove(fs, NULL, sep);
+            if (astat != AFS_OK) {
+                error(argv[i], astat);
+                status++;
+            }
+        }
+        else
+            status++;
+    }
+    return status;
+}
+
+static int cmd_title(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "afsbatch: %s:%u: usage: title <img> <title>\n", script, line_no);
+        return 1;
+    }
+    acorn_fs *fs = open_image(argv[1], true);
+    if (!fs)
+        return 1;
+    int status = fs->settitle(fs, argv[2]);
+    if (status != AFS_OK) {
+        error(argv[1], status);
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_chk(int argc, char **argv)
+{
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        acorn_fs *fs = open_image(argv[i], false);
+        if (!fs || fs->check(fs, argv[i], stderr) != AFS_OK)
+            status++;
+    }
+    return status;
+}
+
+static int cmd_sync(int argc, char **argv)
+{
+    int status = 0;
+    for (image *img = images; img; img = img->next) {
+        bool wanted = argc == 1;
+        for (int i = 1; i < argc && !wanted; i++)
+            wanted = !strcmp(argv[i], img->fs->filename);
+        if (wanted) {
+            int astat = acorn_fs_sync(img->fs);
+            if (astat != AFS_OK) {
+                error(img->fs->filename, astat);
+                status++;
+            }
+        }
+    }
+    return status;
+}
+
+static const struct {
+    const char *name;
+    int (*func)(int argc, char **argv);
+} commands[] = {
+    { "ls",    cmd_ls    },
+    { "tree",  cmd_tree  },
+    { "cp",    cmd_cp    },
+    { "mkdir", cmd_mkdir },
+    { "rm",    cmd_rm    },
+    { "title", cmd_title },
+    { "chk",   cmd_chk   },
+    { "sync",  cmd_sync  }
+};
+
+static int split(char *line, char **argv)
+{
+    int argc = 0;
+    char *src = line;
+    for (;;) {
+        while (isspace((unsigned char)*src))
+            src++;
+        if (!*src || *src == '#')
+            break;
+        if (argc == MAX_ARGS)
+            return -1;
+        char *dst = src;
+        argv[argc++] = dst;
+        bool quoted = false;
+        while (*src && (quoted || !isspace((unsigned char)*src))) {
+            if (*src == '"')
+                quoted = !quoted;
+            else
+                *dst++ = *src;
+            src++;
+        }
+        if (*src)
+            src++;
+        *dst = 0;
+    }
+    return argc;
+}
+
+static int run(FILE *fp, bool stop)
+{
+    int status = 0;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fp) > 0) {
+        line_no++;
+        char *argv[MAX_ARGS];
+        int argc = split(line, argv);
+        if (argc < 0) {
+            fprintf(stderr, "afsbatch: %s:%u: too many arguments\n", script, line_no);
+            status++;
+        }
+        else if (argc > 0) {
+            size_t c;
+            for (c = 0; c < sizeof(commands) / sizeof(commands[0]); c++)
+                if (!strcmp(argv[0], commands[c].name))
+                    break;
+            if (c < sizeof(commands) / sizeof(commands[0]))
+                status += commands[c].func(argc, argv);
+            else {
+                fprintf(stderr, "afsbatch: %s:%u: unknown command '%s'\n", script, line_no, argv[0]);
+                status++;
+            }
+        }
+        fflush(stdout);
+        if (status && stop)
+            break;
+    }
+    free(line);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    bool stop = false;
+    static const struct option long_opts[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { NULL }
+    };
+    while ((opt = getopt_long(argc, argv, "e", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+                stop = true;
+                break;
+            case 'S':
+                acorn_fs_stats_at_close(stderr);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind > 1) {
+        fputs("Usage: afsbatch [ -e ] [ --stats ] [ <script> ]\n", stderr);
+        return 1;
+    }
+    setlocale(LC_ALL, "");
+    FILE *fp = stdin;
+    script = "<stdin>";
+    if (optind < argc) {
+        script = argv[optind];
+        if (!(fp = fopen(script, "r"))) {
+            fprintf(stderr, "afsbatch: %s: %s\n", script, strerror(errno));
+            return 2;
+        }
+    }
+    int status = run(fp, stop);
+    if (fp != stdin)
+        fclose(fp);
+    int astat = acorn_fs_close_all();
+    if (astat != AFS_OK) {
+        fprintf(stderr, "afsbatch: %s\n", acorn_fs_strerr(astat));
+        status++;
+    }
+    while (images) {
+        image *next = images->next;
+        free(images);
+        images = next;
+    }
+    return status;
+}
@@ -0,0 +1,488 @@
+#include "acorn-fs.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Build a complete ADFS image from a host tree or a manifest.  The
+ * whole layout is worked out before anything is written: each
+ * directory is followed immediately by the files in it and then by
+ * its subdirectories, each laid out the same way, so the image is
+ * written front to back in a single pass with no free space between
+ * objects.
+ */
+
+#define ROOT_SECT  2
+#define DIR_SECTS  (ACORN_FS_ADFS_DIR_SIZE / ACORN_FS_SECT_SIZE)
+#define DIR_ENT_SIZE 0x1A
+#define DIR_MAX_ENT 47
+#define COPY_SECTS 64
+
+typedef struct node node;
+
+struct node {
+    acorn_fs_object obj;
+    char          *host;
+    node          **kids;
+    unsigned      nkids;
+    unsigned      size;
+    unsigned char key[DIR_ENT_SIZE];
+};
+
+typedef struct {
+    FILE          *fp;
+    const char    *fsname;
+    bool          ide;
+    unsigned      sector;
+    unsigned char buf[COPY_SECTS * ACORN_FS_SECT_SIZE * 2];
+} writer;
+
+static const unsigned std_sizes[] = { 640, 1280, 2560 };
+
+static node *new_node(const char *name, const char *host, bool is_dir)
+{
+    node *n = calloc(1, sizeof(node));
+    if (n) {
+        strncpy(n->obj.name, name, ACORN_FS_MAX_NAME);
+        if (is_dir) {
+            n->obj.attr = AFS_ATTR_DIR | AFS_ATTR_LOCKED | AFS_ATTR_UREAD;
+            n->obj.length = ACORN_FS_ADFS_DIR_SIZE;
+        }
+        else if (!(n->host = strdup(host))) {
+            free(n);
+            n = NULL;
+        }
+    }
+    return n;
+}
+
+static void free_node(node *n)
+{
+    for (unsigned i = 0; i < n->nkids; i++)
+        free_node(n->kids[i]);
+    free(n->kids);
+    free(n->host);
+    free(n);
+}
+
+static int add_kid(node *dir, node *kid)
+{
+    if (dir->nkids == dir->size) {
+        unsigned size = dir->size ? dir->size * 2 : 8;
+        node **kids = realloc(dir->kids, size * sizeof(node *));
+        if (!kids)
+            return errno;
+        dir->kids = kids;
+        dir->size = size;
+    }
+    dir->kids[dir->nkids++] = kid;
+    return AFS_OK;
+}
+
+static node *find_kid(node *dir, const char *name)
+{
+    unsigned char key[DIR_ENT_SIZE];
+    acorn_fs_object obj;
+    memset(&obj, 0, sizeof(obj));
+    strncpy(obj.name, name, ACORN_FS_MAX_NAME);
+    memset(key, 0, sizeof(key));
+    acorn_fs_adfs_obj2ent(&obj, key);
+    for (unsigned i = 0; i < dir->nkids; i++) {
+        node *kid = dir->kids[i];
+        memset(kid->key, 0, sizeof(kid->key));
+        acorn_fs_adfs_obj2ent(&kid->obj, kid->key);
+        if (!acorn_fs_adfs_namecmp(kid->key, key))
+            return kid;
+    }
+    return NULL;
+}
+
+static unsigned norm_attr(unsigned attr)
+{
+    return acorn_fs_default_attr(attr) & ~AFS_ATTR_DIR;
+}
+
+static node *file_node(const char *host, struct stat *stb)
+{
+    acorn_fs_object obj;
+    acorn_fs_parse_inf(&obj, host);
+    node *n = new_node(obj.name, host, false);
+    if (n) {
+        n->obj.load_addr = obj.load_addr;
+        n->obj.exec_addr = obj.exec_addr;
+        n->obj.attr = norm_attr(obj.attr);
+        n->obj.length = stb->st_size;
+    }
+    return n;
+}
+
+static int scan_dir(node *dir, const char *host_path)
+{
+    int status = AFS_OK;
+    DIR *dp = opendir(host_path);
+    if (!dp) {
+        status = errno;
+        fprintf(stderr, "afsbuild: %s: %s\n", host_path, strerror(status));
+        return status;
+    }
+    size_t hlen = strlen(host_path);
+    char *hpath = malloc(hlen + NAME_MAX + 2);
+    if (!hpath) {
+        status = errno;
+        closedir(dp);
+        return status;
+    }
+    memcpy(hpath, host_path, hlen);
+    hpath[hlen] = '/';
+    struct dirent *de;
+    while (status == AFS_OK && (de = readdir(dp))) {
+        if (de->d_name[0] == '.' || acorn_fs_is_inf(de->d_name))
+            continue;
+        strcpy(hpath + hlen + 1, de->d_name);
+        struct stat stb;
+        node *kid;
+        if (stat(hpath, &stb)) {
+            status = errno;
+            fprintf(stderr, "afsbuild: %s: %s\n", hpath, strerror(status));
+            break;
+        }
+        if (S_ISDIR(stb.st_mode)) {
+            char name[ACORN_FS_MAX_NAME+1];
+            acorn_fs_name_n2a(de->d_name, name);
+            kid = new_node(name, NULL, true);
+        }
+        else
+            kid = file_node(hpath, &stb);
+        if (!kid) {
+            status = errno;
+            break;
+        }
+        if (find_kid(dir, kid->obj.name)) {
+            fprintf(stderr, "afsbuild: %s: name %s already used\n", hpath, kid->obj.name);
+            free_node(kid);
+            status = EEXIST;
+        }
+        else if ((status = add_kid(dir, kid)) != AFS_OK)
+            free_node(kid);
+        else if (kid->obj.attr & AFS_ATTR_DIR)
+            status = scan_dir(kid, hpath);
+    }
+    closedir(dp);
+    free(hpath);
+    return status;
+}
+
+/*
+ * A manifest has one line for each file, giving the ADFS path to
+ * store it as, relative to $, followed by the host file.  Directories
+ * are created as needed.
+ */
+
+static int read_manifest(node *root, const char *manifest)
+{
+    int status = AFS_OK;
+    FILE *fp = fopen(manifest, "r");
+    if (!fp) {
+        status = errno;
+        fprintf(stderr, "afsbuild: %s: %s\n", manifest, strerror(status));
+        return status;
+    }
+    char line[ACORN_FS_MAX_PATH + PATH_MAX + 2];
+    unsigned lineno = 0;
+    while (status == AFS_OK && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *adfs_path = strtok(line, " \t\r\n");
+        char *host = strtok(NULL, "\r\n");
+        if (!adfs_path || *adfs_path == '#')
+            continue;
+        while (host && (*host == ' ' || *host == '\t'))
+            host++;
+        if (!host || !*host) {
+            fprintf(stderr, "afsbuild: %s:%u: missing host file\n", manifest, lineno);
+            status = AFS_CORRUPT;
+            break;
+        }
+        if (adfs_path[0] == '$' && adfs_path[1] == '.')
+            adfs_path += 2;
+        struct stat stb;
+        if (stat(host, &stb)) {
+            status = errno;
+            fprintf(stderr, "afsbuild: %s: %s\n", host, strerror(status));
+            break;
+        }
+        node *dir = root;
+        char *name = adfs_path, *sep;
+        while ((sep = strchr(name, '.'))) {
+            *sep = 0;
+            node *kid = find_kid(dir, name);
+            if (!kid) {
+                if (!(kid = new_node(name, NULL, true))) {
+                    status = errno;
+                    break;
+                }
+                if ((status = add_kid(dir, kid)) != AFS_OK) {
+                    free_node(kid);
+                    break;
+                }
+            }
+            else if (!(kid->obj.attr & AFS_ATTR_DIR)) {
+                fprintf(stderr, "afsbuild: %s:%u: %s is a file\n", manifest, lineno, name);
+                status = ENOTDIR;
+                break;
+            }
+            dir = kid;
+            name = sep + 1;
+        }
+        if (status != AFS_OK)
+            break;
+        node *kid = file_node(host, &stb);
+        if (!kid) {
+            status = errno;
+            break;
+        }
+        strncpy(kid->obj.name, name, ACORN_FS_MAX_NAME);
+        if (find_kid(dir, kid->obj.name)) {
+            fprintf(stderr, "afsbuild: %s:%u: %s already exists\n", manifest, lineno, name);
+            free_node(kid);
+            status = EEXIST;
+        }
+        else if ((status = add_kid(dir, kid)) != AFS_OK)
+            free_node(kid);
+    }
+    fclose(fp);
+    return status;
+}
+
+static int kid_cmp(const void *va, const void *vb)
+{
+    const node *a = *(node *const *)va;
+    const node *b = *(node *const *)vb;
+    return acorn_fs_adfs_namecmp(a->key, b->key);
+}
+
+static unsigned sectors(unsigned bytes)
+{
+    return (bytes + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE;
+}
+
+/*
+ * Assign start sectors.  The directory itself has already been
+ * placed; its files follow it and then each subdirectory with its
+ * own contents.  The write pass visits objects in the same order.
+ */
+
+static int plan(node *dir, unsigned *next, const char *path)
+{
+    if (dir->nkids > DIR_MAX_ENT) {
+        fprintf(stderr, "afsbuild: %s: too many entries (%u, max %u)\n", path, dir->nkids, DIR_MAX_ENT);
+        return AFS_DIR_FULL;
+    }
+    for (unsigned i = 0; i < dir->nkids; i++) {
+        node *kid = dir->kids[i];
+        memset(kid->key, 0, sizeof(kid->key));
+        acorn_fs_adfs_obj2ent(&kid->obj, kid->key);
+    }
+    qsort(dir->kids, dir->nkids, sizeof(node *), kid_cmp);
+    for (unsigned i = 0; i < dir->nkids; i++) {
+        node *kid = dir->kids[i];
+        if (!(kid->obj.attr & AFS_ATTR_DIR)) {
+            kid->obj.sector = *next;
+            *next += sectors(kid->obj.length);
+        }
+    }
+    for (unsigned i = 0; i < dir->nkids; i++) {
+        node *kid = dir->kids[i];
+        if (kid->obj.attr & AFS_ATTR_DIR) {
+            char kpath[ACORN_FS_MAX_PATH];
+            snprintf(kpath, sizeof(kpath), "%s.%s", path, kid->obj.name);
+            kid->obj.sector = *next;
+            *next += DIR_SECTS;
+            int status = plan(kid, next, kpath);
+            if (status != AFS_OK)
+                return status;
+        }
+    }
+    return AFS_OK;
+}
+
+static int put_sects(writer *w, const unsigned char *data, unsigned size)
+{
+    unsigned nsect = sectors(size);
+    unsigned bytes = nsect * ACORN_FS_SECT_SIZE;
+    if (w->ide) {
+        unsigned char *ptr = w->buf;
+        for (unsigned i = 0; i < bytes; i++) {
+            *ptr++ = i < size ? data[i] : 0;
+            *ptr++ = 0;
+        }
+        bytes *= 2;
+    }
+    else {
+        if (data != w->buf)
+            memcpy(w->buf, data, size);
+        memset(w->buf + size, 0, bytes - size);
+    }
+    if (bytes && fwrite(w->buf, bytes, 1, w->fp) != 1)
+        return errno;
+    w->sector += nsect;
+    return AFS_OK;
+}
+
+static int write_file(writer *w, node *n)
+{
+    int status = AFS_OK;
+    FILE *fp = fopen(n->host, "rb");
+    if (!fp)
+        return errno;
+    unsigned chunk = COPY_SECTS * ACORN_FS_SECT_SIZE;
+    unsigned left = n->obj.length;
+    unsigned char data[COPY_SECTS * ACORN_FS_SECT_SIZE];
+    while (left && status == AFS_OK) {
+        if (chunk > left)
+            chunk = left;
+        if (fread(data, chunk, 1, fp) != 1)
+            status = ferror(fp) ? errno : AFS_BAD_EOF;
+        else {
+            status = put_sects(w, data, chunk);
+            left -= chunk;
+        }
+    }
+    fclose(fp);
+    return status;
+}
+
+static int write_dir(writer *w, node *dir, unsigned parent, const char *title, const char *path)
+{
+    int status;
+    unsigned char data[ACORN_FS_ADFS_DIR_SIZE];
+    acorn_fs_adfs_dirinit(data, dir->obj.name, title, parent);
+    unsigned char *ent = data + 5;
+    for (unsigned i = 0; i < dir->nkids; i++, ent += DIR_ENT_SIZE)
+        acorn_fs_adfs_obj2ent(&dir->kids[i]->obj, ent);
+    if (w->sector != dir->obj.sector)
+        return AFS_BUG;
+    if ((status = put_sects(w, data, sizeof(data))) != AFS_OK)
+        return status;
+    for (unsigned i = 0; i < dir->nkids; i++) {
+        node *kid = dir->kids[i];
+        if (!(kid->obj.attr & AFS_ATTR_DIR)) {
+            if (w->sector != kid->obj.sector)
+                return AFS_BUG;
+            if ((status = write_file(w, kid)) != AFS_OK) {
+                fprintf(stderr, "afsbuild: %s: %s\n", kid->host, acorn_fs_strerr(status));
+                return status;
+            }
+        }
+    }
+    for (unsigned i = 0; i < dir->nkids; i++) {
+        node *kid = dir->kids[i];
+        if (kid->obj.attr & AFS_ATTR_DIR) {
+            char kpath[ACORN_FS_MAX_PATH];
+            snprintf(kpath, sizeof(kpath), "%s.%s", path, kid->obj.name);
+            if ((status = write_dir(w, kid, dir->obj.sector, kid->obj.name, kpath)) != AFS_OK)
+                return status;
+        }
+    }
+    return AFS_OK;
+}
+
+static int build(node *root, const char *fsname, unsigned total, bool ide, const char *title)
+{
+    int status;
+    unsigned used = ROOT_SECT + DIR_SECTS;
+    if ((status = plan(root, &used, "$")) != AFS_OK)
+        return status;
+    if (!total) {
+        for (int i = 0; i < sizeof(std_sizes) / sizeof(std_sizes[0]) && !total; i++)
+            if (used <= std_sizes[i])
+                total = std_sizes[i];
+        if (!total)
+            total = (used / 16 + 1) * 16; // whole tracks, leaving some free.
+    }
+    else if (used > total) {
+        fprintf(stderr, "afsbuild: %s: needs %u sectors, only %u available\n", fsname, used, total);
+        return ENOSPC;
+    }
+    writer *w = malloc(sizeof(writer));
+    if (!w)
+        return errno;
+    w->fsname = fsname;
+    w->ide = ide;
+    w->sector = 0;
+    if (!(w->fp = fopen(fsname, "wb"))) {
+        status = errno;
+        fprintf(stderr, "afsbuild: %s: %s\n", fsname, strerror(status));
+        free(w);
+        return status;
+    }
+    unsigned char fsmap[2 * ACORN_FS_SECT_SIZE];
+    acorn_fs_adfs_mapinit(fsmap, total, used);
+    if ((status = put_sects(w, fsmap, sizeof(fsmap))) == AFS_OK)
+        status = write_dir(w, root, ROOT_SECT, title, "$");
+    if (status == AFS_OK) {
+        // Extend to the full size without writing the free space.
+        off_t size = (off_t)total * ACORN_FS_SECT_SIZE * (ide ? 2 : 1);
+        if (fflush(w->fp) || ftruncate(fileno(w->fp), size))
+            status = errno;
+    }
+    if (fclose(w->fp) && status == AFS_OK)
+        status = errno;
+    if (status != AFS_OK)
+        fprintf(stderr, "afsbuild: %s: %s\n", fsname, acorn_fs_strerr(status));
+    else
+        fprintf(stderr, "afsbuild: %s: %u of %u sectors used\n", fsname, used, total);
+    free(w);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int status, opt;
+    bool ide = false;
+    unsigned total = 0;
+    const char *manifest = NULL, *title = "$";
+    while ((opt = getopt(argc, argv, "im:s:t:")) != -1) {
+        switch (opt) {
+            case 'i':
+                ide = true;
+                break;
+            case 'm':
+                manifest = optarg;
+                break;
+            case 's':
+                total = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                title = optarg;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if ((manifest && argc - optind == 1) || (!manifest && argc - optind == 2)) {
+        node *root = new_node("$", NULL, true);
+        if (!root) {
+            fprintf(stderr, "afsbuild: %s\n", strerror(errno));
+            return 2;
+        }
+        root->obj.sector = ROOT_SECT;
+        if (manifest)
+            status = read_manifest(root, manifest);
+        else
+            status = scan_dir(root, argv[optind++]);
+        if (status == AFS_OK)
+            status = build(root, argv[optind], total, ide, title) == AFS_OK ? 0 : 3;
+        else
+            status = 2;
+        free_node(root);
+    }
+    else {
+        fputs("Usage: afsbuild [ -i ] [ -s <sectors> ] [ -t <title> ] <host-dir> <img-file>\n"
+              "       afsbuild [ -i ] [ -s <sectors> ] [ -t <title> ] -m <manifest> <img-file>\n", stderr);
+        status = 1;
+    }
+    return status;
+}
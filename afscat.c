@@ -0,0 +1,111 @@
+#include "acorn-fs.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Write files, or part of them, from images to standard output.  Only
+ * the sectors covering the range asked for are read, a chunk at a
+ * time, so the head of a large file costs no more than a small one.
+ */
+
+#define CHUNK_SIZE (64 * ACORN_FS_SECT_SIZE)
+
+static bool parse_num(const char *arg, unsigned long *value)
+{
+    char *end;
+    if (*arg == '&')
+        *value = strtoul(arg + 1, &end, 16);
+    else
+        *value = strtoul(arg, &end, 0);
+    return end > arg && !*end;
+}
+
+static int cat_file(acorn_fs *fs, acorn_fs_object *obj, unsigned long offset, unsigned long length)
+{
+    unsigned char buf[CHUNK_SIZE];
+    if (offset > obj->length)
+        offset = obj->length;
+    if (length > obj->length - offset)
+        length = obj->length - offset;
+    while (length) {
+        unsigned chunk = length < sizeof(buf) ? length : sizeof(buf);
+        int status = fs->read_range(fs, obj, offset, chunk, buf);
+        if (status != AFS_OK)
+            return status;
+        if (fwrite(buf, chunk, 1, stdout) != 1)
+            return errno;
+        offset += chunk;
+        length -= chunk;
+    }
+    return AFS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long offset = 0, length = ~0UL;
+    int opt;
+    static const struct option long_opts[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { NULL }
+    };
+    while ((opt = getopt_long(argc, argv, "o:n:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                if (!parse_num(optarg, &offset)) {
+                    fprintf(stderr, "afscat: invalid offset '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                if (!parse_num(optarg, &length)) {
+                    fprintf(stderr, "afscat: invalid length '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                acorn_fs_stats_at_close(stderr);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc <= optind) {
+        fputs("Usage: afscat [ -o <offset> ] [ -n <length> ] [ --stats ] <img-file:file> [...]\n", stderr);
+        return 1;
+    }
+    int status = 0;
+    for (argv += optind; *argv; argv++) {
+        char *fsname = *argv;
+        char *sep = strchr(fsname, ':');
+        if (!sep || !sep[1]) {
+            fprintf(stderr, "afscat: name '%s' invalid, ':' and a file name required\n", fsname);
+            status++;
+            continue;
+        }
+        *sep++ = 0;
+        acorn_fs *fs = acorn_fs_open(fsname, false);
+        if (fs) {
+            acorn_fs_object obj;
+            int astat = fs->find(fs, sep, &obj);
+            if (astat == AFS_OK && (obj.attr & AFS_ATTR_DIR))
+                astat = EISDIR;
+            if (astat == AFS_OK)
+                astat = cat_file(fs, &obj, offset, length);
+            if (astat != AFS_OK) {
+                fprintf(stderr, "afscat: %s:%s: %s\n", fsname, sep, acorn_fs_strerr(astat));
+                status++;
+            }
+            acorn_fs_close(fs);
+        }
+        else {
+            fprintf(stderr, "afscat: %s: %s\n", fsname, acorn_fs_strerr(errno));
+            status++;
+        }
+    }
+    if (fflush(stdout)) {
+        fprintf(stderr, "afscat: stdout: %s\n", strerror(errno));
+        status++;
+    }
+    return status;
+}
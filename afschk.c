@@ -1,7 +1,13 @@
 #include "acorn-fs.h"
+#include <string.h>
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "--stats")) {
+        acorn_fs_stats_at_close(stderr);
+        argc--;
+        argv++;
+    }
     if (--argc) {
         int status = 0;
         while(argc--) {
@@ -21,7 +27,7 @@ int main(int argc, char *argv[])
         return status;
     }
     else {
-        fputs("Usage: afschk <acorn-fs-image>\n", stderr);
+        fputs("Usage: afschk [ --stats ] <acorn-fs-image>\n", stderr);
         return 1;
     }
 }
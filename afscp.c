@@ -1,392 +1,281 @@
 #include "acorn-fs.h"
-#include <alloca.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-#include <locale.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
 
-typedef struct {
-    const char      *src_fsname;
-    acorn_fs        *dst_fs;
-    const char      *dst_fsname;
-    acorn_fs_object *dst_obj;
-    const char      *dst_objname;
-    bool            dst_isdir;
-    bool            recurse;
-} acorn_ctx;
-
-typedef int (*native_cb)(const char *src, void *dest);
+#define PIPE_SLOTS   32
+#define DEFAULT_JOBS 4
 
 /*
- * Translate non-BBC filename characters to BBC ones according to
- * the table at http://beebwiki.mdfs.net/Filename_character_mapping
-*/
+ * When extracting recursively to the native filesystem the image is
+ * read on the main thread and the loaded files are handed over a
+ * bounded queue to a pool of writer threads which create the native
+ * files and their .inf sidecars.
+ */
 
-static const char nativ_chars[] = "#$%&.?@^";
-static const char acorn_chars[] = "?<;+/#=>";
+typedef struct {
+    acorn_fs_object obj;
+    char            *path;
+} pipe_item;
 
-static void name_n2a(const char *native_fn, char *acorn_fn)
-{
-    int ch;
-    const char *ptr;
-    char *end = acorn_fn + ACORN_FS_MAX_NAME;
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    pipe_item       items[PIPE_SLOTS];
+    unsigned        head;
+    unsigned        count;
+    bool            done;
+    int             errors;
+    unsigned        nthreads;
+    pthread_t       *threads;
+    acorn_fs_copy   *copy;
+} pipeline;
 
-    while ((ch = *native_fn++) && acorn_fn < end) {
-        if ((ptr = strchr(nativ_chars, ch)))
-            ch = acorn_chars[ptr-nativ_chars];
-        *acorn_fn++ = ch;
-    }
-    *acorn_fn = '\0';
-}
+/*
+ * For an elevator schedule the files to be extracted are first
+ * collected, with their native destination, then read in order of
+ * their start sector in a single forward sweep of the disc.
+ */
 
-static void name_a2n(const char *acorn_fn, char *native_fn)
-{
-    int ch;
-    const char *ptr;
-    char *end = native_fn + ACORN_FS_MAX_NAME;
+typedef struct {
+    acorn_fs_object obj;
+    char            *src;
+    char            *dest;
+} plan_item;
 
-    while ((ch = *acorn_fn++) && native_fn < end) {
-        if ((ptr = strchr(acorn_chars, ch)))
-            ch = nativ_chars[ptr-acorn_chars];
-        *native_fn++ = ch;
-    }
-    *native_fn = '\0';
-}
+typedef struct {
+    plan_item       *items;
+    size_t          count;
+    size_t          size;
+} plan;
 
 /*
- * Handle sidecar (.inf) files containing Acorn-specific attributes
- * that cannot be stored in the native filing system.
-*/
+ * The files planned or queued for the writers; the udata of the
+ * copy, for its extract hook.
+ */
 
-static void parse_inf(acorn_fs_object *obj, const char *filename)
-{
-    bool copy_name = true;
-    obj->load_addr = 0;
-    obj->exec_addr = 0;
-    obj->length = 0;
-    obj->attr = 0;
+typedef struct {
+    pipeline        *pipe;
+    plan            *plan;
+} extractor;
 
-    size_t len = strlen(filename);
-    char *inf = alloca(len+5);
-    strcpy(inf, filename);
-    strcpy(inf+len, ".inf");
-    FILE *fp = fopen(inf, "r");
-    if (fp) {
-        int n  = fscanf(fp, "%12s%x%x%x%x", obj->name, &obj->load_addr, &obj->exec_addr, &obj->length, &obj->attr);
-        if (n >= 1) {
-            copy_name = false;
-            if (n < 5) {
-                if (n == 2)
-                    obj->exec_addr = obj->load_addr;
-                char lck;
-                if (fscanf(fp, " %c", &lck) == 1 && (lck == 'L' || lck == 'l'))
-                    obj->attr = AFS_ATTR_LOCKED;
-            }
-        }
-        fclose(fp);
-    }
-    if (copy_name) {
-        const char *ptr = strrchr(filename, '/');
-        if (ptr)
-            filename = ptr + 1;
-        name_n2a(filename, obj->name);
+static void *pipe_writer(void *udata)
+{
+    pipeline *pipe = udata;
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (!pipe->count && !pipe->done)
+            pthread_cond_wait(&pipe->not_empty, &pipe->lock);
+        if (!pipe->count)
+            break;
+        pipe_item item = pipe->items[pipe->head];
+        pipe->head = (pipe->head + 1) % PIPE_SLOTS;
+        pipe->count--;
+        pthread_cond_signal(&pipe->not_full);
+        pthread_mutex_unlock(&pipe->lock);
+        int status = acorn_fs_save_native(pipe->copy, &item.obj, item.path);
+        acorn_fs_free_obj(&item.obj);
+        free(item.path);
+        pthread_mutex_lock(&pipe->lock);
+        if (status != AFS_OK)
+            pipe->errors++;
     }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
 }
 
-static int write_inf(acorn_fs_object *obj, const char *filename)
+static int pipe_start(pipeline *pipe, unsigned nthreads, acorn_fs_copy *cp)
 {
-    size_t len = strlen(filename);
-    char *inf = alloca(len+5);
-    strcpy(inf, filename);
-    strcpy(inf+len, ".inf");
-    FILE *fp = fopen(inf, "w");
-    if (fp) {
-        fprintf(fp, "%-12s %08X %08X %08X %02X\n", obj->name, obj->load_addr, obj->exec_addr, obj->length, obj->attr);
-        fclose(fp);
-        return AFS_OK;
-    }
-    else {
-        int err = errno;
-        fprintf(stderr, "afscp: %s: %s\n", inf, strerror(err));
-        return err;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->not_empty, NULL);
+    pthread_cond_init(&pipe->not_full, NULL);
+    pipe->head = 0;
+    pipe->count = 0;
+    pipe->done = false;
+    pipe->errors = 0;
+    pipe->nthreads = 0;
+    pipe->copy = cp;
+    if (!(pipe->threads = malloc(nthreads * sizeof(pthread_t))))
+        return errno;
+    while (pipe->nthreads < nthreads) {
+        int status = pthread_create(pipe->threads + pipe->nthreads, NULL, pipe_writer, pipe);
+        if (status) {
+            if (!pipe->nthreads)
+                return status;
+            break; // carry on with fewer writers.
+        }
+        pipe->nthreads++;
     }
+    return AFS_OK;
 }
 
 /*
- * Load a native file into memory.
-*/
+ * Queue a loaded file for writing.  Ownership of the data and the
+ * path passes to the pipeline.
+ */
 
-static int native_load(acorn_fs_object *obj, const char *filename)
+static void pipe_put(pipeline *pipe, acorn_fs_object *obj, char *path)
 {
-    int status;
-    parse_inf(obj, filename);
-    FILE *fp = fopen(filename, "rb");
-    if (fp) {
-        if (!fseek(fp, 0, SEEK_END)) {
-            int len = ftell(fp);
-            obj->length = len;
-            if (len >= 0) {
-                if (len == 0) {
-                    fclose(fp);
-                    obj->data = NULL;
-                    return AFS_OK;
-                }
-                else if ((obj->data = malloc(len))) {
-                    if (!fseek(fp, 0, SEEK_SET)) {
-                        if (fread(obj->data, len, 1, fp) == 1) {
-                            fclose(fp);
-                            return AFS_OK;
-                        }
-                        status = ferror(fp) ? errno : AFS_BAD_EOF;
-                    }
-                    else
-                        status = errno;
-                    free(obj->data);
-                }
-                else
-                    status = errno;
-            }
-            else
-                status = errno;
-        }
-        else
-            status = errno;
-        fclose(fp);
-    }
-    else
-        status = errno;
-    fprintf(stderr, "afscp: %s: %s\n", filename, strerror(status));
-    return status;
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == PIPE_SLOTS)
+        pthread_cond_wait(&pipe->not_full, &pipe->lock);
+    pipe_item *item = pipe->items + (pipe->head + pipe->count) % PIPE_SLOTS;
+    item->obj = *obj;
+    item->path = path;
+    pipe->count++;
+    pthread_cond_signal(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
 }
 
 /*
- * Save a native file.
+ * Wait for the writers to drain the queue and exit, returning the
+ * number of files they failed to write.
  */
 
-static int native_save(acorn_fs_object *obj, const char *filename)
+static int pipe_finish(pipeline *pipe)
 {
-    int status;
-    FILE *fp = fopen(filename, "wb");
-    if (fp) {
-        if (!obj->length || fwrite(obj->data, obj->length, 1, fp) == 1)
-            status = write_inf(obj, filename);
-        else {
-            status = errno;
-            fprintf(stderr, "afscp: %s: %s\n", filename, strerror(status));
-        }
-        fclose(fp);
-    }
-    else {
-        status = errno;
-        fprintf(stderr, "afscp: %s: %s\n", filename, strerror(status));
-    }
-    return status;
+    pthread_mutex_lock(&pipe->lock);
+    pipe->done = true;
+    pthread_cond_broadcast(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
+    for (unsigned i = 0; i < pipe->nthreads; i++)
+        pthread_join(pipe->threads[i], NULL);
+    free(pipe->threads);
+    pthread_cond_destroy(&pipe->not_full);
+    pthread_cond_destroy(&pipe->not_empty);
+    pthread_mutex_destroy(&pipe->lock);
+    return pipe->errors;
 }
 
-static int save_file(acorn_fs_object *obj, acorn_ctx *ctx)
+static char *native_path(acorn_fs_object *obj, acorn_fs_copy *cp)
 {
-    int status;
-    if (ctx->dst_fs) {
-        // Acorn destination.
-        if (!ctx->dst_isdir)
-            strncpy(obj->name, ctx->dst_objname, ACORN_FS_MAX_NAME);
-        if (!(obj->attr & (AFS_ATTR_UREAD|AFS_ATTR_UWRITE|AFS_ATTR_UEXEC|AFS_ATTR_OREAD|AFS_ATTR_OWRITE|AFS_ATTR_OEXEC)))
-            obj->attr |= AFS_ATTR_UREAD|AFS_ATTR_UWRITE;
-        status = ctx->dst_fs->save(ctx->dst_fs, obj, ctx->dst_obj, true);
-        if (status != AFS_OK) {
-            if (ctx->dst_isdir)
-                fprintf(stderr, "afscp: %s:%s.%s: %s\n", ctx->dst_fsname, ctx->dst_objname, obj->name, acorn_fs_strerr(status));
-            else
-                fprintf(stderr, "afscp: %s:%s: %s\n", ctx->dst_fsname, ctx->dst_objname, acorn_fs_strerr(status));
-        }
-    }
-    else {
-        // Native destination.
-        const char *name = ctx->dst_objname;
-        if (ctx->dst_isdir) {
-            size_t len = strlen(ctx->dst_objname);
-            char *path = alloca(len + ACORN_FS_MAX_NAME + 2);
-            memcpy(path, ctx->dst_objname, len);
-            path[len++] = '/';
-            name_a2n(obj->name, path+len);
-            name = path;
-        }
-        status = native_save(obj, name);
+    size_t len = strlen(cp->dst_objname);
+    char *path = malloc(len + ACORN_FS_MAX_NAME + 2);
+    if (path) {
+        memcpy(path, cp->dst_objname, len);
+        path[len++] = '/';
+        acorn_fs_name_a2n(obj->name, path+len);
     }
-    return status;
+    return path;
 }
 
-static int acorn_src(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+static int plan_add(plan *plan, acorn_fs_object *obj, const char *src, char *dest)
 {
-    acorn_ctx *ctx = udata;
-    int astat;
-    if (obj->attr & AFS_ATTR_DIR) {
-		if (ctx->recurse) {
-			if (ctx->dst_fs) {
-				/* Destination is an Acorn filesystem */
-				acorn_fs_object child;
-				memcpy(child.name, obj->name, ACORN_FS_MAX_NAME);
-				astat = ctx->dst_fs->mkdir(ctx->dst_fs, &child, ctx->dst_obj);
-				if (astat == AFS_OK || (astat == EEXIST && (child.attr & AFS_ATTR_DIR))) {
-					acorn_ctx cctx = *ctx;
-					cctx.dst_objname = obj->name;
-					cctx.dst_obj = &child;
-					astat = fs->glob(fs, obj, "*", acorn_src, &cctx);
-				}
-				else
-					fprintf(stderr, "afscp: unable to create Acorn directory %s: %s\n", child.name, acorn_fs_strerr(astat));
-			}
-			else {
-				/* Destination is the native filesystem */
-				size_t plen = strlen(ctx->dst_objname);
-				size_t nlen = strlen(obj->name);
-				char *cpath = alloca(plen+nlen+2);
-				memcpy(cpath, ctx->dst_objname, plen);
-				cpath[plen] = '/';
-				name_a2n(obj->name, cpath+plen+1);
-				struct stat stb;
-				if ((!stat(cpath, &stb) && S_ISDIR(stb.st_mode)) || !mkdir(cpath, 0755)) {
-					acorn_ctx cctx = *ctx;
-					cctx.dst_objname = cpath;
-					astat = fs->glob(fs, obj, "*", acorn_src, &cctx);
-				}
-				else {
-					astat = errno;
-					fprintf(stderr, "afscp: unable to create native directory %s: %s\n", cpath, strerror(astat));
-				}
-			}	
-		}
-		else {
-			fprintf(stderr, "afscp: skipping directory %s:%s\n", ctx->src_fsname, path);
-			astat = AFS_OK;
-		}
+    if (plan->count == plan->size) {
+        size_t size = plan->size ? plan->size * 2 : 64;
+        plan_item *items = realloc(plan->items, size * sizeof(plan_item));
+        if (!items)
+            return errno;
+        plan->items = items;
+        plan->size = size;
     }
-    else {
-		astat = fs->load(fs, obj);
-		if (astat == AFS_OK)
-			astat = save_file(obj, ctx);
-	}
-    return astat;
+    plan_item *item = plan->items + plan->count;
+    if (!(item->src = strdup(src)))
+        return errno;
+    item->obj = *obj;
+    item->obj.data = NULL;
+    item->dest = dest;
+    plan->count++;
+    return AFS_OK;
 }
 
-static int native_dir(const char *path, acorn_ctx *ctx);
+static unsigned long seek_distance(plan *plan)
+{
+    unsigned long dist = 0;
+    unsigned head = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        acorn_fs_object *obj = &plan->items[i].obj;
+        dist += (obj->sector > head) ? obj->sector - head : head - obj->sector;
+        head = obj->sector + (obj->length + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE;
+    }
+    return dist;
+}
 
-static int native_src(const char *path, const char *name, acorn_ctx *ctx)
+static int plan_cmp(const void *va, const void *vb)
 {
-	int astat;
-	struct stat stb;
-	if (!stat(path, &stb)) {
-		if (S_ISDIR(stb.st_mode)) {
-			/* Native source is a directory */
-			if (ctx->recurse) {
-				if (ctx->dst_fs) {
-					/* Destination is an Acorn filesystem */
-					acorn_fs_object child;
-					name_n2a(name, child.name);
-					astat = ctx->dst_fs->mkdir(ctx->dst_fs, &child, ctx->dst_obj);
-					if (astat == AFS_OK || (astat == EEXIST && (child.attr & AFS_ATTR_DIR))) {
-						acorn_ctx cctx = *ctx;
-						cctx.dst_objname = name;
-						cctx.dst_obj = &child;
-						astat = native_dir(path, &cctx);
-					}
-					else
-						fprintf(stderr, "afscp: unable to create Acorn directory %s: %s\n", child.name, acorn_fs_strerr(astat));
-				}
-				else {
-					/* Destination is the native filesystem */
-					size_t plen = strlen(ctx->dst_objname);
-					size_t nlen = strlen(name);
-					char *cpath = alloca(plen+nlen+2);
-					memcpy(cpath, ctx->dst_objname, plen);
-					cpath[plen] = '/';
-					strcpy(cpath+plen+1, name);
-					struct stat stb;
-					if ((!stat(cpath, &stb) && S_ISDIR(stb.st_mode)) || !mkdir(cpath, 0755)) {
-						acorn_ctx cctx = *ctx;
-						cctx.dst_objname = cpath;
-						astat = native_dir(path, &cctx);
-					}
-					else {
-						astat = errno;
-						fprintf(stderr, "afscp: unable to create native directory %s: %s\n", cpath, strerror(astat));
-					}
-				}	
-			}
-			else {
-				astat = AFS_OK;
-				fprintf(stderr, "adfscp: skipping directory %s in non-recursive mode\n", path);
-			}
-		}
-		else {
-			acorn_fs_object obj;
-			astat = native_load(&obj, path);
-			if (astat == AFS_OK)
-				astat = save_file(&obj, ctx);
-		}
-	}
-	else {
-		astat = errno;
-		fprintf(stderr, "afscp: %s: %s\n", path, strerror(astat));
-	}
-	return astat;
+    const plan_item *a = va;
+    const plan_item *b = vb;
+    if (a->obj.sector < b->obj.sector)
+        return -1;
+    return a->obj.sector > b->obj.sector;
 }
 
-static bool is_inf(const char *path)
+/*
+ * Read the planned files in sector order and write them to their
+ * native destinations, then report how far the heads were spared
+ * from travelling compared with directory order.
+ */
+
+static int plan_run(acorn_fs *fs, acorn_fs_copy *cp)
 {
-    const char *ptr = strrchr(path, '.');
-    // we know if ptr is not NULL, ptr[0] is a dot, no need to test.
-    return ptr && (ptr[1] == 'I' || ptr[1] == 'i') && (ptr[2] == 'N' || ptr[2] == 'n') && (ptr[3] == 'F' || ptr[3] == 'f') && !ptr[4];
+    extractor *ext = cp->udata;
+    plan *plan = ext->plan;
+    int status = AFS_OK;
+    unsigned long dir_dist = seek_distance(plan);
+    qsort(plan->items, plan->count, sizeof(plan_item), plan_cmp);
+    unsigned long ord_dist = seek_distance(plan);
+    for (size_t i = 0; i < plan->count; i++) {
+        plan_item *item = plan->items + i;
+        int astat = fs->load(fs, &item->obj);
+        if (astat == AFS_OK) {
+            if (ext->pipe) {
+                pipe_put(ext->pipe, &item->obj, item->dest);
+                item->obj.data = NULL;
+                item->dest = NULL;
+            }
+            else if ((astat = acorn_fs_save_native(cp, &item->obj, item->dest)) != AFS_OK)
+                status = astat;
+        }
+        else {
+            fprintf(stderr, "afscp: %s:%s: %s\n", cp->src_fsname, item->src, acorn_fs_strerr(astat));
+            status = astat;
+        }
+        acorn_fs_free_obj(&item->obj);
+        free(item->src);
+        free(item->dest);
+    }
+    if (plan->count)
+        fprintf(stderr, "afscp: %s: %zu files in sector order, seek distance %lu sectors (directory order %lu, saved %ld)\n",
+                cp->src_fsname, plan->count, ord_dist, dir_dist, (long)dir_dist - (long)ord_dist);
+    plan->count = 0;
+    return status;
 }
 
-static int native_dir(const char *path, acorn_ctx *ctx)
+/*
+ * The extract hook: an image file bound for a native directory is
+ * added to the plan or, loaded, queued for the writers.
+ */
+
+static int extract_file(acorn_fs_copy *cp, acorn_fs *fs, acorn_fs_object *obj, const char *path)
 {
-	int astat;
-	DIR *dir = opendir(path);
-	if (dir) {
-		size_t plen = strlen(path);
-		size_t nlen = plen+ACORN_FS_MAX_NAME;
-		char *cpath = malloc(nlen);
-		if (cpath) {
-			astat = AFS_OK;
-			memcpy(cpath, path, plen);
-			cpath[plen] = '/';
-			struct dirent *dp;
-			while ((dp = readdir(dir))) {
-				if (dp->d_name[0] != '.' && !is_inf(dp->d_name)) {
-					size_t reqd = plen + strlen(dp->d_name) + 2;
-					if (reqd > nlen) {
-						char *npath = realloc(cpath, reqd);
-						if (!npath) {
-							astat = ENOENT;
-							break;
-						}
-						cpath = npath;
-						nlen = reqd;
-					}
-					strcpy(cpath+plen+1, dp->d_name);
-					astat = native_src(cpath, dp->d_name, ctx);
-					if (astat != AFS_OK)
-						break;
-				}
-			}
-			free(cpath);
-		}
-		else
-			astat = ENOMEM;
-		closedir(dir);
-	}
-	else {
-		astat = errno;
-		fprintf(stderr, "afscp: unable to opendir '%s': %s\n", path, strerror(astat));
-	}
-	return astat;
+    extractor *ext = cp->udata;
+    int astat;
+    char *dest = native_path(obj, cp);
+    if (!dest)
+        astat = errno;
+    else if (ext->plan)
+        astat = plan_add(ext->plan, obj, path, dest);
+    else {
+        obj->data = NULL;
+        if ((astat = fs->load(fs, obj)) == AFS_OK) {
+            pipe_put(ext->pipe, obj, dest);
+            return AFS_OK;
+        }
+        acorn_fs_free_obj(obj);
+    }
+    if (astat != AFS_OK) {
+        free(dest);
+        fprintf(stderr, "afscp: %s:%s: %s\n", cp->src_fsname, path, acorn_fs_strerr(astat));
+    }
+    return astat;
 }
 
-static int copy_loop(int argc, char **argv, acorn_ctx *ctx)
+static int copy_loop(int argc, char **argv, acorn_fs_copy *cp)
 {
+    extractor *ext = cp->udata;
     int status = 0;
     for (argc -= 2; argc; argc--) {
         int astat;
@@ -396,25 +285,28 @@ static int copy_loop(int argc, char **argv, acorn_ctx *ctx)
             *sep++ = 0;
             acorn_fs *fs = acorn_fs_open(item, false);
             if (fs) {
-                ctx->src_fsname = item;
-                astat = fs->glob(fs, NULL, sep, acorn_src, ctx);
+                cp->src_fsname = item;
+                astat = fs->glob(fs, NULL, sep, acorn_fs_copy_cb, cp);
+                if (ext && ext->plan) {
+                    int pstat = plan_run(fs, cp);
+                    if (astat == AFS_OK)
+                        astat = pstat;
+                }
             }
             else {
                 astat = errno;
                 fprintf(stderr, "afscp: %s: %s\n", item, acorn_fs_strerr(astat));
             }
         }
-        else {
-			const char *name = strrchr(item, '/');
-			astat = native_src(item, name ? name+1 : item, ctx);
-		}
+        else
+            astat = acorn_fs_copy_native(cp, item);
         if (astat != AFS_OK)
             status++;
     }
     return status;
 }
 
-static int acorn_dest(int argc, char **argv, const char *fsname, char *dest, bool recurse)
+static int acorn_dest(int argc, char **argv, const char *fsname, char *dest, bool recurse, bool append)
 {
     int status;
     *dest++ = 0;
@@ -423,22 +315,36 @@ static int acorn_dest(int argc, char **argv, const char *fsname, char *dest, boo
         if (!*dest)
             dest = "$";
         acorn_fs_object dobj;
-        acorn_ctx ctx;
-        ctx.dst_fs = fs;
-        ctx.dst_fsname = fsname;
-        ctx.dst_obj = &dobj;
-        ctx.dst_objname = dest;
-        ctx.recurse = recurse;
+        acorn_fs_copy cp;
+        cp.prog = "afscp";
+        cp.dst_fs = fs;
+        cp.dst_fsname = fsname;
+        cp.dst_obj = &dobj;
+        cp.dst_objname = dest;
+        cp.recurse = recurse;
+        cp.append = append;
+        cp.extract = NULL;
+        cp.udata = NULL;
+        fs->deferred = true; // update each directory and the map once.
         status = fs->find(fs, dest, &dobj);
-        if (status == AFS_OK && dobj.attr & AFS_ATTR_DIR) {
-            ctx.dst_isdir = true;
-            status = copy_loop(argc, argv, &ctx);
+        if (status == AFS_OK && dobj.attr & AFS_ATTR_DIR && !append) {
+            cp.dst_isdir = true;
+            status = copy_loop(argc, argv, &cp);
         }
-        else if ((status == AFS_OK || status == ENOENT) && argc == 3 && !recurse) {
-            ctx.dst_isdir = false;
-            status = copy_loop(argc, argv, &ctx);
+        else if ((status == AFS_OK || status == ENOENT) && (argc == 3 || append) && !recurse) {
+            cp.dst_isdir = false;
+            if (status == AFS_OK && (dobj.attr & AFS_ATTR_DIR))
+                status = EISDIR;
+            else
+                status = acorn_fs_find_parent(fs, dest, &dobj, &cp.dst_leaf);
+            if (status == AFS_OK)
+                status = copy_loop(argc, argv, &cp);
+            else {
+                fprintf(stderr, "afscp: %s:%s: %s\n", fsname, dest, acorn_fs_strerr(status));
+                status = 2;
+            }
         }
-        else if (status == ENOENT) {
+        else if (status == ENOENT || status == AFS_OK) {
             fputs("afscp: destination must be a directory for multi-file/recursive copy\n", stderr);
             status = 3;
         }
@@ -446,6 +352,11 @@ static int acorn_dest(int argc, char **argv, const char *fsname, char *dest, boo
             fprintf(stderr, "afscp: %s:%s: %s\n", fsname, dest, acorn_fs_strerr(status));
             status = 2;
         }
+        int sstat = acorn_fs_sync(fs);
+        if (sstat != AFS_OK) {
+            fprintf(stderr, "afscp: %s: %s\n", fsname, acorn_fs_strerr(sstat));
+            status = 4;
+        }
     }
     else {
         fprintf(stderr, "afscp: %s: %s\n", dest, acorn_fs_strerr(errno));
@@ -462,23 +373,45 @@ static bool is_acorn_wild(const char *name)
     return 0;
 }
 
-static int native_dest(int argc, char **argv, const char *dest, bool recurse)
+static int native_dest(int argc, char **argv, const char *dest, bool recurse, unsigned jobs, bool sorted)
 {
-    acorn_ctx ctx;
-    ctx.dst_fs = NULL;
-    ctx.dst_fsname = NULL;
-    ctx.dst_obj = NULL;
-    ctx.dst_objname = dest;
-    ctx.recurse = recurse;
+    acorn_fs_copy cp;
+    plan plan = { NULL, 0, 0 };
+    extractor ext = { NULL, sorted ? &plan : NULL };
+    cp.prog = "afscp";
+    cp.dst_fs = NULL;
+    cp.dst_fsname = NULL;
+    cp.dst_obj = NULL;
+    cp.dst_objname = dest;
+    cp.dst_leaf = dest;
+    cp.recurse = recurse;
+    cp.append = false;
+    cp.extract = NULL;
+    cp.udata = NULL;
     struct stat stb;
     int status = stat(dest, &stb);
     if (!status && S_ISDIR(stb.st_mode)) {
-        ctx.dst_isdir = true;
-        status = copy_loop(argc, argv, &ctx);
+        cp.dst_isdir = true;
+        pipeline pipe;
+        if (recurse && jobs > 0) {
+            int pstat = pipe_start(&pipe, jobs, &cp);
+            if (pstat == AFS_OK)
+                ext.pipe = &pipe;
+            else
+                fprintf(stderr, "afscp: unable to start writer threads, copying serially: %s\n", strerror(pstat));
+        }
+        if (ext.pipe || ext.plan) {
+            cp.extract = extract_file;
+            cp.udata = &ext;
+        }
+        status = copy_loop(argc, argv, &cp);
+        if (ext.pipe)
+            status += pipe_finish(&pipe);
+        free(plan.items);
     }
     else if ((!status || errno == ENOENT) && argc == 3 && !is_acorn_wild(argv[1]) && !recurse) {
-        ctx.dst_isdir = false;
-        status = copy_loop(argc, argv, &ctx);
+        cp.dst_isdir = false;
+        status = copy_loop(argc, argv, &cp);
     }
     else if (!status) {
         fputs("afscp: destination must be a directory for multi-file/recursive copy\n", stderr);
@@ -493,24 +426,51 @@ static int native_dest(int argc, char **argv, const char *dest, bool recurse)
 
 int main(int argc, char *argv[])
 {
-    int status;
-    bool recurse = false;
-    if (argc >= 2 && !strcmp(argv[1], "-r")) {
-		recurse = true;
-		--argc;
-		++argv;
-	}
+    int status, opt;
+    bool recurse = false, sorted = false, append = false;
+    unsigned jobs = DEFAULT_JOBS;
+    static const struct option long_opts[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { NULL }
+    };
+    while ((opt = getopt_long(argc, argv, "arsj:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                append = true;
+                break;
+            case 'r':
+                recurse = true;
+                break;
+            case 's':
+                sorted = true;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                acorn_fs_stats_at_close(stderr);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc > 2) {
         const char *dest = argv[argc-1];
         char *sep = strchr(dest, ':');
         if (sep)
-            status = acorn_dest(argc, argv, dest, sep, recurse);
+            status = acorn_dest(argc, argv, dest, sep, recurse, append);
+        else if (append) {
+            fputs("afscp: -a needs a file in an image as the destination\n", stderr);
+            status = 1;
+        }
         else
-            status = native_dest(argc, argv, dest, recurse);
+            status = native_dest(argc, argv, dest, recurse, jobs, sorted);
         acorn_fs_close_all();
     }
     else {
-        fputs("Usage: afscp [ -r ] <src> [ <src> ... ] <dest>\n", stderr);
+        fputs("Usage: afscp [ -a | -r ] [ -s ] [ -j <writers> ] [ --stats ] <src> [ <src> ... ] <dest>\n", stderr);
         status = 1;
     }
     return status;
@@ -0,0 +1,525 @@
+#include "acorn-fs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * afsd keeps images open, with their free space maps and directories
+ * cached by the drivers, and serves requests for them over a Unix
+ * domain socket so clients pay neither process start up nor probing.
+ *
+ * Each client gets a thread.  A request is one line, a command then
+ * an image file name, optionally followed by a colon and an Acorn
+ * path or pattern:
+ *
+ *   ls <img>[:<pattern>]         list, as afsls
+ *   tree <img>[:<start>]         list recursively, as afstree
+ *   stat <img>:<path>            one object, as afsls
+ *   read <img>:<path>            the contents of a file
+ *   write <img>:<path> <load> <exec> <length>
+ *                                followed by <length> bytes of data
+ *   mkdir <img>:<path>           create a directory
+ *   rm <img>:<pattern>           remove objects
+ *   stats <img>                  the counters, as --stats
+ *   quit
+ *
+ * The reply is either "OK <length>" and that many bytes or "ERR"
+ * and a message, each on a line of its own.  A write refused before
+ * its data is read, such as one longer than the image, is answered
+ * with ERR and the connection closed.
+ *
+ * Clients may use the images named on the command line, which are
+ * opened at start up, and with -d any image file under the directory
+ * given, opened on first use.  The check is made on the real path, so
+ * neither .. nor a symbolic link leads outside it; other images are
+ * refused with EACCES.  The socket is created accessible only to the
+ * user running afsd.  Images stay open until afsd is stopped with
+ * SIGINT or SIGTERM.  Each has a reader/writer lock: listing and reading share
+ * it, updates hold it exclusively and are written back before the
+ * reply.  The lock keeps each request whole; within it the library
+ * lets readers of one image run at the same time.  The list of
+ * images is protected by open_lock.
+ */
+
+typedef struct image image;
+
+struct image {
+    acorn_fs         *fs;
+    pthread_rwlock_t lock;
+    image            *next;
+    char             name[1];
+};
+
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static image *images;
+static bool read_only;
+static char root[PATH_MAX]; // -d, empty if only named images are served.
+static volatile sig_atomic_t stopping;
+
+static bool under_root(const char *path)
+{
+    size_t len = strlen(root);
+    return len && !strncmp(path, root, len) && (path[len] == '/' || root[len-1] == '/');
+}
+
+/*
+ * Find an open image or open a new one, which a client may only do
+ * for one under the root directory.
+ */
+
+static image *get_image(const char *fsname, bool named, int *status)
+{
+    char path[PATH_MAX];
+    if (!realpath(fsname, path)) {
+        *status = errno;
+        return NULL;
+    }
+    pthread_mutex_lock(&open_lock);
+    image *img;
+    for (img = images; img; img = img->next)
+        if (!strcmp(img->name, path))
+            break;
+    if (!img) {
+        if (!named && !under_root(path))
+            *status = EACCES;
+        else if ((img = malloc(sizeof(image) + strlen(path)))) {
+            if ((img->fs = acorn_fs_open(path, !read_only))) {
+                img->fs->deferred = true; // one update per request.
+                pthread_rwlock_init(&img->lock, NULL);
+                strcpy(img->name, path);
+                img->next = images;
+                images = img;
+            }
+            else {
+                *status = errno;
+                free(img);
+                img = NULL;
+            }
+        }
+        else
+            *status = ENOMEM;
+    }
+    pthread_mutex_unlock(&open_lock);
+    return img;
+}
+
+static int update_done(image *img, int status)
+{
+    int sstat = acorn_fs_sync(img->fs);
+    pthread_rwlock_unlock(&img->lock);
+    return status == AFS_OK ? sstat : status;
+}
+
+static int info_cb(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    acorn_fs_info(obj, udata);
+    fprintf(udata, " %s\n", path);
+    return AFS_OK;
+}
+
+static int list(image *img, const char *pattern, FILE *mfp)
+{
+    pthread_rwlock_rdlock(&img->lock);
+    int status = img->fs->glob(img->fs, NULL, pattern && *pattern ? pattern : "*", info_cb, mfp);
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+static int tree(image *img, const char *start, FILE *mfp)
+{
+    int status;
+    pthread_rwlock_rdlock(&img->lock);
+    if (start && *start) {
+        acorn_fs_object obj;
+        if ((status = img->fs->find(img->fs, start, &obj)) == AFS_OK)
+            status = img->fs->walk(img->fs, &obj, info_cb, mfp);
+    }
+    else
+        status = img->fs->walk(img->fs, NULL, info_cb, mfp);
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+static int stat_obj(image *img, const char *path, FILE *mfp)
+{
+    acorn_fs_object obj;
+    pthread_rwlock_rdlock(&img->lock);
+    int status = img->fs->find(img->fs, path, &obj);
+    pthread_rwlock_unlock(&img->lock);
+    if (status == AFS_OK) {
+        acorn_fs_info(&obj, mfp);
+        fprintf(mfp, " %s\n", path);
+    }
+    return status;
+}
+
+static int read_obj(image *img, const char *path, acorn_fs_object *obj)
+{
+    obj->data = NULL;
+    pthread_rwlock_rdlock(&img->lock);
+    int status = img->fs->find(img->fs, path, obj);
+    if (status == AFS_OK) {
+        if (obj->attr & AFS_ATTR_DIR)
+            status = EISDIR;
+        else
+            status = img->fs->load(img->fs, obj);
+    }
+    pthread_rwlock_unlock(&img->lock);
+    return status;
+}
+
+/*
+ * Find the directory an object is to be created in and the leaf
+ * name.  A single character prefix that is not a directory is left
+ * in the name as it is a DFS directory letter.
+ */
+
+static int find_parent(acorn_fs *fs, char *path, acorn_fs_object *dir, char *name)
+{
+    int status;
+    char *sep = strrchr(path, '.');
+    if (sep) {
+        *sep = 0;
+        status = fs->find(fs, path, dir);
+        *sep = '.';
+        if (status == AFS_OK) {
+            if (!(dir->attr & AFS_ATTR_DIR))
+                return ENOTDIR;
+            path = sep + 1;
+        }
+        else if (status != ENOENT || sep - path != 1)
+            return status;
+        else
+            status = fs->find(fs, "$", dir);
+    }
+    else
+        status = fs->find(fs, "$", dir);
+    if (strlen(path) > ACORN_FS_MAX_NAME)
+        return ENAMETOOLONG;
+    strcpy(name, path);
+    return status;
+}
+
+static int write_obj(image *img, char *path, acorn_fs_object *obj)
+{
+    acorn_fs_object dir;
+    pthread_rwlock_wrlock(&img->lock);
+    int status = find_parent(img->fs, path, &dir, obj->name);
+    if (status == AFS_OK)
+        status = img->fs->save(img->fs, obj, &dir, true);
+    return update_done(img, status);
+}
+
+static int make_dir(image *img, char *path)
+{
+    acorn_fs_object dir, obj;
+    pthread_rwlock_wrlock(&img->lock);
+    int status = find_parent(img->fs, path, &dir, obj.name);
+    if (status == AFS_OK)
+        status = img->fs->mkdir(img->fs, &obj, &dir);
+    return update_done(img, status);
+}
+
+static int remove_objs(image *img, const char *pattern)
+{
+    pthread_rwlock_wrlock(&img->lock);
+    int status = img->fs->remove(img->fs, NULL, pattern);
+    return update_done(img, status);
+}
+
+static int stats(image *img, FILE *mfp)
+{
+    pthread_rwlock_rdlock(&img->lock);
+    acorn_fs_print_stats(img->fs, mfp);
+    pthread_rwlock_unlock(&img->lock);
+    return AFS_OK;
+}
+
+static int reply(FILE *out, int status, const char *data, size_t size)
+{
+    if (status == AFS_OK) {
+        fprintf(out, "OK %zu\n", size);
+        if (size)
+            fwrite(data, size, 1, out);
+    }
+    else
+        fprintf(out, "ERR %s\n", acorn_fs_strerr(status));
+    return fflush(out) ? errno : AFS_OK;
+}
+
+/*
+ * Read the data for a write request before any lock is taken so a
+ * slow client cannot hold up others.  No file can be longer than the
+ * image it is written to, so a longer one is refused before anything
+ * is allocated for it.
+ */
+
+static int parse_write(FILE *in, char **saveptr, image *img, acorn_fs_object *obj)
+{
+    char *load = strtok_r(NULL, " ", saveptr);
+    char *exec = strtok_r(NULL, " ", saveptr);
+    char *length = strtok_r(NULL, " \n", saveptr);
+    if (!load || !exec || !length)
+        return EINVAL;
+    char *end;
+    unsigned long value = strtoul(length, &end, 0);
+    if (*end || *length == '-')
+        return EINVAL;
+    struct stat stb;
+    if (fstat(fileno(img->fs->fp), &stb))
+        return errno;
+    if (value > UINT_MAX || value > (unsigned long long)stb.st_size)
+        return EFBIG;
+    obj->load_addr = strtoul(load, NULL, 16);
+    obj->exec_addr = strtoul(exec, NULL, 16);
+    obj->length = value;
+    obj->attr = AFS_ATTR_UREAD|AFS_ATTR_UWRITE;
+    if (!(obj->data = malloc(obj->length ? obj->length : 1)))
+        return ENOMEM;
+    if (obj->length && fread(obj->data, obj->length, 1, in) != 1) {
+        acorn_fs_free_obj(obj);
+        return AFS_BAD_EOF;
+    }
+    return AFS_OK;
+}
+
+static const char *const commands[] = {
+    "ls", "tree", "stat", "read", "write", "mkdir", "rm", "stats", NULL
+};
+
+/*
+ * Serve one request, returning false when the client has gone or
+ * asked to quit.
+ */
+
+static bool serve(FILE *in, FILE *out, char *line)
+{
+    char *saveptr;
+    char *cmd = strtok_r(line, " \n", &saveptr);
+    if (!cmd)
+        return true;
+    if (!strcmp(cmd, "quit"))
+        return false;
+    const char *const *known = commands;
+    while (*known && strcmp(*known, cmd))
+        known++;
+    if (!*known)
+        return reply(out, ENOSYS, NULL, 0) == AFS_OK;
+    char *fsname = strtok_r(NULL, " \n", &saveptr);
+    if (!fsname)
+        return reply(out, EINVAL, NULL, 0) == AFS_OK;
+    char *path = strchr(fsname, ':');
+    if (path)
+        *path++ = 0;
+
+    acorn_fs_object obj;
+    obj.data = NULL;
+    int status = AFS_OK;
+    image *img = get_image(fsname, false, &status);
+    bool is_write = !strcmp(cmd, "write");
+    if (is_write && img)
+        status = parse_write(in, &saveptr, img, &obj);
+    if (is_write && status != AFS_OK) {
+        // The data was not read, so the next request cannot be found.
+        if (status != AFS_BAD_EOF)
+            reply(out, status, NULL, 0);
+        return false;
+    }
+
+    char *data = NULL;
+    size_t size = 0;
+    FILE *mfp = open_memstream(&data, &size);
+    if (!mfp)
+        status = errno;
+    if (img && mfp) {
+        if (!strcmp(cmd, "ls"))
+            status = list(img, path, mfp);
+        else if (!strcmp(cmd, "tree"))
+            status = tree(img, path, mfp);
+        else if (!strcmp(cmd, "stats"))
+            status = stats(img, mfp);
+        else if (!path || !*path)
+            status = EINVAL;
+        else if (!strcmp(cmd, "stat"))
+            status = stat_obj(img, path, mfp);
+        else if (!strcmp(cmd, "read")) {
+            if ((status = read_obj(img, path, &obj)) == AFS_OK)
+                fwrite(obj.data, obj.length, 1, mfp);
+        }
+        else if (is_write)
+            status = write_obj(img, path, &obj);
+        else if (!strcmp(cmd, "mkdir"))
+            status = make_dir(img, path);
+        else
+            status = remove_objs(img, path);
+    }
+    acorn_fs_free_obj(&obj);
+    if (mfp && fclose(mfp) && status == AFS_OK)
+        status = errno;
+    status = reply(out, status, data, size);
+    free(data);
+    return status == AFS_OK;
+}
+
+static void *client(void *udata)
+{
+    int fd = (intptr_t)udata;
+    FILE *in = fdopen(fd, "rb");
+    FILE *out = fdopen(dup(fd), "wb");
+    if (in && out) {
+        char *line = NULL;
+        size_t size = 0;
+        while (getline(&line, &size, in) > 0 && serve(in, out, line))
+            ;
+        free(line);
+    }
+    if (out)
+        fclose(out);
+    if (in)
+        fclose(in);
+    else
+        close(fd);
+    return NULL;
+}
+
+static void stop(int sig)
+{
+    stopping = 1;
+}
+
+static int shutdown_images(void)
+{
+    pthread_mutex_lock(&open_lock);
+    for (image *img = images; img; img = img->next)
+        pthread_rwlock_wrlock(&img->lock);
+    return acorn_fs_close_all();
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    struct stat stb;
+    while ((opt = getopt(argc, argv, "rd:")) != -1) {
+        if (opt == 'r')
+            read_only = true;
+        else if (opt == 'd') {
+            int err = ENOTDIR;
+            if (!realpath(optarg, root) || stat(root, &stb))
+                err = errno;
+            else if (S_ISDIR(stb.st_mode))
+                err = 0;
+            if (err) {
+                fprintf(stderr, "afsd: %s: %s\n", optarg, strerror(err));
+                return 2;
+            }
+        }
+        else
+            argc = 0;
+    }
+    if (argc - optind < 1) {
+        fputs("Usage: afsd [ -r ] [ -d <dir> ] <socket> [ <img-file> ... ]\n", stderr);
+        return 1;
+    }
+    setlocale(LC_ALL, "");
+    const char *sockname = argv[optind++];
+    struct sockaddr_un addr;
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "afsd: %s: %s\n", sockname, strerror(ENAMETOOLONG));
+        return 2;
+    }
+    for (; optind < argc; optind++) {
+        int status;
+        if (!get_image(argv[optind], true, &status)) {
+            fprintf(stderr, "afsd: %s: %s\n", argv[optind], acorn_fs_strerr(status));
+            acorn_fs_close_all();
+            return 2;
+        }
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        fprintf(stderr, "afsd: socket: %s\n", strerror(errno));
+        return 2;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockname);
+    unlink(sockname);
+    mode_t mask = umask(077);
+    int err = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (err || listen(sock, SOMAXCONN) || fcntl(sock, F_SETFL, O_NONBLOCK)) {
+        fprintf(stderr, "afsd: %s: %s\n", sockname, strerror(errno));
+        acorn_fs_close_all();
+        return 2;
+    }
+
+    /*
+     * Stop on a signal.  The signals are blocked, in the client
+     * threads too, except while the main thread waits in pselect, so
+     * one cannot arrive between the test of stopping and the wait.
+     */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stopsigs, oldsigs;
+    sigemptyset(&stopsigs);
+    sigaddset(&stopsigs, SIGINT);
+    sigaddset(&stopsigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopsigs, &oldsigs);
+
+    int status = 0;
+    while (!stopping) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        if (pselect(sock + 1, &fds, NULL, NULL, NULL, &oldsigs) < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "afsd: select: %s\n", strerror(errno));
+                status = 3;
+                break;
+            }
+            continue;
+        }
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            // The connection may have gone again since pselect.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "afsd: accept: %s\n", strerror(errno));
+                status = 3;
+                break;
+            }
+            continue;
+        }
+        fcntl(fd, F_SETFL, 0); // some systems pass on O_NONBLOCK.
+        pthread_t thread;
+        err = pthread_create(&thread, NULL, client, (void *)(intptr_t)fd);
+        if (err) {
+            fprintf(stderr, "afsd: %s\n", strerror(err));
+            close(fd);
+        }
+        else
+            pthread_detach(thread);
+    }
+    close(sock);
+    unlink(sockname);
+    int astat = shutdown_images();
+    if (astat != AFS_OK) {
+        fprintf(stderr, "afsd: %s\n", acorn_fs_strerr(astat));
+        status = 4;
+    }
+    return status;
+}
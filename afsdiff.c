@@ -0,0 +1,238 @@
+#include "acorn-fs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * Compare the files in two images, or two directories in images,
+ * without extracting them.  Each side is walked once and its objects
+ * listed by path, which keeps the directory letter of a DFS file, and
+ * the two lists, sorted by path, are merged.  Files whose length,
+ * addresses or attributes differ are changed without reading them;
+ * only when those all match are the contents loaded and compared.
+ */
+
+typedef struct {
+    acorn_fs        *fs[2];
+    const char      *fsname[2];
+    bool            summary;
+    unsigned        added;
+    unsigned        changed;
+    unsigned        removed;
+    unsigned        same;
+    int             status;
+} diff_ctx;
+
+typedef struct {
+    acorn_fs_object obj;
+    char            *path;
+} diff_ent;
+
+typedef struct {
+    diff_ent        *ents;
+    size_t          count;
+    size_t          size;
+} ent_list;
+
+static int collect(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    ent_list *list = udata;
+    if (list->count == list->size) {
+        size_t size = list->size ? list->size * 2 : 32;
+        diff_ent *ents = realloc(list->ents, size * sizeof(diff_ent));
+        if (!ents)
+            return errno;
+        list->ents = ents;
+        list->size = size;
+    }
+    diff_ent *ent = list->ents + list->count;
+    if (!(ent->path = strdup(path)))
+        return errno;
+    ent->obj = *obj;
+    ent->obj.data = NULL;
+    list->count++;
+    return AFS_OK;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+    return strcasecmp(((const diff_ent *)a)->path, ((const diff_ent *)b)->path);
+}
+
+static void free_list(ent_list *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+        free(list->ents[i].path);
+    free(list->ents);
+}
+
+static int list_tree(diff_ctx *ctx, int side, acorn_fs_object *dir, const char *path, ent_list *list)
+{
+    list->ents = NULL;
+    list->count = list->size = 0;
+    acorn_fs_object start = *dir;
+    int status = ctx->fs[side]->walk(ctx->fs[side], &start, collect, list);
+    if (status != AFS_OK) {
+        fprintf(stderr, "afsdiff: %s:%s: %s\n", ctx->fsname[side], path, acorn_fs_strerr(status));
+        ctx->status = status;
+        free_list(list);
+        return status;
+    }
+    // ADFS walks each directory in order, so this is usually one pass.
+    for (size_t i = 1; i < list->count; i++) {
+        if (path_cmp(list->ents + i - 1, list->ents + i) > 0) {
+            qsort(list->ents, list->count, sizeof(diff_ent), path_cmp);
+            break;
+        }
+    }
+    return AFS_OK;
+}
+
+static void report(int what, const char *path, acorn_fs_object *obj)
+{
+    printf("%c ", what);
+    acorn_fs_info(obj, stdout);
+    printf(" %s\n", path);
+}
+
+static bool same_data(diff_ctx *ctx, acorn_fs_object *a, acorn_fs_object *b, const char *path)
+{
+    bool same = false;
+    int status = ctx->fs[0]->load(ctx->fs[0], a);
+    if (status == AFS_OK) {
+        if ((status = ctx->fs[1]->load(ctx->fs[1], b)) == AFS_OK) {
+            same = a->length == b->length && !memcmp(a->data, b->data, a->length);
+            acorn_fs_free_obj(b);
+        }
+        else
+            fprintf(stderr, "afsdiff: %s:%s: %s\n", ctx->fsname[1], path, acorn_fs_strerr(status));
+        acorn_fs_free_obj(a);
+    }
+    else
+        fprintf(stderr, "afsdiff: %s:%s: %s\n", ctx->fsname[0], path, acorn_fs_strerr(status));
+    if (status != AFS_OK)
+        ctx->status = status;
+    return same;
+}
+
+/*
+ * Compare one path present on either or both sides.  Everything in a
+ * directory present on one side only is in that side's list, so is
+ * reported along with it, and a file replaced by a directory or the
+ * other way round is a removal followed by an addition.
+ */
+
+static void diff_obj(diff_ctx *ctx, acorn_fs_object *a, acorn_fs_object *b, const char *path)
+{
+    if (a && b && (a->attr & AFS_ATTR_DIR) != (b->attr & AFS_ATTR_DIR)) {
+        diff_obj(ctx, a, NULL, path);
+        diff_obj(ctx, NULL, b, path);
+    }
+    else if (!b) {
+        report('-', path, a);
+        ctx->removed++;
+    }
+    else if (!a) {
+        report('+', path, b);
+        ctx->added++;
+    }
+    else if (a->load_addr != b->load_addr || a->exec_addr != b->exec_addr || a->attr != b->attr || (a->length != b->length && !(a->attr & AFS_ATTR_DIR))) {
+        report('M', path, b);
+        ctx->changed++;
+    }
+    else if (!(a->attr & AFS_ATTR_DIR)) {
+        if (same_data(ctx, a, b, path))
+            ctx->same++;
+        else {
+            report('M', path, b);
+            ctx->changed++;
+        }
+    }
+}
+
+static void diff_tree(diff_ctx *ctx, acorn_fs_object *a_dir, acorn_fs_object *b_dir, const char *path)
+{
+    ent_list a, b;
+    if (list_tree(ctx, 0, a_dir, path, &a) == AFS_OK) {
+        if (list_tree(ctx, 1, b_dir, path, &b) == AFS_OK) {
+            size_t plen = strlen(path);
+            char *kpath = malloc(plen + ACORN_FS_MAX_PATH + 2);
+            if (kpath) {
+                memcpy(kpath, path, plen);
+                kpath[plen] = '.';
+                size_t i = 0, j = 0;
+                while (i < a.count || j < b.count) {
+                    diff_ent *ae = i < a.count ? a.ents + i : NULL;
+                    diff_ent *be = j < b.count ? b.ents + j : NULL;
+                    int cmp = !ae ? 1 : !be ? -1 : path_cmp(ae, be);
+                    if (cmp < 0)
+                        be = NULL;
+                    else if (cmp > 0)
+                        ae = NULL;
+                    strcpy(kpath + plen + 1, (ae ? ae : be)->path);
+                    diff_obj(ctx, ae ? &ae->obj : NULL, be ? &be->obj : NULL, kpath);
+                    if (ae)
+                        i++;
+                    if (be)
+                        j++;
+                }
+                free(kpath);
+            }
+            else {
+                fprintf(stderr, "afsdiff: %s\n", strerror(errno));
+                ctx->status = errno;
+            }
+            free_list(&b);
+        }
+        free_list(&a);
+    }
+}
+
+static int open_side(diff_ctx *ctx, int side, char *arg, acorn_fs_object *dir, const char **path)
+{
+    int status;
+    char *sep = strchr(arg, ':');
+    if (sep)
+        *sep++ = 0;
+    *path = sep && *sep ? sep : "$";
+    ctx->fsname[side] = arg;
+    if (!(ctx->fs[side] = acorn_fs_open_err(arg, false, &status)))
+        fprintf(stderr, "afsdiff: %s: %s\n", arg, acorn_fs_strerr(status));
+    else if ((status = ctx->fs[side]->find(ctx->fs[side], *path, dir)) != AFS_OK || !(dir->attr & AFS_ATTR_DIR))
+        fprintf(stderr, "afsdiff: %s:%s: %s\n", arg, *path, status == AFS_OK ? strerror(status = ENOTDIR) : acorn_fs_strerr(status));
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    diff_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+            case 's':
+                ctx.summary = true;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 2) {
+        fputs("Usage: afsdiff [ -s ] <img-file>[:<dir>] <img-file>[:<dir>]\n", stderr);
+        return 2;
+    }
+    acorn_fs_object a_dir, b_dir;
+    const char *a_path, *b_path;
+    if (open_side(&ctx, 0, argv[optind], &a_dir, &a_path) != AFS_OK || open_side(&ctx, 1, argv[optind+1], &b_dir, &b_path) != AFS_OK) {
+        acorn_fs_close_all();
+        return 2;
+    }
+    diff_tree(&ctx, &a_dir, &b_dir, b_path);
+    if (ctx.summary)
+        fprintf(stderr, "afsdiff: %u added, %u changed, %u removed, %u unchanged\n", ctx.added, ctx.changed, ctx.removed, ctx.same);
+    acorn_fs_close_all();
+    if (ctx.status != AFS_OK)
+        return 2;
+    return ctx.added || ctx.changed || ctx.removed ? 1 : 0;
+}
@@ -0,0 +1,501 @@
+#include "acorn-fs.h"
+#include <locale.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Build a catalogue of every file in a collection of images, with a
+ * hash of its contents, and answer questions about duplication from
+ * the catalogue alone.
+ *
+ * The catalogue is a small header followed by the image names and
+ * then one record per file, sorted by hash.  All integers are little
+ * endian:
+ *
+ *   "AFSIDX\1\0" u32 image-count u32 record-count
+ *   image-count * { u16 length, name }
+ *   record-count * { u64 hash, u32 length, u32 load, u32 exec,
+ *                    u32 image, u16 attr, u8 length, path }
+ */
+
+#define DEFAULT_JOBS 4
+
+static const char magic[8] = "AFSIDX\1";
+
+typedef struct {
+    uint64_t hash;
+    unsigned length;
+    unsigned load_addr;
+    unsigned exec_addr;
+    unsigned image;
+    unsigned attr;
+    char     *path;
+} record;
+
+typedef struct {
+    record   *recs;
+    size_t   count;
+    size_t   size;
+} rec_list;
+
+typedef struct {
+    char            **images;
+    unsigned        nimages;
+    unsigned        next;
+    int             errors;
+    pthread_mutex_t lock;
+} job_queue;
+
+typedef struct {
+    job_queue       *queue;
+    rec_list        list;
+    unsigned        image;
+    const char      *fsname;
+} worker;
+
+static int rec_add(rec_list *list, record *rec)
+{
+    if (list->count == list->size) {
+        size_t size = list->size ? list->size * 2 : 256;
+        record *recs = realloc(list->recs, size * sizeof(record));
+        if (!recs)
+            return errno;
+        list->recs = recs;
+        list->size = size;
+    }
+    list->recs[list->count++] = *rec;
+    return AFS_OK;
+}
+
+static int index_file(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    worker *w = udata;
+    if (obj->attr & AFS_ATTR_DIR)
+        return AFS_OK;
+    obj->data = NULL;
+    int status = fs->load(fs, obj);
+    if (status == AFS_OK) {
+        record rec;
+        rec.hash = acorn_fs_hash(obj->data, obj->length);
+        rec.length = obj->length;
+        rec.load_addr = obj->load_addr;
+        rec.exec_addr = obj->exec_addr;
+        rec.image = w->image;
+        rec.attr = obj->attr;
+        if ((rec.path = strdup(path)) && (status = rec_add(&w->list, &rec)) == AFS_OK) {
+            acorn_fs_free_obj(obj);
+            return AFS_OK;
+        }
+        if (!rec.path)
+            status = errno;
+        free(rec.path);
+    }
+    acorn_fs_free_obj(obj);
+    fprintf(stderr, "afsindex: %s:%s: %s\n", w->fsname, path, acorn_fs_strerr(status));
+    return AFS_OK; // carry on with the rest of the image.
+}
+
+static void *index_worker(void *udata)
+{
+    worker *w = udata;
+    job_queue *q = w->queue;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        if (q->next >= q->nimages) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        w->image = q->next++;
+        w->fsname = q->images[w->image];
+        pthread_mutex_unlock(&q->lock);
+        int status;
+        acorn_fs *fs = acorn_fs_open_err(w->fsname, false, &status);
+        if (fs) {
+            if ((status = fs->walk(fs, NULL, index_file, w)) != AFS_OK)
+                fprintf(stderr, "afsindex: %s: %s\n", w->fsname, acorn_fs_strerr(status));
+            acorn_fs_close(fs);
+        }
+        else
+            fprintf(stderr, "afsindex: %s: %s\n", w->fsname, acorn_fs_strerr(status));
+        pthread_mutex_lock(&q->lock);
+        if (status != AFS_OK)
+            q->errors++;
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+static int rec_cmp(const void *va, const void *vb)
+{
+    const record *a = va;
+    const record *b = vb;
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : 1;
+    if (a->length != b->length)
+        return a->length < b->length ? -1 : 1;
+    if (a->image != b->image)
+        return a->image < b->image ? -1 : 1;
+    return strcmp(a->path, b->path);
+}
+
+static int str_cmp(const void *va, const void *vb)
+{
+    return strcmp(*(char *const *)va, *(char *const *)vb);
+}
+
+static void put16(FILE *fp, unsigned value)
+{
+    putc(value & 0xff, fp);
+    putc((value >> 8) & 0xff, fp);
+}
+
+static void put32(FILE *fp, uint32_t value)
+{
+    put16(fp, value & 0xffff);
+    put16(fp, value >> 16);
+}
+
+static void put64(FILE *fp, uint64_t value)
+{
+    put32(fp, value & 0xffffffff);
+    put32(fp, value >> 32);
+}
+
+static int write_cat(const char *catname, char **images, unsigned nimages, rec_list *list)
+{
+    FILE *fp = fopen(catname, "wb");
+    if (!fp)
+        return errno;
+    fwrite(magic, sizeof(magic), 1, fp);
+    put32(fp, nimages);
+    put32(fp, list->count);
+    for (unsigned i = 0; i < nimages; i++) {
+        size_t len = strlen(images[i]);
+        put16(fp, len);
+        fwrite(images[i], len, 1, fp);
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        record *rec = list->recs + i;
+        size_t len = strlen(rec->path);
+        put64(fp, rec->hash);
+        put32(fp, rec->length);
+        put32(fp, rec->load_addr);
+        put32(fp, rec->exec_addr);
+        put32(fp, rec->image);
+        put16(fp, rec->attr);
+        putc(len, fp);
+        fwrite(rec->path, len, 1, fp);
+    }
+    if (ferror(fp)) {
+        int status = errno;
+        fclose(fp);
+        return status;
+    }
+    return fclose(fp) ? errno : AFS_OK;
+}
+
+static int build(const char *catname, unsigned jobs, int nimages, char **images)
+{
+    int status;
+    job_queue q;
+    qsort(images, nimages, sizeof(char *), str_cmp);
+    q.images = images;
+    q.nimages = 0;
+    for (int i = 0; i < nimages; i++)
+        if (!q.nimages || strcmp(images[i], q.images[q.nimages-1]))
+            images[q.nimages++] = images[i];
+    q.next = 0;
+    q.errors = 0;
+    pthread_mutex_init(&q.lock, NULL);
+    if (jobs < 1)
+        jobs = 1;
+    worker *workers = calloc(jobs, sizeof(worker));
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    if (!workers || !threads) {
+        fprintf(stderr, "afsindex: %s\n", strerror(errno));
+        return 2;
+    }
+    unsigned nthreads = 0;
+    for (unsigned i = 0; i < jobs; i++) {
+        workers[i].queue = &q;
+        if (pthread_create(threads + i, NULL, index_worker, workers + i))
+            break;
+        nthreads++;
+    }
+    if (!nthreads)
+        index_worker(workers);
+    for (unsigned i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    rec_list all = { NULL, 0, 0 };
+    for (unsigned i = 0; i < jobs; i++) {
+        for (size_t r = 0; r < workers[i].list.count; r++)
+            if (rec_add(&all, workers[i].list.recs + r) != AFS_OK) {
+                fprintf(stderr, "afsindex: %s\n", strerror(errno));
+                return 2;
+            }
+        free(workers[i].list.recs);
+    }
+    qsort(all.recs, all.count, sizeof(record), rec_cmp);
+    if ((status = write_cat(catname, q.images, q.nimages, &all)) != AFS_OK) {
+        fprintf(stderr, "afsindex: %s: %s\n", catname, strerror(status));
+        status = 2;
+    }
+    else
+        status = q.errors ? 3 : 0;
+    for (size_t i = 0; i < all.count; i++)
+        free(all.recs[i].path);
+    free(all.recs);
+    free(threads);
+    free(workers);
+    pthread_mutex_destroy(&q.lock);
+    return status;
+}
+
+/*
+ * Reading the catalogue back.
+ */
+
+typedef struct {
+    unsigned char *data;
+    unsigned char *ptr;
+    unsigned char *end;
+    char          **images;
+    unsigned      nimages;
+    rec_list      list;
+} catalogue;
+
+static bool need(catalogue *cat, size_t bytes)
+{
+    return (size_t)(cat->end - cat->ptr) >= bytes;
+}
+
+static unsigned get16(catalogue *cat)
+{
+    unsigned value = cat->ptr[0] | (cat->ptr[1] << 8);
+    cat->ptr += 2;
+    return value;
+}
+
+static uint32_t get32(catalogue *cat)
+{
+    uint32_t value = get16(cat);
+    return value | (get16(cat) << 16);
+}
+
+static uint64_t get64(catalogue *cat)
+{
+    uint64_t value = get32(cat);
+    return value | ((uint64_t)get32(cat) << 32);
+}
+
+static char *get_str(catalogue *cat, size_t len)
+{
+    char *str = malloc(len + 1);
+    if (str) {
+        memcpy(str, cat->ptr, len);
+        str[len] = 0;
+        cat->ptr += len;
+    }
+    return str;
+}
+
+static int read_cat(const char *catname, catalogue *cat)
+{
+    int status = AFS_OK;
+    FILE *fp = fopen(catname, "rb");
+    if (!fp)
+        return errno;
+    memset(cat, 0, sizeof(catalogue));
+    if (fseek(fp, 0, SEEK_END) || (status = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET))
+        status = errno;
+    else {
+        size_t size = status;
+        status = AFS_OK;
+        if (!(cat->data = malloc(size + 1)))
+            status = errno;
+        else if (size && fread(cat->data, size, 1, fp) != 1)
+            status = ferror(fp) ? errno : AFS_BAD_EOF;
+        cat->ptr = cat->data;
+        cat->end = cat->data + size;
+    }
+    fclose(fp);
+    if (status != AFS_OK)
+        return status;
+    if (!need(cat, 16) || memcmp(cat->ptr, magic, sizeof(magic)))
+        return AFS_CORRUPT;
+    cat->ptr += sizeof(magic);
+    cat->nimages = get32(cat);
+    size_t nrecs = get32(cat);
+    if (!(cat->images = calloc(cat->nimages + 1, sizeof(char *))))
+        return errno;
+    for (unsigned i = 0; i < cat->nimages; i++) {
+        if (!need(cat, 2))
+            return AFS_CORRUPT;
+        size_t len = get16(cat);
+        if (!need(cat, len))
+            return AFS_CORRUPT;
+        if (!(cat->images[i] = get_str(cat, len)))
+            return errno;
+    }
+    for (size_t i = 0; i < nrecs; i++) {
+        record rec;
+        if (!need(cat, 27))
+            return AFS_CORRUPT;
+        rec.hash = get64(cat);
+        rec.length = get32(cat);
+        rec.load_addr = get32(cat);
+        rec.exec_addr = get32(cat);
+        rec.image = get32(cat);
+        rec.attr = get16(cat);
+        size_t len = *cat->ptr++;
+        if (!need(cat, len) || rec.image >= cat->nimages)
+            return AFS_CORRUPT;
+        if (!(rec.path = get_str(cat, len)))
+            return errno;
+        if ((status = rec_add(&cat->list, &rec)) != AFS_OK)
+            return status;
+    }
+    return AFS_OK;
+}
+
+static void print_rec(catalogue *cat, record *rec)
+{
+    acorn_fs_object obj;
+    obj.load_addr = rec->load_addr;
+    obj.exec_addr = rec->exec_addr;
+    obj.length = rec->length;
+    obj.attr = rec->attr;
+    obj.sector = 0;
+    acorn_fs_info(&obj, stdout);
+    printf(" %016llX %s:%s\n", (unsigned long long)rec->hash, cat->images[rec->image], rec->path);
+}
+
+static int query(catalogue *cat, const char *filename)
+{
+    int status = AFS_OK;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        status = errno;
+        fprintf(stderr, "afsindex: %s: %s\n", filename, strerror(status));
+    }
+    else {
+        unsigned char *data = NULL;
+        long len = 0;
+        if (fseek(fp, 0, SEEK_END) || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET))
+            status = errno;
+        else if (!(data = malloc(len + 1)))
+            status = errno;
+        else if (len && fread(data, len, 1, fp) != 1)
+            status = ferror(fp) ? errno : AFS_BAD_EOF;
+        fclose(fp);
+        if (status == AFS_OK) {
+            record key;
+            key.hash = acorn_fs_hash(data, len);
+            key.length = len;
+            size_t lo = 0, hi = cat->list.count;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                record *rec = cat->list.recs + mid;
+                if (rec->hash < key.hash || (rec->hash == key.hash && rec->length < key.length))
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            int found = 0;
+            for (; lo < cat->list.count; lo++) {
+                record *rec = cat->list.recs + lo;
+                if (rec->hash != key.hash || rec->length != key.length)
+                    break;
+                print_rec(cat, rec);
+                found++;
+            }
+            if (!found) {
+                fprintf(stderr, "afsindex: %s: not in catalogue\n", filename);
+                status = ENOENT;
+            }
+        }
+        else
+            fprintf(stderr, "afsindex: %s: %s\n", filename, acorn_fs_strerr(status));
+        free(data);
+    }
+    return status;
+}
+
+static void summary(catalogue *cat)
+{
+    unsigned long long total_bytes = 0, unique_bytes = 0;
+    size_t unique = 0;
+    for (size_t i = 0; i < cat->list.count; i++) {
+        record *rec = cat->list.recs + i;
+        total_bytes += rec->length;
+        if (!i || rec->hash != rec[-1].hash || rec->length != rec[-1].length) {
+            unique_bytes += rec->length;
+            unique++;
+        }
+    }
+    printf("images:       %'u\n", cat->nimages);
+    printf("files:        %'zu\n", cat->list.count);
+    printf("unique files: %'zu\n", unique);
+    printf("total bytes:  %'llu\n", total_bytes);
+    printf("unique bytes: %'llu\n", unique_bytes);
+    if (total_bytes)
+        printf("duplication:  %.1f%%\n", 100.0 * (total_bytes - unique_bytes) / total_bytes);
+}
+
+int main(int argc, char *argv[])
+{
+    int status, opt;
+    const char *outname = NULL, *catname = NULL;
+    bool stats = false;
+    unsigned jobs = DEFAULT_JOBS;
+    char **queries = calloc(argc, sizeof(char *));
+    int nqueries = 0;
+    setlocale(LC_ALL, "");
+    while ((opt = getopt(argc, argv, "o:f:j:q:s")) != -1) {
+        switch (opt) {
+            case 'o':
+                outname = optarg;
+                break;
+            case 'f':
+                catname = optarg;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                queries[nqueries++] = optarg;
+                break;
+            case 's':
+                stats = true;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (outname && optind < argc && !catname)
+        status = build(outname, jobs, argc - optind, argv + optind);
+    else if (catname && !outname && optind == argc && (nqueries || stats)) {
+        catalogue cat;
+        if ((status = read_cat(catname, &cat)) == AFS_OK) {
+            for (int i = 0; i < nqueries; i++)
+                if (query(&cat, queries[i]) != AFS_OK)
+                    status++;
+            if (stats)
+                summary(&cat);
+        }
+        else {
+            fprintf(stderr, "afsindex: %s: %s\n", catname, acorn_fs_strerr(status));
+            status = 2;
+        }
+    }
+    else {
+        fputs("Usage: afsindex -o <catalogue> [ -j <threads> ] <img-file> [...]\n"
+              "       afsindex -f <catalogue> [ -q <host-file> ... ] [ -s ]\n", stderr);
+        status = 1;
+    }
+    free(queries);
+    return status;
+}
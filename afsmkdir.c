@@ -57,7 +57,7 @@ static int acorn_mkdir(const char *fsname, char *dir_path)
 }
 
 #ifndef __APPLE__
-#ifndef __GLIBC__
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38)
 static inline void strlcpy(char *dest, const char *src, size_t len)
 {
 	strncpy(dest, src, --len);
@@ -71,6 +71,11 @@ int main(int argc, char *argv[])
     int status = 0;
     char orig_path[1024];
 
+    if (argc > 1 && !strcmp(argv[1], "--stats")) {
+        acorn_fs_stats_at_close(stderr);
+        argc--;
+        argv++;
+    }
     if (argc >= 2) {
         while (argc >= 2) {
             int ret;
@@ -98,7 +103,7 @@ int main(int argc, char *argv[])
             argc--;
         }
     } else {
-        fputs("Usage: afsmkdir <directory> [ <directory> ... ]\n", stderr);
+        fputs("Usage: afsmkdir [ --stats ] <directory> [ <directory> ... ]\n", stderr);
         status = 1;
     }
     return status;
@@ -0,0 +1,186 @@
+#include "acorn-fs.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * Create a blank DFS or ADFS image.  Only the catalogue, or the free
+ * space map and root directory, are written; the file is then
+ * extended to its full size with ftruncate so the rest takes no space
+ * on filing systems with sparse files and a large hard disc image is
+ * made as quickly as a floppy.
+ */
+
+#define DFS_MAX_SECTS  0x3ff
+#define ADFS_MAX_SECTS 0xffffff
+#define ADFS_USED      7  // free space map and root directory.
+
+static const struct {
+    const char *ext;
+    bool       dfs;
+    int        layout;
+    unsigned   sectors;   // default size, per side for DFS.
+    unsigned   max_sects;
+} types[] = {
+    { ".ssd", true,  AFS_LAYOUT_SIMPLE,   800,  DFS_MAX_SECTS  },
+    { ".dsd", true,  AFS_LAYOUT_ILEAVE10, 800,  800            },
+    { ".adf", false, AFS_LAYOUT_SIMPLE,   1280, ADFS_MAX_SECTS },
+    { ".adl", false, AFS_LAYOUT_ILEAVE16, 2560, 2560           },
+    { ".ide", false, AFS_LAYOUT_IDE,      0,    ADFS_MAX_SECTS },
+    { NULL,   false, AFS_LAYOUT_SIMPLE,   0,    ADFS_MAX_SECTS }
+};
+
+/*
+ * A size is a number of sectors or, with a K, M or G suffix, a number
+ * of bytes which must be a whole number of sectors.
+ */
+
+static bool parse_size(const char *arg, unsigned long *sectors)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 0);
+    if (end == arg)
+        return false;
+    if (*end) {
+        const char *units = "KMG";
+        const char *unit = strchr(units, *end & ~0x20);
+        if (!unit || end[1])
+            return false;
+        unsigned shift = 10 * (unit - units + 1);
+        if (value > ULLONG_MAX >> shift)
+            return false;
+        value <<= shift;
+        if (value % ACORN_FS_SECT_SIZE)
+            return false;
+        value /= ACORN_FS_SECT_SIZE;
+    }
+    if (value > ULONG_MAX)
+        return false;
+    *sectors = value;
+    return true;
+}
+
+static void dfs_catinit(unsigned char *cat, const char *title, unsigned sectors)
+{
+    memset(cat, 0, 2 * ACORN_FS_SECT_SIZE);
+    for (int i = 0; i < 12; i++) {
+        char c = i < strlen(title) ? title[i] : ' ';
+        cat[i < 8 ? i : 0x100 + i - 8] = c;
+    }
+    cat[0x106] = (sectors >> 8) & 0x03;
+    cat[0x107] = sectors & 0xff;
+}
+
+/*
+ * Write the formatted sectors at the start of the image, doubling each
+ * byte for IDE, and extend the file to size bytes.
+ */
+
+static int write_blank(FILE *fp, const unsigned char *data, size_t len, off_t size, bool ide)
+{
+    for (size_t i = 0; i < len; i++)
+        if (putc(data[i], fp) == EOF || (ide && putc(0, fp) == EOF))
+            return errno;
+    if (fflush(fp) || ftruncate(fileno(fp), size))
+        return errno;
+    return AFS_OK;
+}
+
+static int mkfs(const char *fsname, unsigned long sectors, bool ide, const char *title)
+{
+    const char *ext = strrchr(fsname, '.');
+    int t = 0;
+    while (types[t].ext && !(ext && !strcasecmp(ext, types[t].ext)))
+        t++;
+    int layout = types[t].layout;
+    if (ide) {
+        if (types[t].dfs || layout == AFS_LAYOUT_ILEAVE16) {
+            fprintf(stderr, "afsmkfs: %s: only an ADFS hard disc image can be IDE\n", fsname);
+            return EINVAL;
+        }
+        layout = AFS_LAYOUT_IDE;
+    }
+    if (!sectors && !(sectors = types[t].sectors)) {
+        fprintf(stderr, "afsmkfs: %s: a size is needed for a hard disc image\n", fsname);
+        return EINVAL;
+    }
+    unsigned min_sects = types[t].dfs ? 2 : ADFS_USED;
+    if (sectors <= min_sects || sectors > types[t].max_sects) {
+        fprintf(stderr, "afsmkfs: %s: %lu sectors is outside %u to %u\n", fsname, sectors, min_sects + 1, types[t].max_sects);
+        return EINVAL;
+    }
+
+    unsigned char data[12 * ACORN_FS_SECT_SIZE];
+    size_t len;
+    off_t size = (off_t)sectors * ACORN_FS_SECT_SIZE;
+    if (types[t].dfs) {
+        if (!title)
+            title = "";
+        dfs_catinit(data, title, sectors);
+        len = 2 * ACORN_FS_SECT_SIZE;
+        if (layout == AFS_LAYOUT_ILEAVE10) {
+            // The second side has a catalogue of its own at the start
+            // of the second track in the file.
+            memset(data + len, 0, 8 * ACORN_FS_SECT_SIZE);
+            memcpy(data + 10 * ACORN_FS_SECT_SIZE, data, len);
+            len = 12 * ACORN_FS_SECT_SIZE;
+            size *= 2;
+        }
+    }
+    else {
+        if (!title)
+            title = "$";
+        // Sectors 0 to 15 are the first track, even when interleaved.
+        acorn_fs_adfs_mapinit(data, sectors, ADFS_USED);
+        acorn_fs_adfs_dirinit(data + 2 * ACORN_FS_SECT_SIZE, "$", title, 2);
+        len = ADFS_USED * ACORN_FS_SECT_SIZE;
+        if (layout == AFS_LAYOUT_IDE)
+            size *= 2;
+    }
+
+    FILE *fp = fopen(fsname, "wb");
+    if (!fp) {
+        int status = errno;
+        fprintf(stderr, "afsmkfs: %s: %s\n", fsname, strerror(status));
+        return status;
+    }
+    int status = write_blank(fp, data, len, size, layout == AFS_LAYOUT_IDE);
+    if (fclose(fp) && status == AFS_OK)
+        status = errno;
+    if (status != AFS_OK)
+        fprintf(stderr, "afsmkfs: %s: %s\n", fsname, acorn_fs_strerr(status));
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    bool ide = false;
+    unsigned long sectors = 0;
+    const char *title = NULL;
+    while ((opt = getopt(argc, argv, "is:t:")) != -1) {
+        switch (opt) {
+            case 'i':
+                ide = true;
+                break;
+            case 's':
+                if (!parse_size(optarg, &sectors)) {
+                    fprintf(stderr, "afsmkfs: invalid size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                title = optarg;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 1) {
+        fputs("Usage: afsmkfs [ -i ] [ -s <sectors>|<bytes>K|M|G ] [ -t <title> ] <img-file>\n", stderr);
+        return 1;
+    }
+    return mkfs(argv[optind], sectors, ide, title) == AFS_OK ? 0 : 2;
+}
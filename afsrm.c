@@ -4,6 +4,11 @@
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "--stats")) {
+        acorn_fs_stats_at_close(stderr);
+        argc--;
+        argv++;
+    }
     if (--argc) {
         int status = 0;
         setlocale(LC_ALL, "");
@@ -34,7 +39,7 @@ int main(int argc, char *argv[])
         return status;
     }
     else {
-        fputs("Usage: afsrm <img-file:pattern> [...]\n", stderr);
+        fputs("Usage: afsrm [ --stats ] <img-file:pattern> [...]\n", stderr);
         return 1;
     }
 }
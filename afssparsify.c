@@ -0,0 +1,56 @@
+#include "acorn-fs.h"
+#include <inttypes.h>
+#include <unistd.h>
+
+/*
+ * Give the free space in images back to the host.  Files removed from
+ * an image leave their old contents behind in the free space, which
+ * backups and deduplicating storage then keep paying for.  Each image
+ * is checked first, as a free space map that is wrong would have live
+ * files punched out of it.
+ */
+
+static int sparsify(const char *fsname, bool dry_run)
+{
+    int status;
+    acorn_fs *fs = acorn_fs_open_err(fsname, !dry_run, &status);
+    if (!fs) {
+        fprintf(stderr, "afssparsify: %s: %s\n", fsname, acorn_fs_strerr(status));
+        return status;
+    }
+    if ((status = fs->check(fs, fsname, stderr)) != AFS_OK)
+        fprintf(stderr, "afssparsify: %s: not changed as the check failed\n", fsname);
+    else {
+        uint64_t bytes;
+        if ((status = acorn_fs_sparsify(fs, dry_run, &bytes)) == AFS_OK)
+            printf("%s: %" PRIu64 " bytes %s\n", fsname, bytes, dry_run ? "reclaimable" : "released");
+        else
+            fprintf(stderr, "afssparsify: %s: %s\n", fsname, acorn_fs_strerr(status));
+    }
+    acorn_fs_close(fs);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    bool dry_run = false;
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+            case 'n':
+                dry_run = true;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc <= optind) {
+        fputs("Usage: afssparsify [ -n ] <img-file> [ <img-file> ... ]\n", stderr);
+        return 1;
+    }
+    int status = 0;
+    for (argv += optind; *argv; argv++)
+        if (sparsify(*argv, dry_run) != AFS_OK)
+            status++;
+    return status;
+}
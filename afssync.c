@@ -0,0 +1,341 @@
+#include "acorn-fs.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+/*
+ * Bring a directory in an image into line with a directory tree on
+ * the host, copying only what has been added or changed and removing
+ * what has gone.  Files are considered unchanged if the length, load
+ * and exec addresses, attributes and contents all match.
+ */
+
+typedef struct {
+    acorn_fs        *fs;
+    const char      *fsname;
+    bool            dry_run;
+    bool            verbose;
+    unsigned        added;
+    unsigned        changed;
+    unsigned        removed;
+    unsigned        same;
+} sync_ctx;
+
+typedef struct {
+    acorn_fs_object *objs;
+    size_t          count;
+    size_t          size;
+} obj_list;
+
+static int collect(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char *path)
+{
+    obj_list *list = udata;
+    if (list->count == list->size) {
+        size_t size = list->size ? list->size * 2 : 32;
+        acorn_fs_object *objs = realloc(list->objs, size * sizeof(acorn_fs_object));
+        if (!objs)
+            return errno;
+        list->objs = objs;
+        list->size = size;
+    }
+    acorn_fs_object *ent = list->objs + list->count++;
+    *ent = *obj;
+    ent->data = NULL;
+    return AFS_OK;
+}
+
+/*
+ * A .inf file may give the whole Acorn path, as in "$.PROG", so only
+ * the last part is matched against and saved into the directory.
+ */
+
+static void leaf_name(char *name)
+{
+    char *dot = strrchr(name, '.');
+    if (dot)
+        memmove(name, dot + 1, strlen(dot));
+}
+
+static long list_find(obj_list *list, const char *name)
+{
+    for (size_t i = 0; i < list->count; i++)
+        if (!strcasecmp(list->objs[i].name, name))
+            return i;
+    return -1;
+}
+
+static void report(sync_ctx *ctx, int what, const char *path, acorn_fs_object *obj)
+{
+    if (ctx->verbose) {
+        printf("%c ", what);
+        acorn_fs_info(obj, stdout);
+        printf(" %s\n", path);
+    }
+}
+
+static int load_native(acorn_fs_object *obj, const char *filename)
+{
+    int status;
+    FILE *fp = fopen(filename, "rb");
+    obj->data = NULL;
+    if (fp) {
+        status = AFS_OK;
+        if (obj->length) {
+            if ((obj->data = malloc(obj->length))) {
+                if (fread(obj->data, obj->length, 1, fp) != 1) {
+                    status = ferror(fp) ? errno : AFS_BAD_EOF;
+                    acorn_fs_free_obj(obj);
+                }
+            }
+            else
+                status = errno;
+        }
+        fclose(fp);
+    }
+    else
+        status = errno;
+    return status;
+}
+
+static bool same_file(sync_ctx *ctx, acorn_fs_object *host, acorn_fs_object *img)
+{
+    if (host->length != img->length || host->load_addr != img->load_addr || host->exec_addr != img->exec_addr)
+        return false;
+    if (acorn_fs_default_attr(host->attr) != (img->attr & ~AFS_ATTR_DIR))
+        return false;
+    bool same = false;
+    if (ctx->fs->load(ctx->fs, img) == AFS_OK)
+        same = img->length == host->length && !memcmp(host->data, img->data, host->length);
+    acorn_fs_free_obj(img);
+    return same;
+}
+
+static int sync_dir(sync_ctx *ctx, acorn_fs_object *dir, const char *host_path, const char *img_path);
+
+static int sync_subdir(sync_ctx *ctx, acorn_fs_object *dir, acorn_fs_object *img, const char *host_path, const char *img_path, const char *name)
+{
+    int status;
+    acorn_fs_object child;
+    memset(&child, 0, sizeof(child));
+    acorn_fs_name_n2a(name, child.name);
+    if (img && (img->attr & AFS_ATTR_DIR))
+        child = *img;
+    else {
+        if (img) {
+            report(ctx, '-', img_path, img);
+            ctx->removed++;
+            if (!ctx->dry_run && (status = ctx->fs->remove(ctx->fs, dir, img->name)) != AFS_OK) {
+                fprintf(stderr, "afssync: %s:%s: %s\n", ctx->fsname, img_path, acorn_fs_strerr(status));
+                return status;
+            }
+        }
+        child.attr = AFS_ATTR_DIR;
+        report(ctx, '+', img_path, &child);
+        ctx->added++;
+        if (ctx->dry_run)
+            return AFS_OK;
+        if ((status = ctx->fs->mkdir(ctx->fs, &child, dir)) != AFS_OK) {
+            fprintf(stderr, "afssync: %s:%s: %s\n", ctx->fsname, img_path, acorn_fs_strerr(status));
+            return status;
+        }
+    }
+    return sync_dir(ctx, &child, host_path, img_path);
+}
+
+static int sync_file(sync_ctx *ctx, acorn_fs_object *dir, acorn_fs_object *img, const char *host_path, const char *img_path, struct stat *stb)
+{
+    int status = AFS_OK;
+    acorn_fs_object obj;
+    acorn_fs_parse_inf(&obj, host_path);
+    leaf_name(obj.name);
+    obj.length = stb->st_size;
+    obj.sector = img ? img->sector : 0;
+    if ((status = load_native(&obj, host_path)) != AFS_OK) {
+        fprintf(stderr, "afssync: %s: %s\n", host_path, strerror(status));
+        return status;
+    }
+    obj.attr = acorn_fs_default_attr(obj.attr);
+    if (img && !(img->attr & AFS_ATTR_DIR) && same_file(ctx, &obj, img)) {
+        ctx->same++;
+        acorn_fs_free_obj(&obj);
+        return AFS_OK;
+    }
+    if (img && (img->attr & AFS_ATTR_DIR)) {
+        report(ctx, '-', img_path, img);
+        ctx->removed++;
+        if (!ctx->dry_run && (status = ctx->fs->remove(ctx->fs, dir, img->name)) != AFS_OK) {
+            fprintf(stderr, "afssync: %s:%s: %s\n", ctx->fsname, img_path, acorn_fs_strerr(status));
+            acorn_fs_free_obj(&obj);
+            return status;
+        }
+        img = NULL;
+    }
+    if (img) {
+        report(ctx, 'M', img_path, &obj);
+        ctx->changed++;
+        strcpy(obj.name, img->name); // keep the case already in the image.
+    }
+    else {
+        report(ctx, '+', img_path, &obj);
+        ctx->added++;
+    }
+    if (!ctx->dry_run) {
+        acorn_fs_object dest = *dir;
+        if ((status = ctx->fs->save(ctx->fs, &obj, &dest, true)) != AFS_OK)
+            fprintf(stderr, "afssync: %s:%s: %s\n", ctx->fsname, img_path, acorn_fs_strerr(status));
+    }
+    acorn_fs_free_obj(&obj);
+    return status;
+}
+
+static int sync_dir(sync_ctx *ctx, acorn_fs_object *dir, const char *host_path, const char *img_path)
+{
+    int status;
+    obj_list list = { NULL, 0, 0 };
+    acorn_fs_object start = *dir;
+    if ((status = ctx->fs->glob(ctx->fs, &start, "*", collect, &list)) != AFS_OK) {
+        fprintf(stderr, "afssync: %s:%s: %s\n", ctx->fsname, img_path, acorn_fs_strerr(status));
+        free(list.objs);
+        return status;
+    }
+    size_t hlen = strlen(host_path);
+    size_t ilen = strlen(img_path);
+    bool *seen = calloc(list.count + 1, sizeof(bool));
+    char *hpath = malloc(hlen + NAME_MAX + 2);
+    char *ipath = malloc(ilen + ACORN_FS_MAX_NAME + 2);
+    DIR *dp = opendir(host_path);
+    if (!seen || !hpath || !ipath || !dp) {
+        status = errno;
+        fprintf(stderr, "afssync: %s: %s\n", host_path, strerror(status));
+        if (dp)
+            closedir(dp);
+        free(ipath);
+        free(hpath);
+        free(seen);
+        free(list.objs);
+        return status;
+    }
+    memcpy(ipath, img_path, ilen);
+    ipath[ilen] = '.';
+    struct dirent *de;
+    while ((de = readdir(dp))) {
+        if (de->d_name[0] == '.' || acorn_fs_is_inf(de->d_name))
+            continue;
+        memcpy(hpath, host_path, hlen);
+        hpath[hlen] = '/';
+        strcpy(hpath + hlen + 1, de->d_name);
+        struct stat stb;
+        if (stat(hpath, &stb)) {
+            status = errno;
+            fprintf(stderr, "afssync: %s: %s\n", hpath, strerror(status));
+            continue;
+        }
+        acorn_fs_object obj;
+        if (S_ISDIR(stb.st_mode))
+            acorn_fs_name_n2a(de->d_name, obj.name);
+        else {
+            acorn_fs_parse_inf(&obj, hpath);
+            leaf_name(obj.name);
+        }
+        strcpy(ipath + ilen + 1, obj.name);
+        acorn_fs_object *img = NULL;
+        long ix = list_find(&list, obj.name);
+        if (ix >= 0) {
+            img = list.objs + ix;
+            seen[ix] = true;
+        }
+        int astat;
+        if (S_ISDIR(stb.st_mode))
+            astat = sync_subdir(ctx, dir, img, hpath, ipath, de->d_name);
+        else
+            astat = sync_file(ctx, dir, img, hpath, ipath, &stb);
+        if (astat != AFS_OK)
+            status = astat;
+    }
+    closedir(dp);
+    for (size_t i = 0; i < list.count; i++) {
+        if (!seen[i]) {
+            acorn_fs_object *img = list.objs + i;
+            strcpy(ipath + ilen + 1, img->name);
+            report(ctx, '-', ipath, img);
+            ctx->removed++;
+            if (!ctx->dry_run) {
+                acorn_fs_object start = *dir;
+                int astat = ctx->fs->remove(ctx->fs, &start, img->name);
+                if (astat != AFS_OK) {
+                    fprintf(stderr, "afssync: %s:%s: %s\n", ctx->fsname, ipath, acorn_fs_strerr(astat));
+                    status = astat;
+                }
+            }
+        }
+    }
+    free(ipath);
+    free(hpath);
+    free(seen);
+    free(list.objs);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int status, opt;
+    sync_ctx ctx;
+    ctx.dry_run = false;
+    ctx.verbose = false;
+    ctx.added = ctx.changed = ctx.removed = ctx.same = 0;
+    while ((opt = getopt(argc, argv, "nv")) != -1) {
+        switch (opt) {
+            case 'n':
+                ctx.dry_run = true;
+                ctx.verbose = true;
+                break;
+            case 'v':
+                ctx.verbose = true;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind == 2) {
+        const char *host = argv[optind];
+        char *fsname = argv[optind+1];
+        char *dest = strchr(fsname, ':');
+        if (dest)
+            *dest++ = 0;
+        if (!dest || !*dest)
+            dest = "$";
+        ctx.fsname = fsname;
+        if ((ctx.fs = acorn_fs_open(fsname, !ctx.dry_run))) {
+            acorn_fs_object dobj;
+            ctx.fs->deferred = true; // commit directories and map once.
+            status = ctx.fs->find(ctx.fs, dest, &dobj);
+            if (status == AFS_OK && dobj.attr & AFS_ATTR_DIR) {
+                status = sync_dir(&ctx, &dobj, host, dest) == AFS_OK ? 0 : 2;
+                int sstat = acorn_fs_sync(ctx.fs);
+                if (sstat != AFS_OK) {
+                    fprintf(stderr, "afssync: %s: %s\n", fsname, acorn_fs_strerr(sstat));
+                    status = 3;
+                }
+                fprintf(stderr, "afssync: %u added, %u changed, %u removed, %u unchanged\n", ctx.added, ctx.changed, ctx.removed, ctx.same);
+            }
+            else {
+                fprintf(stderr, "afssync: %s:%s: %s\n", fsname, dest, status == AFS_OK ? strerror(ENOTDIR) : acorn_fs_strerr(status));
+                status = 2;
+            }
+            acorn_fs_close_all();
+        }
+        else {
+            fprintf(stderr, "afssync: %s: %s\n", fsname, acorn_fs_strerr(errno));
+            status = 2;
+        }
+    }
+    else {
+        fputs("Usage: afssync [ -n ] [ -v ] <host-dir> <img-file>[:<dir>]\n", stderr);
+        status = 1;
+    }
+    return status;
+}
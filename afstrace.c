@@ -0,0 +1,566 @@
+#include "acorn-fs.h"
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Summarise a sector access trace recorded by setting ACORN_FS_TRACE:
+ * the traffic for each image and each calling driver function, how
+ * sequential it was, the most used sectors and the read hit rate an
+ * LRU sector cache of various sizes would have had.  Given an image,
+ * the reads are also replayed against it and timed.
+ */
+
+#define DEFAULT_TOP 10
+
+static const unsigned default_caches[] = { 16, 64, 256, 1024, 4096, 0 };
+
+typedef struct {
+    uint8_t  type;
+    uint16_t image;
+    uint16_t caller;
+    uint32_t sector;
+    uint32_t length;
+    uint64_t time;
+} xfer;
+
+typedef struct {
+    char          **names;
+    unsigned      count;
+} name_table;
+
+typedef struct {
+    xfer          *list;
+    size_t        count;
+    name_table    images;
+    name_table    callers;
+} trace;
+
+typedef struct {
+    unsigned long      reads;
+    unsigned long      writes;
+    unsigned long long sects_read;
+    unsigned long long sects_written;
+} totals;
+
+static unsigned sectors(unsigned bytes)
+{
+    return (bytes + ACORN_FS_SECT_SIZE - 1) / ACORN_FS_SECT_SIZE;
+}
+
+static uint64_t get_le(const unsigned char *ptr, int bytes)
+{
+    uint64_t value = 0;
+    while (bytes--)
+        value = (value << 8) | ptr[bytes];
+    return value;
+}
+
+static int add_name(name_table *tab, unsigned id, FILE *fp, unsigned len)
+{
+    if (id >= tab->count) {
+        char **names = realloc(tab->names, (id + 1) * sizeof(char *));
+        if (!names)
+            return errno;
+        memset(names + tab->count, 0, (id + 1 - tab->count) * sizeof(char *));
+        tab->names = names;
+        tab->count = id + 1;
+    }
+    char *name = malloc(len + 1);
+    if (!name)
+        return errno;
+    if (len && fread(name, len, 1, fp) != 1) {
+        free(name);
+        return ferror(fp) ? errno : AFS_BAD_EOF;
+    }
+    name[len] = 0;
+    free(tab->names[id]);
+    tab->names[id] = name;
+    return AFS_OK;
+}
+
+static const char *get_name(const name_table *tab, unsigned id)
+{
+    if (id < tab->count && tab->names[id])
+        return tab->names[id];
+    return "?";
+}
+
+static int load_trace(const char *fn, trace *tr)
+{
+    FILE *fp = fopen(fn, "rb");
+    if (!fp)
+        return errno;
+    int status = AFS_OK;
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, fp) != 1)
+        status = ferror(fp) ? errno : AFS_CORRUPT;
+    else if (memcmp(magic, ACORN_FS_TRACE_MAGIC, sizeof(magic)))
+        status = AFS_CORRUPT;
+    size_t max = 0;
+    unsigned char hdr[ACORN_FS_TRACE_HDR];
+    while (status == AFS_OK && fread(hdr, sizeof(hdr), 1, fp) == 1) {
+        unsigned image = get_le(hdr + 2, 2);
+        unsigned caller = get_le(hdr + 4, 2);
+        unsigned length = get_le(hdr + 12, 4);
+        switch (hdr[0]) {
+            case 'O':
+                status = add_name(&tr->images, image, fp, length);
+                break;
+            case 'N':
+                status = add_name(&tr->callers, caller, fp, length);
+                break;
+            case 'R':
+            case 'W':
+                if (tr->count == max) {
+                    size_t new_max = max ? max * 2 : 4096;
+                    xfer *list = realloc(tr->list, new_max * sizeof(xfer));
+                    if (!list) {
+                        status = errno;
+                        break;
+                    }
+                    tr->list = list;
+                    max = new_max;
+                }
+                xfer *acc = tr->list + tr->count++;
+                acc->type = hdr[0];
+                acc->image = image;
+                acc->caller = caller;
+                acc->sector = get_le(hdr + 8, 4);
+                acc->length = length;
+                acc->time = get_le(hdr + 16, 8);
+                break;
+            default:
+                status = AFS_CORRUPT;
+        }
+    }
+    // A trace cut short by a crash loses at most a partial record.
+    if (status == AFS_OK && ferror(fp))
+        status = errno;
+    fclose(fp);
+    return status;
+}
+
+static void add_total(totals *tot, const xfer *acc)
+{
+    if (acc->type == 'R') {
+        tot->reads++;
+        tot->sects_read += sectors(acc->length);
+    }
+    else {
+        tot->writes++;
+        tot->sects_written += sectors(acc->length);
+    }
+}
+
+static void print_total(const char *label, const totals *tot)
+{
+    printf("  %-24s %'9lu reads %'11llu sectors %'9lu writes %'11llu sectors\n",
+           label, tot->reads, tot->sects_read, tot->writes, tot->sects_written);
+}
+
+static void by_table(const trace *tr, int image_filter, const name_table *tab, bool by_image)
+{
+    totals *tots = calloc(tab->count + 1, sizeof(totals));
+    if (!tots)
+        return;
+    for (size_t i = 0; i < tr->count; i++) {
+        const xfer *acc = tr->list + i;
+        if (image_filter && acc->image != image_filter)
+            continue;
+        unsigned id = by_image ? acc->image : acc->caller;
+        add_total(tots + (id < tab->count ? id : tab->count), acc);
+    }
+    for (unsigned id = 0; id <= tab->count; id++) {
+        if (tots[id].reads || tots[id].writes) {
+            char label[ACORN_FS_MAX_PATH+8];
+            if (by_image)
+                snprintf(label, sizeof(label), "%u %s", id, get_name(tab, id));
+            else
+                snprintf(label, sizeof(label), "%s", id ? get_name(tab, id) : "(other)");
+            print_total(label, tots + id);
+        }
+    }
+    free(tots);
+}
+
+/*
+ * A transfer is sequential when it starts at the sector after the
+ * end of the previous transfer on the same image.
+ */
+
+static void sequentiality(const trace *tr, int image_filter)
+{
+    unsigned nimages = tr->images.count + 1;
+    uint32_t *next = calloc(nimages, sizeof(uint32_t));
+    bool *seen = calloc(nimages, sizeof(bool));
+    if (!next || !seen) {
+        free(next);
+        free(seen);
+        return;
+    }
+    unsigned long xfers = 0, seq = 0, seeks = 0, runs = 0;
+    unsigned long long dist = 0;
+    for (size_t i = 0; i < tr->count; i++) {
+        const xfer *acc = tr->list + i;
+        if (image_filter && acc->image != image_filter)
+            continue;
+        unsigned id = acc->image < nimages ? acc->image : 0;
+        xfers++;
+        if (seen[id] && acc->sector == next[id])
+            seq++;
+        else {
+            runs++;
+            if (seen[id]) {
+                seeks++;
+                dist += acc->sector > next[id] ? acc->sector - next[id] : next[id] - acc->sector;
+            }
+        }
+        seen[id] = true;
+        next[id] = acc->sector + sectors(acc->length);
+    }
+    printf("Sequentiality:\n");
+    printf("  %.1f%% of %'lu transfers follow on, %'lu runs of %.1f transfers, mean seek %.1f sectors\n",
+           xfers ? seq * 100.0 / xfers : 0.0, xfers, runs, runs ? (double)xfers / runs : 0.0,
+           seeks ? (double)dist / seeks : 0.0);
+    free(next);
+    free(seen);
+}
+
+typedef struct {
+    uint64_t key;
+    unsigned reads;
+    unsigned writes;
+} sect_count;
+
+static int cmp_key(const void *a, const void *b)
+{
+    uint64_t ka = ((const sect_count *)a)->key;
+    uint64_t kb = ((const sect_count *)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static int cmp_hot(const void *a, const void *b)
+{
+    const sect_count *sa = a, *sb = b;
+    unsigned ta = sa->reads + sa->writes;
+    unsigned tb = sb->reads + sb->writes;
+    if (ta != tb)
+        return ta < tb ? 1 : -1;
+    return cmp_key(a, b);
+}
+
+static void hot_sectors(const trace *tr, int image_filter, unsigned top)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < tr->count; i++)
+        if (!image_filter || tr->list[i].image == image_filter)
+            total += sectors(tr->list[i].length);
+    sect_count *counts = malloc((total ? total : 1) * sizeof(sect_count));
+    if (!counts)
+        return;
+    size_t n = 0;
+    for (size_t i = 0; i < tr->count; i++) {
+        const xfer *acc = tr->list + i;
+        if (image_filter && acc->image != image_filter)
+            continue;
+        for (unsigned s = 0; s < sectors(acc->length); s++) {
+            counts[n].key = ((uint64_t)acc->image << 32) | (acc->sector + s);
+            counts[n].reads = acc->type == 'R';
+            counts[n].writes = acc->type == 'W';
+            n++;
+        }
+    }
+    qsort(counts, n, sizeof(sect_count), cmp_key);
+    size_t uniq = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (uniq && counts[uniq-1].key == counts[i].key) {
+            counts[uniq-1].reads += counts[i].reads;
+            counts[uniq-1].writes += counts[i].writes;
+        }
+        else
+            counts[uniq++] = counts[i];
+    }
+    qsort(counts, uniq, sizeof(sect_count), cmp_hot);
+    printf("Hot sectors (%'zu distinct sectors, %'zu accesses):\n", uniq, n);
+    printf("  %5s %8s %8s %8s\n", "image", "sector", "reads", "writes");
+    for (size_t i = 0; i < uniq && i < top; i++)
+        printf("  %5u %8u %8u %8u\n", (unsigned)(counts[i].key >> 32), (unsigned)counts[i].key, counts[i].reads, counts[i].writes);
+    free(counts);
+}
+
+/*
+ * An LRU cache of whole sectors.  Reads are hits or misses and both
+ * reads and writes leave the sector at the head of the list.
+ */
+
+typedef struct {
+    uint64_t key;
+    unsigned prev;
+    unsigned next;
+    unsigned chain;
+} lru_node;
+
+typedef struct {
+    lru_node *nodes;    // 1 to size, 0 is the end of a list.
+    unsigned *buckets;
+    unsigned mask;
+    unsigned size;
+    unsigned used;
+    unsigned head;
+    unsigned tail;
+} lru;
+
+static unsigned lru_hash(const lru *cache, uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 32 & cache->mask;
+}
+
+static void lru_unlink(lru *cache, unsigned n)
+{
+    lru_node *node = cache->nodes + n;
+    if (node->prev)
+        cache->nodes[node->prev].next = node->next;
+    else
+        cache->head = node->next;
+    if (node->next)
+        cache->nodes[node->next].prev = node->prev;
+    else
+        cache->tail = node->prev;
+}
+
+static void lru_push(lru *cache, unsigned n)
+{
+    lru_node *node = cache->nodes + n;
+    node->prev = 0;
+    node->next = cache->head;
+    if (cache->head)
+        cache->nodes[cache->head].prev = n;
+    else
+        cache->tail = n;
+    cache->head = n;
+}
+
+static bool lru_access(lru *cache, uint64_t key)
+{
+    unsigned *bucket = cache->buckets + lru_hash(cache, key);
+    for (unsigned n = *bucket; n; n = cache->nodes[n].chain) {
+        if (cache->nodes[n].key == key) {
+            lru_unlink(cache, n);
+            lru_push(cache, n);
+            return true;
+        }
+    }
+    unsigned n;
+    if (cache->used < cache->size)
+        n = ++cache->used;
+    else {
+        n = cache->tail;
+        lru_unlink(cache, n);
+        unsigned *link = cache->buckets + lru_hash(cache, cache->nodes[n].key);
+        while (*link != n)
+            link = &cache->nodes[*link].chain;
+        *link = cache->nodes[n].chain;
+    }
+    cache->nodes[n].key = key;
+    cache->nodes[n].chain = *bucket;
+    *bucket = n;
+    lru_push(cache, n);
+    return false;
+}
+
+static void simulate(const trace *tr, int image_filter, const unsigned *sizes)
+{
+    printf("LRU sector cache:\n");
+    printf("  %8s %12s %12s %8s\n", "sectors", "reads", "hits", "hit rate");
+    for (; *sizes; sizes++) {
+        lru cache;
+        unsigned nbuckets = 1;
+        while (nbuckets < *sizes * 2)
+            nbuckets <<= 1;
+        cache.nodes = malloc((*sizes + 1) * sizeof(lru_node));
+        cache.buckets = calloc(nbuckets, sizeof(unsigned));
+        if (!cache.nodes || !cache.buckets) {
+            free(cache.nodes);
+            free(cache.buckets);
+            return;
+        }
+        cache.mask = nbuckets - 1;
+        cache.size = *sizes;
+        cache.used = cache.head = cache.tail = 0;
+        unsigned long long reads = 0, hits = 0;
+        for (size_t i = 0; i < tr->count; i++) {
+            const xfer *acc = tr->list + i;
+            if (image_filter && acc->image != image_filter)
+                continue;
+            for (unsigned s = 0; s < sectors(acc->length); s++) {
+                bool hit = lru_access(&cache, ((uint64_t)acc->image << 32) | (acc->sector + s));
+                if (acc->type == 'R') {
+                    reads++;
+                    hits += hit;
+                }
+            }
+        }
+        printf("  %8u %'12llu %'12llu %7.1f%%\n", *sizes, reads, hits, reads ? hits * 100.0 / reads : 0.0);
+        free(cache.nodes);
+        free(cache.buckets);
+    }
+}
+
+static const char *leaf(const char *path)
+{
+    const char *sep = strrchr(path, '/');
+    return sep ? sep + 1 : path;
+}
+
+/*
+ * Reads from other images mean nothing against this one, so without
+ * -i a trace of more than one image is replayed for the image that
+ * was opened under the same name or, failing that, with the same
+ * final component, if there is just one.
+ */
+
+static int replay_image(const trace *tr, const char *fn)
+{
+    unsigned images = 0, found = 0, matches = 0;
+    for (unsigned id = 1; id < tr->images.count; id++) {
+        const char *name = tr->images.names[id];
+        if (!name)
+            continue;
+        images++;
+        if (!strcmp(name, fn))
+            return id;
+        if (!strcmp(leaf(name), leaf(fn))) {
+            found = id;
+            matches++;
+        }
+    }
+    if (images <= 1)
+        return 0;
+    if (matches == 1)
+        return found;
+    fprintf(stderr, "afstrace: %s: the trace has %u images, choose one with -i\n", fn, images);
+    return -1;
+}
+
+static int replay(const trace *tr, int image_filter, const char *fn)
+{
+    if (!image_filter && (image_filter = replay_image(tr, fn)) < 0)
+        return EINVAL;
+    acorn_fs *fs = acorn_fs_open(fn, false);
+    if (!fs) {
+        fprintf(stderr, "afstrace: %s: %s\n", fn, acorn_fs_strerr(errno));
+        return errno;
+    }
+    unsigned max = 0;
+    for (size_t i = 0; i < tr->count; i++)
+        if (tr->list[i].length > max)
+            max = tr->list[i].length;
+    unsigned char *buf = malloc(max ? max : 1);
+    if (!buf) {
+        int status = errno;
+        fprintf(stderr, "afstrace: %s: %s\n", fn, strerror(status));
+        acorn_fs_close(fs);
+        return status;
+    }
+    unsigned long reads = 0, failed = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < tr->count; i++) {
+        const xfer *acc = tr->list + i;
+        if (acc->type != 'R' || (image_filter && acc->image != image_filter))
+            continue;
+        reads++;
+        if (fs->rdsect(fs, acc->sector, buf, acc->length) != AFS_OK)
+            failed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Replay against %s:\n", fn);
+    printf("  %'lu reads in %.3fms, %'lu failed\n", reads, secs * 1e3, failed);
+    acorn_fs_print_stats(fs, stdout);
+    free(buf);
+    acorn_fs_close(fs);
+    return failed ? AFS_BAD_EOF : AFS_OK;
+}
+
+static unsigned *parse_sizes(char *arg)
+{
+    unsigned n = 1;
+    for (char *ptr = arg; *ptr; ptr++)
+        if (*ptr == ',')
+            n++;
+    unsigned *sizes = calloc(n + 1, sizeof(unsigned));
+    if (sizes) {
+        n = 0;
+        for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+            if ((sizes[n] = strtoul(tok, NULL, 0)))
+                n++;
+    }
+    return sizes;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, image_filter = 0;
+    unsigned top = DEFAULT_TOP;
+    const unsigned *sizes = default_caches;
+    setlocale(LC_ALL, "");
+    while ((opt = getopt(argc, argv, "c:n:i:")) != -1) {
+        switch (opt) {
+            case 'c':
+                if (!(sizes = parse_sizes(optarg))) {
+                    fprintf(stderr, "afstrace: %s\n", strerror(errno));
+                    return 2;
+                }
+                break;
+            case 'n':
+                top = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                image_filter = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        fputs("Usage: afstrace [ -c <sectors>[,<sectors>...] ] [ -n <top> ] [ -i <image> ] <trace-file> [ <img-file> ]\n", stderr);
+        return 1;
+    }
+    const char *fn = argv[optind];
+    trace tr;
+    memset(&tr, 0, sizeof(tr));
+    int status = load_trace(fn, &tr);
+    if (status != AFS_OK) {
+        fprintf(stderr, "afstrace: %s: %s\n", fn, status == AFS_CORRUPT ? "not a sector access trace" : acorn_fs_strerr(status));
+        return 2;
+    }
+
+    totals all;
+    memset(&all, 0, sizeof(all));
+    uint64_t first = 0, last = 0;
+    for (size_t i = 0; i < tr.count; i++) {
+        const xfer *acc = tr.list + i;
+        if (image_filter && acc->image != image_filter)
+            continue;
+        if (!all.reads && !all.writes)
+            first = acc->time;
+        last = acc->time;
+        add_total(&all, acc);
+    }
+    printf("Trace %s over %.3fms:\n", fn, (last - first) / 1e6);
+    print_total("total", &all);
+    printf("Images:\n");
+    by_table(&tr, image_filter, &tr.images, true);
+    printf("Callers:\n");
+    by_table(&tr, image_filter, &tr.callers, false);
+    sequentiality(&tr, image_filter);
+    hot_sectors(&tr, image_filter, top);
+    simulate(&tr, image_filter, sizes);
+    if (argc - optind == 2 && replay(&tr, image_filter, argv[optind+1]) != AFS_OK)
+        status = 3;
+    return status;
+}
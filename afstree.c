@@ -11,6 +11,11 @@ static int callback(acorn_fs *fs, acorn_fs_object *obj, void *udata, const char
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && !strcmp(argv[1], "--stats")) {
+        acorn_fs_stats_at_close(stderr);
+        argc--;
+        argv++;
+    }
     if (--argc) {
         int status = 0;
         setlocale(LC_ALL, "");
@@ -43,7 +48,7 @@ int main(int argc, char *argv[])
         return status;
     }
     else {
-        fputs("Usage: afstree <img-file[:start]> [...]\n", stderr);
+        fputs("Usage: afstree [ --stats ] <img-file[:start]> [...]\n", stderr);
         return 1;
     }
 }
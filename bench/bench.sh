@@ -0,0 +1,175 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the command line tools over a generated
+# corpus of images.  Each operation is run several times and the best
+# time kept.  Results are written as JSON, one result per line, and
+# compared with a saved baseline.  The first run saves the baseline.
+#
+# Usage: bench/bench.sh [ -b ] [ -n <runs> ] [ -c <corpus-dir> ] [ -o <json-file> ]
+#
+#   -b  save the results as the baseline for later runs.
+#
+# Sector reads are the totals reported by --stats for the images each
+# command opens.  With ACORN_FS_SIMDEV set in the environment the
+# simulated device time is recorded as sim_seconds.  A command that
+# fails is reported and marked "failed" in the results, the script
+# exits with status 1 and the baseline is not saved.
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+bench="$top/bench"
+corpus="${TMPDIR:-/tmp}/afs-corpus"
+results="$bench/results.json"
+baseline="$bench/baseline.json"
+runs=3
+save_baseline=false
+
+while getopts "bn:c:o:" opt; do
+    case $opt in
+        b) save_baseline=true ;;
+        n) runs=$OPTARG ;;
+        c) corpus=$OPTARG ;;
+        o) results=$OPTARG ;;
+        *) echo "Usage: bench.sh [ -b ] [ -n <runs> ] [ -c <corpus-dir> ] [ -o <json-file> ]" >&2; exit 1 ;;
+    esac
+done
+
+export LC_ALL=C
+
+# name, then mkcorpus options.
+images="
+dfs.ssd     -n 28   -s 256:4096
+dfs.dsd     -n 28   -s 256:4096 -r 7
+small.adf   -n 100  -d 2 -b 3 -s 256:3072  -f 20
+floppy.adl  -n 120  -d 2 -b 4 -s 256:6144  -f 20
+disc.ide    -n 1500 -d 3 -b 4 -s 256:16384 -f 3 -k 81920
+"
+
+rm -rf "$corpus"
+mkdir -p "$corpus"
+
+while read -r name opts; do
+    [ -n "$name" ] || continue
+    "$bench/mkcorpus" $opts "$corpus/$name" >/dev/null
+    "$bench/mkcorpus" $opts -n 0 -d 0 "$corpus/blank-$name" >/dev/null
+done <<EOF
+$images
+EOF
+
+now() {
+    date +%s.%N
+}
+
+# run <image> <op> <files> <bytes> <setup> <command...>
+#
+# setup is run, untimed, before each run of the command.
+run() {
+    image=$1 op=$2 files=$3 bytes=$4 setup=$5
+    shift 5
+    best=
+    status=0
+    reads=0
+    sim=0
+    i=0
+    while [ $i -lt "$runs" ]; do
+        eval "$setup"
+        t0=$(now)
+        rc=0
+        "$@" >/dev/null 2>"$stats" || rc=$?
+        t1=$(now)
+        if [ $rc -ne 0 ]; then
+            echo "bench: $image $op: exit status $rc" >&2
+            sed 's/^/  /' "$stats" >&2
+            failed=true
+            status=$rc
+            break
+        fi
+        secs=$(awk "BEGIN { printf \"%.6f\", $t1 - $t0 }")
+        if [ -z "$best" ] || awk "BEGIN { exit !($secs < $best) }"; then
+            best=$secs
+            reads=$(awk '/ sectors read in / { n += $2 } END { print n + 0 }' "$stats")
+            sim=$(awk '/ simulated device time$/ { n += $2 / 1000 } END { printf "%.6f", n }' "$stats")
+        fi
+        i=$((i + 1))
+    done
+    if [ $status -ne 0 ]; then
+        echo "{\"image\":\"$image\",\"op\":\"$op\",\"failed\":true,\"status\":$status}" >> "$results.tmp"
+        return
+    fi
+    awk -v image="$image" -v op="$op" -v files="$files" -v bytes="$bytes" -v secs="$best" -v reads="$reads" -v sim="$sim" 'BEGIN {
+        fps = secs > 0 ? files / secs : 0
+        mbs = secs > 0 ? bytes / secs / 1e6 : 0
+        printf "%-12s %-8s %7d files %10d bytes %9.4fs %12.1f files/s %8.2f MB/s %9d sectors\n", image, op, files, bytes, secs, fps, mbs, reads > "/dev/stderr"
+        printf "{\"image\":\"%s\",\"op\":\"%s\",\"files\":%d,\"bytes\":%d,\"seconds\":%.6f,\"files_per_sec\":%.1f,\"mb_per_sec\":%.3f,\"sector_reads\":%d,\"sim_seconds\":%.6f}\n", image, op, files, bytes, secs, fps, mbs, reads, sim
+    }' >> "$results.tmp"
+}
+
+: > "$results.tmp"
+failed=false
+work="$corpus/work"
+stats="$corpus/stats"
+
+while read -r name opts; do
+    [ -n "$name" ] || continue
+    img="$corpus/$name"
+    # The copy keeps the name so it is opened with the same layout.
+    copy="$corpus/work-$name"
+    nroot=$("$top/afsls" "$img" | wc -l)
+    nrootf=$("$top/afsls" "$img" | awk '$1 !~ /^D/ { n++ } END { print n + 0 }')
+    nall=$("$top/afstree" "$img" | wc -l)
+    nfiles=$("$top/afstree" "$img" | awk '$1 !~ /^D/ { n++ } END { print n + 0 }')
+    nbytes=$("$top/afstree" "$img" | awk '$1 !~ /^D/ { n += $4 } END { print n + 0 }')
+
+    run "$name" ls      "$nroot"  0 : "$top/afsls" --stats "$img"
+    run "$name" tree    "$nall"   0 : "$top/afstree" --stats "$img"
+    run "$name" chk     "$nall"   0 : "$top/afschk" --stats "$img"
+    run "$name" extract "$nfiles" "$nbytes" 'rm -rf "$work"; mkdir -p "$work"' \
+        "$top/afscp" --stats -r "$img:*" "$work"
+    # The .inf files written by the extract go in with the files they
+    # describe, not as files of their own.
+    run "$name" import  "$nfiles" "$nbytes" 'cp "$corpus/blank-$name" "$copy"' \
+        sh -c 'cp=$1 src=$2 dst=$3; shift 3
+               for f in "$src"/*; do case $f in *.inf) ;; *) set -- "$@" "$f" ;; esac; done
+               "$cp" --stats -r "$@" "$dst:"' sh "$top/afscp" "$work" "$copy"
+    # Removing whole trees from the hard disc image would run out of
+    # free space map entries, as it would on ADFS itself, so only the
+    # files in the root are removed.
+    run "$name" rm      "$nrootf" 0 'cp "$img" "$copy"' "$top/afsrm" --stats "$copy:F*"
+    rm -rf "$work" "$copy" "$stats"
+done <<EOF
+$images
+EOF
+
+{
+    echo "{\"commit\":\"$(git -C "$top" rev-parse --short HEAD 2>/dev/null || echo unknown)\",\"date\":\"$(date -u +%Y-%m-%dT%H:%M:%SZ)\",\"runs\":$runs,\"results\":["
+    sed '$!s/$/,/' "$results.tmp"
+    echo "]}"
+} > "$results"
+rm -f "$results.tmp"
+
+if $failed; then
+    echo "bench: some commands failed, results in $results, baseline not saved" >&2
+    exit 1
+fi
+
+[ -f "$baseline" ] || save_baseline=true
+
+if ! $save_baseline; then
+    echo "Compared with $baseline (time, lower is better):" >&2
+    awk -F'"' '
+        function secs(line) { sub(/.*"seconds":/, "", line); sub(/,.*/, "", line); return line + 0 }
+        FNR == 1 { file++ }
+        /"image":/ {
+            key = $4 " " $8
+            if (file == 1)
+                base[key] = secs($0)
+            else if (key in base && base[key] > 0)
+                printf "%-21s %9.4fs -> %9.4fs  %+6.1f%%\n", key, base[key], secs($0), (secs($0) - base[key]) / base[key] * 100
+        }' "$baseline" "$results" >&2
+fi
+
+if $save_baseline; then
+    cp "$results" "$baseline"
+    echo "Saved baseline $baseline" >&2
+fi
@@ -0,0 +1,296 @@
+#include "acorn-adfs.c"
+#include "micro.h"
+#include <unistd.h>
+
+/*
+ * ADFS kernels: name matching, directory entry decoding, the free
+ * space map checksum, allocation and release in the free space map
+ * and the extent list built by the consistency check.
+ */
+
+static const char wild_name[] = "ABCDEFGHIJ";
+
+static const char *wild_pats[] = { "*", "abcdefghij", "*Z", "#*#" };
+
+#define NPATS (sizeof(wild_pats) / sizeof(wild_pats[0]))
+
+typedef struct {
+    unsigned char ent[ADFS_MAX_NAME];
+    char pats[NPATS][ADFS_MAX_NAME+1];
+} wild_ctx;
+
+static const unsigned wild_sizes[] = { 1, 4, 10, 0 };
+
+static void *wild_setup(unsigned size)
+{
+    wild_ctx *ctx = malloc(sizeof(wild_ctx));
+    if (ctx) {
+        memset(ctx->ent, 0x0d, sizeof(ctx->ent));
+        memcpy(ctx->ent, wild_name, size);
+        for (unsigned p = 0; p < NPATS; p++) {
+            strcpy(ctx->pats[p], wild_pats[p]);
+            if (p == 1)
+                ctx->pats[p][size] = 0; // exact match at this length.
+        }
+    }
+    return ctx;
+}
+
+static unsigned long wild_run(void *vctx, unsigned long iters)
+{
+    wild_ctx *ctx = vctx;
+    for (unsigned long i = 0; i < iters; i++)
+        for (unsigned p = 0; p < NPATS; p++)
+            micro_sink += adfs_wildmat(ctx->pats[p], ctx->ent, ADFS_MAX_NAME, false);
+    return iters * NPATS;
+}
+
+static const unsigned dir_sizes[] = { 1, 16, 47, 0 };
+
+static void *ent_setup(unsigned size)
+{
+    unsigned char *data = malloc(ACORN_FS_ADFS_DIR_SIZE);
+    if (data) {
+        acorn_fs_adfs_dirinit(data, "$", "Micro", 2);
+        for (unsigned i = 0; i < size; i++) {
+            acorn_fs_object obj;
+            snprintf(obj.name, sizeof(obj.name), "File%04u", i % 10000);
+            obj.load_addr = 0xffff1900;
+            obj.exec_addr = 0xffff8023;
+            obj.length = i * 100;
+            obj.attr = AFS_ATTR_UREAD | AFS_ATTR_UWRITE;
+            obj.sector = 7 + i;
+            acorn_fs_adfs_obj2ent(&obj, data + DIR_HDR_SIZE + i * DIR_ENT_SIZE);
+        }
+    }
+    return data;
+}
+
+static unsigned long ent_run(void *vctx, unsigned long iters)
+{
+    unsigned char *data = vctx;
+    unsigned char *ftr = data + ACORN_FS_ADFS_DIR_SIZE - DIR_FTR_SIZE;
+    unsigned long ops = 0;
+    for (unsigned long i = 0; i < iters; i++) {
+        for (unsigned char *ent = data + DIR_HDR_SIZE; ent < ftr && *ent; ent += DIR_ENT_SIZE) {
+            acorn_fs_object obj;
+            micro_sink += ent2obj(ent, &obj) + obj.sector;
+            ops++;
+        }
+    }
+    return ops;
+}
+
+static const unsigned map_sizes[] = { 256, 0 };
+
+static void *sum_setup(unsigned size)
+{
+    unsigned char *fsmap = malloc(FSMAP_SIZE);
+    if (fsmap)
+        acorn_fs_adfs_mapinit(fsmap, 1280, 7);
+    return fsmap;
+}
+
+static unsigned long sum_run(void *vctx, unsigned long iters)
+{
+    unsigned char *fsmap = vctx;
+    for (unsigned long i = 0; i < iters; i++)
+        micro_sink += checksum(fsmap + (i & 1) * 0x100);
+    return iters;
+}
+
+/*
+ * The free space map has size - 1 single sector holes followed by
+ * one large extent, so allocating two sectors scans the whole map
+ * and releasing them again, just before the large extent, joins them
+ * to it.  The map is restored from a copy before each operation.
+ */
+
+typedef struct {
+    acorn_fs fs;
+    adfs_priv priv;
+    unsigned char map[FSMAP_SIZE];
+    unsigned char data[2 * ACORN_FS_SECT_SIZE];
+    unsigned hole;
+} map_ctx;
+
+static const unsigned extent_sizes[] = { 1, 16, 80, 0 };
+
+static int wrsect_null(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size)
+{
+    return AFS_OK;
+}
+
+static void *map_setup(unsigned size)
+{
+    map_ctx *ctx = calloc(1, sizeof(map_ctx));
+    if (ctx) {
+        ctx->fs.wrsect = wrsect_null;
+        ctx->fs.priv = &ctx->priv;
+        acorn_fs_adfs_mapinit(ctx->map, 20480, 16);
+        unsigned char *sizes = ctx->map + 0x100;
+        for (unsigned i = 0; i < size; i++) {
+            adfs_put24(ctx->map + i * 3, 16 + 4 * i);
+            adfs_put24(sizes + i * 3, i == size - 1 ? 10000 : 1);
+        }
+        ctx->map[0x1fe] = size * 3;
+        ctx->hole = 16 + 4 * (size - 1) - 2;
+        ctx->priv.map_valid = true;
+    }
+    return ctx;
+}
+
+static unsigned long alloc_run(void *vctx, unsigned long iters)
+{
+    map_ctx *ctx = vctx;
+    for (unsigned long i = 0; i < iters; i++) {
+        acorn_fs_object obj;
+        obj.length = sizeof(ctx->data);
+        obj.data = ctx->data;
+        obj.sector = 0;
+        memcpy(ctx->priv.fsmap, ctx->map, FSMAP_SIZE);
+        micro_sink += alloc_write(&ctx->fs, &obj, NULL) + obj.sector;
+    }
+    return iters;
+}
+
+static unsigned long free_run(void *vctx, unsigned long iters)
+{
+    map_ctx *ctx = vctx;
+    for (unsigned long i = 0; i < iters; i++) {
+        acorn_fs_object obj;
+        obj.length = sizeof(ctx->data);
+        obj.sector = ctx->hole;
+        memcpy(ctx->priv.fsmap, ctx->map, FSMAP_SIZE);
+        micro_sink += map_free(&ctx->fs, &obj);
+    }
+    return iters;
+}
+
+/*
+ * A scratch image with the files spread over subdirectories of the
+ * root, forty to a directory.  The directories stay in the cache so
+ * the walk measures the checks and the extent list, not the reads.
+ */
+
+#define CHECK_SECTS  4096
+#define CHECK_PER_DIR  40
+
+typedef struct {
+    acorn_fs *fs;
+    FILE *mfp;
+    unsigned entries;
+} check_bench;
+
+static const unsigned check_sizes[] = { 40, 400, 1880, 0 };
+
+static acorn_fs *check_image(void)
+{
+    unsigned char data[2 * ACORN_FS_SECT_SIZE + ACORN_FS_ADFS_DIR_SIZE];
+    acorn_fs_adfs_mapinit(data, CHECK_SECTS, 7);
+    acorn_fs_adfs_dirinit(data + 2 * ACORN_FS_SECT_SIZE, "$", "Micro", 2);
+    char *name = micro_tmpname(".adf");
+    if (!name)
+        return NULL;
+    acorn_fs *fs = NULL;
+    FILE *fp = fopen(name, "wb");
+    if (fp) {
+        bool ok = fwrite(data, sizeof(data), 1, fp) == 1 && !fflush(fp)
+            && !ftruncate(fileno(fp), CHECK_SECTS * ACORN_FS_SECT_SIZE);
+        if (!fclose(fp) && ok)
+            fs = acorn_fs_open(name, true);
+    }
+    unlink(name);
+    free(name);
+    return fs;
+}
+
+static void *check_setup(unsigned size)
+{
+    check_bench *ctx = malloc(sizeof(check_bench));
+    if (!ctx)
+        return NULL;
+    if (!(ctx->mfp = fopen("/dev/null", "w"))) {
+        free(ctx);
+        return NULL;
+    }
+    if (!(ctx->fs = check_image())) {
+        fclose(ctx->mfp);
+        free(ctx);
+        return NULL;
+    }
+    acorn_fs *fs = ctx->fs;
+    fs->deferred = true;
+    unsigned char contents[ACORN_FS_SECT_SIZE];
+    memset(contents, 0xe5, sizeof(contents));
+    int status = AFS_OK;
+    acorn_fs_object dir;
+    for (unsigned i = 0; i < size && status == AFS_OK; i++) {
+        acorn_fs_object obj, dest;
+        if (i % CHECK_PER_DIR == 0) {
+            make_root(&dest);
+            snprintf(dir.name, sizeof(dir.name), "D%02u", i / CHECK_PER_DIR);
+            if ((status = fs->mkdir(fs, &dir, &dest)) != AFS_OK)
+                break;
+        }
+        snprintf(obj.name, sizeof(obj.name), "F%04u", i);
+        obj.load_addr = obj.exec_addr = 0x1900;
+        obj.length = sizeof(contents);
+        obj.attr = AFS_ATTR_UREAD | AFS_ATTR_UWRITE;
+        obj.data = contents;
+        dest = dir;
+        status = fs->save(fs, &obj, &dest, false);
+    }
+    if (status == AFS_OK)
+        status = acorn_fs_sync(fs);
+    if (status != AFS_OK) {
+        fprintf(stderr, "micro: check_walk: %s\n", acorn_fs_strerr(status));
+        acorn_fs_close(fs);
+        fclose(ctx->mfp);
+        free(ctx);
+        return NULL;
+    }
+    ctx->entries = size + (size + CHECK_PER_DIR - 1) / CHECK_PER_DIR;
+    return ctx;
+}
+
+static void check_teardown(void *vctx)
+{
+    check_bench *ctx = vctx;
+    acorn_fs_close(ctx->fs);
+    fclose(ctx->mfp);
+    free(ctx);
+}
+
+static unsigned long check_run(void *vctx, unsigned long iters)
+{
+    check_bench *bench = vctx;
+    for (unsigned long i = 0; i < iters; i++) {
+        check_ctx ctx;
+        acorn_fs_object root;
+        char path[] = "$";
+        make_root(&root);
+        ctx.fs = bench->fs;
+        ctx.fsname = "micro";
+        ctx.head = ctx.tail = NULL;
+        ctx.mfp = bench->mfp;
+        micro_sink += check_walk(&ctx, &root, &root, path, 1);
+        extent *ext = ctx.head;
+        while (ext) {
+            extent *next = ext->next;
+            free_ext(ext);
+            ext = next;
+        }
+    }
+    return iters * bench->entries;
+}
+
+const micro_kernel micro_adfs_kernels[] = {
+    { "adfs_wildmat", wild_sizes,   wild_setup,  wild_run,  free,           NULL },
+    { "adfs_ent2obj", dir_sizes,    ent_setup,   ent_run,   free,           NULL },
+    { "checksum",     map_sizes,    sum_setup,   sum_run,   free,           NULL },
+    { "alloc_write",  extent_sizes, map_setup,   alloc_run, free,           NULL },
+    { "map_free",     extent_sizes, map_setup,   free_run,  free,           NULL },
+    { "check_walk",   check_sizes,  check_setup, check_run, check_teardown, NULL },
+    { NULL }
+};
@@ -0,0 +1,86 @@
+#include "acorn-dfs.c"
+#include "micro.h"
+
+/*
+ * DFS kernels: name matching against a catalogue entry and decoding
+ * a whole catalogue.
+ */
+
+static const char *wild_pats[] = { "*", "$.abcdefg", "*.*Z", "#.#*#" };
+
+#define NPATS (sizeof(wild_pats) / sizeof(wild_pats[0]))
+
+typedef struct {
+    unsigned char ent[8];
+    char pats[NPATS][10];
+} wild_ctx;
+
+static const unsigned wild_sizes[] = { 1, 4, 7, 0 };
+
+static void *wild_setup(unsigned size)
+{
+    wild_ctx *ctx = malloc(sizeof(wild_ctx));
+    if (ctx) {
+        memset(ctx->ent, ' ', 7);
+        memcpy(ctx->ent, "ABCDEFG", size);
+        ctx->ent[7] = '$';
+        for (unsigned p = 0; p < NPATS; p++) {
+            strcpy(ctx->pats[p], wild_pats[p]);
+            if (p == 1)
+                ctx->pats[p][size + 2] = 0; // exact match at this length.
+        }
+    }
+    return ctx;
+}
+
+static unsigned long wild_run(void *vctx, unsigned long iters)
+{
+    wild_ctx *ctx = vctx;
+    for (unsigned long i = 0; i < iters; i++)
+        for (unsigned p = 0; p < NPATS; p++)
+            micro_sink += dfs_wildmat(ctx->pats[p], ctx->ent);
+    return iters * NPATS;
+}
+
+static const unsigned cat_sizes[] = { 1, 16, 31, 0 };
+
+static void *cat_setup(unsigned size)
+{
+    unsigned char *cat = calloc(1, 2 * ACORN_FS_SECT_SIZE);
+    if (cat) {
+        for (unsigned i = 0; i < size; i++) {
+            acorn_fs_object obj;
+            char name[8];
+            snprintf(name, sizeof(name), "F%03u", i % 1000);
+            obj.load_addr = 0xffff1900;
+            obj.exec_addr = 0xffff8023;
+            obj.length = i * 300;
+            obj.attr = AFS_ATTR_UREAD | AFS_ATTR_UWRITE;
+            obj2ent(&obj, name, '$', 2 + i * 2, cat + 8 + i * 8);
+        }
+        cat[0x105] = size * 8;
+    }
+    return cat;
+}
+
+static unsigned long cat_run(void *vctx, unsigned long iters)
+{
+    unsigned char *cat = vctx;
+    unsigned char *end = cat + 8 + cat[0x105];
+    unsigned long ops = 0;
+    for (unsigned long i = 0; i < iters; i++) {
+        for (unsigned char *ent = cat + 8; ent < end; ent += 8) {
+            acorn_fs_object obj;
+            ent2obj(ent, &obj);
+            micro_sink += obj.length + obj.sector;
+            ops++;
+        }
+    }
+    return ops;
+}
+
+const micro_kernel micro_dfs_kernels[] = {
+    { "dfs_wildmat", wild_sizes, wild_setup, wild_run, free, NULL },
+    { "dfs_ent2obj", cat_sizes,  cat_setup,  cat_run,  free, NULL },
+    { NULL }
+};
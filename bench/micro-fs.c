@@ -0,0 +1,108 @@
+#include "acorn-fs.c"
+#include "micro.h"
+
+/*
+ * Sector access kernels: the byte lane packing of IDE images and the
+ * track mapping of interleaved floppy images, run against a scratch
+ * file through the same stdio stream the library uses.
+ */
+
+#define ILEAVE_SECTS (160 * 16)
+
+typedef struct {
+    acorn_fs *fs;
+    int (*op)(acorn_fs *fs, int ssect, unsigned char *buf, unsigned size);
+    int ssect;
+    unsigned size;
+    unsigned char buf[];
+} sect_ctx;
+
+static const unsigned sect_sizes[] = { 256, 1280, 16384, 65536, 0 };
+
+static void *sect_setup(unsigned size, off_t file_size, int ssect, int (*op)(acorn_fs *, int, unsigned char *, unsigned))
+{
+    sect_ctx *ctx = malloc(sizeof(sect_ctx) + size);
+    if (!ctx)
+        return NULL;
+    char *name = micro_tmpname(".img");
+    acorn_fs *fs = calloc(1, sizeof(acorn_fs));
+    if (name && fs && (fs->fp = fopen(name, "w+b"))) {
+        unlink(name);
+        free(name);
+        if (!ftruncate(fileno(fs->fp), file_size)) {
+            for (unsigned i = 0; i < size; i++)
+                ctx->buf[i] = i * 7;
+            ctx->fs = fs;
+            ctx->op = op;
+            ctx->ssect = ssect;
+            ctx->size = size;
+            return ctx;
+        }
+        fclose(fs->fp);
+    }
+    else if (name) {
+        unlink(name);
+        free(name);
+    }
+    free(fs);
+    free(ctx);
+    return NULL;
+}
+
+static void sect_teardown(void *vctx)
+{
+    sect_ctx *ctx = vctx;
+    fclose(ctx->fs->fp);
+    free(ctx->fs);
+    free(ctx);
+}
+
+static unsigned long sect_run(void *vctx, unsigned long iters)
+{
+    sect_ctx *ctx = vctx;
+    for (unsigned long i = 0; i < iters; i++)
+        micro_sink += ctx->op(ctx->fs, ctx->ssect, ctx->buf, ctx->size);
+    return iters;
+}
+
+static unsigned sect_bytes(unsigned size)
+{
+    return size;
+}
+
+static void *ide_rd_setup(unsigned size)
+{
+    return sect_setup(size, 2 * (off_t)size, 0, rdsect_ide);
+}
+
+static void *ide_wr_setup(unsigned size)
+{
+    return sect_setup(size, 2 * (off_t)size, 0, wrsect_ide);
+}
+
+// Start just before the change of side at track 80 so larger
+// transfers cover both halves of the mapping.
+
+static void *il16_rd_setup(unsigned size)
+{
+    return sect_setup(size, ILEAVE_SECTS * ACORN_FS_SECT_SIZE, 80 * 16 - 8, rdsect_ileave16);
+}
+
+static void *il16_wr_setup(unsigned size)
+{
+    return sect_setup(size, ILEAVE_SECTS * ACORN_FS_SECT_SIZE, 80 * 16 - 8, wrsect_ileave16);
+}
+
+static void *il10_rd_setup(unsigned size)
+{
+    return sect_setup(size, ILEAVE_SECTS * ACORN_FS_SECT_SIZE, 80 * 10 - 5, rdsect_ileave10);
+}
+
+const micro_kernel micro_fs_kernels[] = {
+    { "rdsect_ide",      sect_sizes, ide_rd_setup,  sect_run, sect_teardown, sect_bytes },
+    { "wrsect_ide",      sect_sizes, ide_wr_setup,  sect_run, sect_teardown, sect_bytes },
+    { "rdsect_ileave16", sect_sizes, il16_rd_setup, sect_run, sect_teardown, sect_bytes },
+    { "wrsect_ileave16", sect_sizes, il16_wr_setup, sect_run, sect_teardown, sect_bytes },
+    { "rdsect_ileave10", sect_sizes, il10_rd_setup, sect_run, sect_teardown, sect_bytes },
+    { NULL }
+};
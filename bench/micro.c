@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include "micro.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Micro-benchmarks for the library's inner loops.  The kernels are
+ * static so each group is compiled in the same translation unit as
+ * the library source it measures.  Allocations are counted by
+ * wrapping malloc, calloc and realloc at link time.
+ */
+
+volatile unsigned long micro_sink;
+
+static unsigned long allocs;
+
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *micro_tmpname(const char *ext)
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir)
+        dir = "/tmp";
+    char *name;
+    if (asprintf(&name, "%s/micro-XXXXXX%s", dir, ext) < 0)
+        return NULL;
+    int fd = mkstemps(name, strlen(ext));
+    if (fd < 0) {
+        free(name);
+        return NULL;
+    }
+    close(fd);
+    return name;
+}
+
+static const micro_kernel *groups[] = {
+    micro_fs_kernels,
+    micro_adfs_kernels,
+    micro_dfs_kernels
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    double ns;
+    double allocs;
+} result;
+
+static result measure(const micro_kernel *k, void *ctx, double target, unsigned repeats)
+{
+    // Find an iteration count that takes about the target time.
+    unsigned long iters = 1;
+    for (;;) {
+        double t0 = now();
+        k->run(ctx, iters);
+        double secs = now() - t0;
+        if (secs >= target || iters >= 1UL << 40)
+            break;
+        if (secs < target / 100)
+            iters *= 10;
+        else
+            iters = iters * (target / secs) + 1;
+    }
+    result best = { 0, 0 };
+    for (unsigned r = 0; r < repeats; r++) {
+        unsigned long a0 = allocs;
+        double t0 = now();
+        unsigned long ops = k->run(ctx, iters);
+        double secs = now() - t0;
+        unsigned long a1 = allocs;
+        double ns = secs * 1e9 / ops;
+        if (!r || ns < best.ns) {
+            best.ns = ns;
+            best.allocs = (double)(a1 - a0) / ops;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    double target = 0.2;
+    unsigned repeats = 3;
+    const char *pattern = NULL, *json = NULL;
+    while ((opt = getopt(argc, argv, "t:r:o:")) != -1) {
+        switch (opt) {
+            case 't':
+                target = strtod(optarg, NULL) / 1000;
+                break;
+            case 'r':
+                repeats = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                json = optarg;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind > 1 || !repeats) {
+        fputs("Usage: micro [ -t <ms> ] [ -r <repeats> ] [ -o <json-file> ] [ <kernel-pattern> ]\n", stderr);
+        return 1;
+    }
+    if (optind < argc)
+        pattern = argv[optind];
+
+    FILE *jfp = NULL;
+    if (json && !(jfp = fopen(json, "w"))) {
+        fprintf(stderr, "micro: %s: %s\n", json, strerror(errno));
+        return 2;
+    }
+    if (jfp)
+        fputs("{\"results\":[\n", jfp);
+
+    int status = 0;
+    bool first = true;
+    printf("%-20s %8s %12s %10s %10s\n", "kernel", "size", "ns/op", "allocs/op", "MB/s");
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        for (const micro_kernel *k = groups[g]; k->name; k++) {
+            if (pattern && fnmatch(pattern, k->name, 0))
+                continue;
+            for (const unsigned *size = k->sizes; *size; size++) {
+                void *ctx = k->setup(*size);
+                if (!ctx) {
+                    fprintf(stderr, "micro: %s/%u: setup failed: %s\n", k->name, *size, strerror(errno));
+                    status++;
+                    continue;
+                }
+                result res = measure(k, ctx, target, repeats);
+                k->teardown(ctx);
+                double mbs = 0;
+                if (k->bytes)
+                    mbs = k->bytes(*size) / res.ns * 1e3;
+                printf("%-20s %8u %12.1f %10.2f", k->name, *size, res.ns, res.allocs);
+                if (mbs)
+                    printf(" %10.1f", mbs);
+                putchar('\n');
+                if (jfp) {
+                    fprintf(jfp, "%s{\"kernel\":\"%s\",\"size\":%u,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f,\"mb_per_sec\":%.1f}",
+                            first ? "" : ",\n", k->name, *size, res.ns, res.allocs, mbs);
+                    first = false;
+                }
+            }
+        }
+    }
+    if (jfp) {
+        fputs("\n]}\n", jfp);
+        if (fclose(jfp)) {
+            fprintf(stderr, "micro: %s: %s\n", json, strerror(errno));
+            status++;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,33 @@
+#ifndef MICRO_INC
+#define MICRO_INC
+
+#include <stddef.h>
+
+/*
+ * A kernel is set up once for each size, outside the timed region,
+ * and then run for a number of iterations.  run returns the number
+ * of operations performed so the time and allocations can be divided
+ * out per operation.  bytes, if not zero, is the number of bytes
+ * moved by each operation and is used to report a transfer rate.
+ */
+
+typedef struct {
+    const char *name;
+    const unsigned *sizes; // zero terminated.
+    void *(*setup)(unsigned size);
+    unsigned long (*run)(void *ctx, unsigned long iters);
+    void (*teardown)(void *ctx);
+    unsigned (*bytes)(unsigned size);
+} micro_kernel;
+
+extern const micro_kernel micro_fs_kernels[];
+extern const micro_kernel micro_adfs_kernels[];
+extern const micro_kernel micro_dfs_kernels[];
+
+// Keeps results live so the compiler cannot remove the work.
+extern volatile unsigned long micro_sink;
+
+// Scratch image files, unlinked once opened.
+extern char *micro_tmpname(const char *ext);
+
+#endif
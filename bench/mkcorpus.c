@@ -0,0 +1,267 @@
+#include "acorn-fs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * Generate a synthetic image for benchmarking.  A blank image of the
+ * chosen type is formatted and then filled through the library with a
+ * tree of directories and files of pseudo-random size and content.
+ * Fragmentation is produced by saving filler files among the real
+ * ones and removing them again at the end, leaving holes in the free
+ * space between the files.  The same seed gives the same image.
+ */
+
+#define MAX_DIRS 1024
+
+enum { TYPE_ADF, TYPE_ADL, TYPE_IDE, TYPE_SSD, TYPE_DSD };
+
+static const struct {
+    const char *ext;
+    unsigned   sectors;
+} types[] = {
+    { ".adf",  1280 },
+    { ".adl",  2560 },
+    { ".ide", 40960 },
+    { ".ssd",   800 },
+    { ".dsd",   800 }
+};
+
+typedef struct {
+    acorn_fs_object obj;
+    char            path[ACORN_FS_MAX_PATH];
+} dir_ent;
+
+typedef struct {
+    char            name[ACORN_FS_MAX_NAME+1];
+    unsigned        dir;
+} filler;
+
+static uint64_t rng_state;
+
+static uint32_t rng(void)
+{
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    rng_state = x;
+    return x >> 32;
+}
+
+static unsigned rng_range(unsigned lo, unsigned hi)
+{
+    return lo + rng() % (hi - lo + 1);
+}
+
+static int write_blank(const char *fn, const unsigned char *data, size_t len, size_t size, bool ide)
+{
+    int status = AFS_OK;
+    FILE *fp = fopen(fn, "wb");
+    if (!fp)
+        return errno;
+    for (size_t i = 0; i < len && status == AFS_OK; i++) {
+        if (putc(data[i], fp) == EOF || (ide && putc(0, fp) == EOF))
+            status = errno;
+    }
+    if (status == AFS_OK && (fflush(fp) || ftruncate(fileno(fp), size * (ide ? 2 : 1))))
+        status = errno;
+    if (fclose(fp) && status == AFS_OK)
+        status = errno;
+    return status;
+}
+
+static int format(const char *fn, int type, unsigned sectors)
+{
+    unsigned char data[7 * ACORN_FS_SECT_SIZE];
+    memset(data, 0, sizeof(data));
+    if (type == TYPE_SSD || type == TYPE_DSD) {
+        memcpy(data, "CORPUS  ", 8);
+        data[0x106] = (sectors >> 8) & 0x03;
+        data[0x107] = sectors & 0xff;
+        return write_blank(fn, data, 2 * ACORN_FS_SECT_SIZE, (size_t)sectors * ACORN_FS_SECT_SIZE * (type == TYPE_DSD ? 2 : 1), false);
+    }
+    // Sectors 0 to 15 are the first track, even when interleaved.
+    acorn_fs_adfs_mapinit(data, sectors, 7);
+    acorn_fs_adfs_dirinit(data + 2 * ACORN_FS_SECT_SIZE, "$", "Corpus", 2);
+    return write_blank(fn, data, sizeof(data), (size_t)sectors * ACORN_FS_SECT_SIZE, type == TYPE_IDE);
+}
+
+static void fill(unsigned char *data, unsigned len)
+{
+    // Runs of random bytes mixed with runs of one repeated byte so
+    // the contents are partly compressible.
+    unsigned i = 0;
+    while (i < len) {
+        unsigned run = rng_range(4, 64);
+        bool repeat = rng() & 1;
+        int ch = rng() & 0xff;
+        while (run-- && i < len)
+            data[i++] = repeat ? ch : rng() & 0xff;
+    }
+}
+
+static int save(acorn_fs *fs, dir_ent *dir, const char *name, unsigned length, unsigned load)
+{
+    acorn_fs_object obj, dest;
+    strcpy(obj.name, name);
+    obj.load_addr = load;
+    obj.exec_addr = load;
+    obj.length = length;
+    obj.attr = AFS_ATTR_UREAD | AFS_ATTR_UWRITE;
+    if (!(obj.data = malloc(length ? length : 1)))
+        return errno;
+    fill(obj.data, length);
+    dest = dir->obj;
+    int status = fs->save(fs, &obj, &dest, false);
+    free(obj.data);
+    return status;
+}
+
+static int make_dirs(acorn_fs *fs, dir_ent *dirs, unsigned depth, unsigned branch, unsigned *ndirs)
+{
+    unsigned first = 0, last = 1;
+    for (unsigned level = 0; level < depth; level++) {
+        for (unsigned d = first; d < last; d++) {
+            for (unsigned b = 0; b < branch && *ndirs < MAX_DIRS; b++) {
+                dir_ent *child = dirs + *ndirs;
+                acorn_fs_object dest = dirs[d].obj;
+                snprintf(child->obj.name, sizeof(child->obj.name), "D%02u", b);
+                int status = fs->mkdir(fs, &child->obj, &dest);
+                if (status != AFS_OK) {
+                    fprintf(stderr, "mkcorpus: %s.%s: %s\n", dirs[d].path, child->obj.name, acorn_fs_strerr(status));
+                    return status;
+                }
+                snprintf(child->path, sizeof(child->path), "%s.%s", dirs[d].path, child->obj.name);
+                (*ndirs)++;
+            }
+        }
+        first = last;
+        last = *ndirs;
+    }
+    return AFS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+    int status, opt, type = -1;
+    unsigned sectors = 0, nfiles = 100, depth = 2, branch = 3, frag = 0;
+    unsigned min_size = 256, max_size = 16384;
+    rng_state = 1;
+    while ((opt = getopt(argc, argv, "t:k:n:d:b:s:f:r:")) != -1) {
+        switch (opt) {
+            case 't':
+                for (type = TYPE_DSD; type >= 0; type--)
+                    if (!strcasecmp(optarg, types[type].ext + 1))
+                        break;
+                if (type < 0)
+                    argc = 0;
+                break;
+            case 'k':
+                sectors = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                nfiles = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                branch = strtoul(optarg, NULL, 0);
+                break;
+            case 's': {
+                char *end;
+                min_size = max_size = strtoul(optarg, &end, 0);
+                if (*end == ':')
+                    max_size = strtoul(end + 1, NULL, 0);
+                break;
+            }
+            case 'f':
+                frag = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                rng_state = strtoull(optarg, NULL, 0) | 1;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (argc - optind != 1 || min_size > max_size) {
+        fputs("Usage: mkcorpus [ -t adf|adl|ide|ssd|dsd ] [ -k <sectors> ] [ -n <files> ] [ -d <depth> ]\n"
+              "                [ -b <branch> ] [ -s <min>[:<max>] ] [ -f <frag-%> ] [ -r <seed> ] <img-file>\n", stderr);
+        return 1;
+    }
+    const char *fn = argv[optind];
+    if (type < 0) {
+        const char *ext = strrchr(fn, '.');
+        for (type = TYPE_DSD; type >= 0; type--)
+            if (ext && !strcasecmp(ext, types[type].ext))
+                break;
+        if (type < 0)
+            type = TYPE_ADF;
+    }
+    if (!sectors)
+        sectors = types[type].sectors;
+    bool dfs = type == TYPE_SSD || type == TYPE_DSD;
+    if ((status = format(fn, type, sectors)) != AFS_OK) {
+        fprintf(stderr, "mkcorpus: %s: %s\n", fn, acorn_fs_strerr(status));
+        return 2;
+    }
+    acorn_fs *fs = acorn_fs_open(fn, true);
+    if (!fs) {
+        fprintf(stderr, "mkcorpus: %s: %s\n", fn, acorn_fs_strerr(errno));
+        return 2;
+    }
+    fs->deferred = true;
+
+    dir_ent *dirs = calloc(MAX_DIRS, sizeof(dir_ent));
+    filler *fillers = calloc(nfiles + 1, sizeof(filler));
+    if (!dirs || !fillers) {
+        fprintf(stderr, "mkcorpus: %s\n", strerror(errno));
+        return 2;
+    }
+    unsigned ndirs = 1, nfill = 0, saved = 0;
+    unsigned long long bytes = 0;
+    fs->find(fs, "$", &dirs[0].obj);
+    strcpy(dirs[0].path, "$");
+    if (!dfs && (status = make_dirs(fs, dirs, depth, branch, &ndirs)) != AFS_OK)
+        return 3;
+
+    for (unsigned i = 0; i < nfiles; i++) {
+        char name[ACORN_FS_MAX_NAME+1];
+        unsigned length = rng_range(min_size, max_size);
+        unsigned d = i % ndirs;
+        if (frag && rng() % 100 < frag) {
+            filler *f = fillers + nfill;
+            snprintf(f->name, sizeof(f->name), dfs ? "Z%03u" : "Z%04u", nfill);
+            f->dir = d;
+            if (save(fs, dirs + d, f->name, rng_range(1, 8) * ACORN_FS_SECT_SIZE, 0) == AFS_OK)
+                nfill++;
+        }
+        snprintf(name, sizeof(name), dfs ? "F%03u" : "F%04u", i);
+        status = save(fs, dirs + d, name, length, 0x1900 + (i & 0xff) * 0x100);
+        if (status != AFS_OK) {
+            fprintf(stderr, "mkcorpus: %s.%s: %s\n", dirs[d].path, name, acorn_fs_strerr(status));
+            break;
+        }
+        saved++;
+        bytes += length;
+    }
+    for (unsigned i = 0; i < nfill; i++) {
+        acorn_fs_object dest = dirs[fillers[i].dir].obj;
+        int rstat = fs->remove(fs, &dest, fillers[i].name);
+        if (rstat != AFS_OK)
+            fprintf(stderr, "mkcorpus: %s.%s: %s\n", dirs[fillers[i].dir].path, fillers[i].name, acorn_fs_strerr(rstat));
+    }
+    int sstat = acorn_fs_sync(fs);
+    if (sstat != AFS_OK) {
+        fprintf(stderr, "mkcorpus: %s: %s\n", fn, acorn_fs_strerr(sstat));
+        status = sstat;
+    }
+    acorn_fs_close_all();
+    printf("%s: %u files, %llu bytes, %u directories, %u fillers removed\n", fn, saved, bytes, ndirs, nfill);
+    free(fillers);
+    free(dirs);
+    return status == AFS_OK ? 0 : 3;
+}